@@ -40,7 +40,6 @@ int main(int argc, char *argv[])
 		current_game = pgn.game;
 	} else {
 		current_game = new_game();
-		current_game->board = malloc(sizeof(Board));
 
 		bool success = from_fen(current_game->board, start_board_fen);
 		// This is a fixed string, it should never fail to be parsed
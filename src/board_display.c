@@ -99,6 +99,8 @@ gboolean board_draw_callback(GtkWidget *widget, cairo_t *cr, gpointer data)
 	uint padding = leftover_space / 2;
 	cairo_translate(cr, padding, padding);
 
+	Board *board = game_board(current_game);
+
 	// Color light squares one-by-one
 	cairo_set_line_width(cr, 0);
 	for (uint file = 0; file < BOARD_SIZE; file++) {
@@ -136,7 +138,7 @@ gboolean board_draw_callback(GtkWidget *widget, cairo_t *cr, gpointer data)
 
 			// Draw the piece, if there is one
 			Piece p;
-			if ((p = PIECE_AT(current_game->board, x, y)) != EMPTY &&
+			if ((p = PIECE_AT(board, x, y)) != EMPTY &&
 					(drag_source == NULL_SQUARE || SQUARE(x, y) != drag_source)) {
 				draw_piece(cr, p, square_size);
 			}
@@ -151,7 +153,7 @@ gboolean board_draw_callback(GtkWidget *widget, cairo_t *cr, gpointer data)
 		cairo_identity_matrix(cr);
 		cairo_translate(cr, padding + mouse_x - square_size / 2,
 				padding + mouse_y - square_size / 2);
-		draw_piece(cr, PIECE_AT_SQUARE(current_game->board, drag_source), square_size);
+		draw_piece(cr, PIECE_AT_SQUARE(board, drag_source), square_size);
 	}
 
 	return FALSE;
@@ -182,7 +184,7 @@ gboolean board_mouse_down_callback(GtkWidget *widget, GdkEvent *event,
 		return FALSE;
 
 	Square clicked_square = board_coords_to_square(widget, e->x, e->y);
-	if (PIECE_AT_SQUARE(current_game->board, clicked_square) != EMPTY) {
+	if (PIECE_AT_SQUARE(game_board(current_game), clicked_square) != EMPTY) {
 		drag_source = clicked_square;
 	}
 
@@ -200,14 +202,19 @@ gboolean board_mouse_up_callback(GtkWidget *widget, GdkEvent *event,
 		return FALSE;
 
 	Square drag_target = board_coords_to_square(widget, e->x, e->y);
-	Move m = MOVE(drag_source, drag_target);
-	if (legal_move(current_game->board, m, true)) {
+	Board *board = game_board(current_game);
+	Move_list moves;
+	generate_legal_moves(board, &moves);
+
+	// TODO: Let the user choose what to promote to
+	Move m = find_legal_move(&moves, drag_source, drag_target, EMPTY);
+	if (m != NULL_MOVE) {
 		char notation[MAX_ALGEBRAIC_NOTATION_LENGTH];
-		algebraic_notation_for(current_game->board, m, notation);
+		algebraic_notation_for(board, m, notation);
 
 		// TODO: Stop printing this when we have a proper move list GUI
-		if (current_game->board->turn == WHITE)
-			printf("%d. %s\n", current_game->board->move_number, notation);
+		if (board->turn == WHITE)
+			printf("%d. %s\n", board->move_number, notation);
 		else
 			printf(" ..%s\n", notation);
 
@@ -330,6 +337,8 @@ void open_pgn_callback(GtkMenuItem *menu_item, gpointer user_data)
 	GtkFileFilter *just_pgns = gtk_file_filter_new();
 	gtk_file_filter_set_name(just_pgns, "PGN files");
 	gtk_file_filter_add_pattern(just_pgns, "*.pgn");
+	gtk_file_filter_add_pattern(just_pgns, "*.pgn.gz");
+	gtk_file_filter_add_pattern(just_pgns, "*.pgn.zst");
 	gtk_file_chooser_add_filter(chooser, just_pgns);
 
 	GtkFileFilter *all_files = gtk_file_filter_new();
@@ -352,6 +361,9 @@ void open_pgn_callback(GtkMenuItem *menu_item, gpointer user_data)
 			return;
 		}
 
+		// We only need the game itself, and the old one is going away
+		free(pgn.tags);
+		free_game(current_game);
 		current_game = pgn.game;
 
 		gtk_widget_queue_draw(board_display);
@@ -0,0 +1,58 @@
+#include <stdlib.h>
+#include "arena.h"
+
+// Everything handed out is aligned to this, which is enough for any of the
+// types we put in arenas.
+#define ARENA_ALIGNMENT 16
+#define ALIGN(n) (((n) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+// The block header is padded so that the data after it is aligned too.
+#define BLOCK_HEADER_SIZE ALIGN(sizeof(Arena_block))
+#define BLOCK_DATA(b) ((char *)(b) + BLOCK_HEADER_SIZE)
+
+// Blocks double in size each time, up to this.
+#define MAX_BLOCK_SIZE (1 << 20)
+
+void arena_init(Arena *arena, size_t first_block_size)
+{
+	arena->blocks = NULL;
+	arena->next_block_size = ALIGN(first_block_size);
+}
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+	size = ALIGN(size);
+
+	Arena_block *block = arena->blocks;
+	if (block == NULL || block->size - block->used < size) {
+		size_t block_size = arena->next_block_size;
+		if (block_size < size)
+			block_size = size;
+
+		block = malloc(BLOCK_HEADER_SIZE + block_size);
+		block->next = arena->blocks;
+		block->size = block_size;
+		block->used = 0;
+		arena->blocks = block;
+
+		if (arena->next_block_size < MAX_BLOCK_SIZE)
+			arena->next_block_size *= 2;
+	}
+
+	void *ret = BLOCK_DATA(block) + block->used;
+	block->used += size;
+
+	return ret;
+}
+
+void arena_free(Arena *arena)
+{
+	Arena_block *block = arena->blocks;
+	while (block != NULL) {
+		Arena_block *next = block->next;
+		free(block);
+		block = next;
+	}
+
+	arena->blocks = NULL;
+}
@@ -0,0 +1,29 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+// An arena hands out memory by bumping a pointer through large blocks, and
+// frees it all at once. This is much cheaper than malloc and free when lots
+// of small objects all live exactly as long as each other, and keeps objects
+// allocated one after another next to each other in memory.
+
+typedef struct Arena_block
+{
+	struct Arena_block *next;
+	size_t size;
+	size_t used;
+} Arena_block;
+
+typedef struct Arena
+{
+	// The block currently being allocated from, which links to the older ones
+	Arena_block *blocks;
+	size_t next_block_size;
+} Arena;
+
+void arena_init(Arena *arena, size_t first_block_size);
+void *arena_alloc(Arena *arena, size_t size);
+void arena_free(Arena *arena);
+
+#endif // include guard
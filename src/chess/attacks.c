@@ -0,0 +1,154 @@
+#include <stdbool.h>
+#include "attacks.h"
+#include "bitboard.h"
+#include "board.h"
+
+#define SQUARES (BOARD_SIZE * BOARD_SIZE)
+
+Bitboard pawn_attack_table[PLAYERS][SQUARES];
+Bitboard knight_attack_table[SQUARES];
+Bitboard king_attack_table[SQUARES];
+Bitboard between_table[SQUARES][SQUARES];
+Bitboard line_table[SQUARES][SQUARES];
+
+// Rays going out from each square in each direction, not including the
+// square itself. The first four directions go towards higher indices, and
+// the last four towards lower indices. This matters for finding the first
+// blocker along a ray.
+typedef enum Direction
+{
+	NORTH, NORTH_EAST, EAST, NORTH_WEST,
+	SOUTH, SOUTH_WEST, WEST, SOUTH_EAST,
+} Direction;
+
+#define DIRECTIONS 8
+#define POSITIVE_DIRECTION(d) ((d) < SOUTH)
+
+static const int direction_dx[DIRECTIONS] = { 0,  1,  1, -1,  0, -1, -1, 1 };
+static const int direction_dy[DIRECTIONS] = { 1,  1,  0,  1, -1, -1,  0, -1 };
+
+static Bitboard ray_table[DIRECTIONS][SQUARES];
+
+static bool on_board(int x, int y)
+{
+	return x >= 0 && x < BOARD_SIZE && y >= 0 && y < BOARD_SIZE;
+}
+
+// Sets the bit for (x, y) in *b, if that's a real square.
+static void add_square(Bitboard *b, int x, int y)
+{
+	if (on_board(x, y))
+		*b |= BIT(y * BOARD_SIZE + x);
+}
+
+void init_attack_tables(void)
+{
+	static bool initialized = false;
+	if (initialized)
+		return;
+
+	static const int knight_dx[] = { 1, 2, 2, 1, -1, -2, -2, -1 };
+	static const int knight_dy[] = { 2, 1, -1, -2, -2, -1, 1, 2 };
+
+	for (int i = 0; i < SQUARES; i++) {
+		int x = i % BOARD_SIZE;
+		int y = i / BOARD_SIZE;
+
+		add_square(&pawn_attack_table[WHITE][i], x - 1, y + 1);
+		add_square(&pawn_attack_table[WHITE][i], x + 1, y + 1);
+		add_square(&pawn_attack_table[BLACK][i], x - 1, y - 1);
+		add_square(&pawn_attack_table[BLACK][i], x + 1, y - 1);
+
+		for (uint n = 0; n < 8; n++)
+			add_square(&knight_attack_table[i], x + knight_dx[n], y + knight_dy[n]);
+
+		for (uint d = 0; d < DIRECTIONS; d++) {
+			int dx = direction_dx[d];
+			int dy = direction_dy[d];
+
+			add_square(&king_attack_table[i], x + dx, y + dy);
+
+			Bitboard ray = EMPTY_BITBOARD;
+			for (int tx = x + dx, ty = y + dy; on_board(tx, ty);
+					tx += dx, ty += dy) {
+				uint j = ty * BOARD_SIZE + tx;
+
+				between_table[i][j] = ray;
+				ray |= BIT(j);
+			}
+
+			ray_table[d][i] = ray;
+		}
+	}
+
+	// Lines can only be filled in once all the rays are done
+	for (int i = 0; i < SQUARES; i++) {
+		for (uint d = 0; d < DIRECTIONS / 2; d++) {
+			// Directions d and d + 4 are opposites
+			Bitboard line = ray_table[d][i] | ray_table[d + 4][i] | BIT(i);
+
+			Bitboard ray = ray_table[d][i] | ray_table[d + 4][i];
+			while (ray != EMPTY_BITBOARD)
+				line_table[i][POP_LSB(ray)] = line;
+		}
+	}
+
+	initialized = true;
+}
+
+static Bitboard ray_attacks(Direction d, uint i, Bitboard occupied)
+{
+	Bitboard attacks = ray_table[d][i];
+	Bitboard blockers = attacks & occupied;
+
+	if (blockers != EMPTY_BITBOARD) {
+		uint first_blocker = POSITIVE_DIRECTION(d) ?
+			LSB_INDEX(blockers) :
+			MSB_INDEX(blockers);
+		// Everything beyond the first blocker is hidden behind it
+		attacks ^= ray_table[d][first_blocker];
+	}
+
+	return attacks;
+}
+
+Bitboard bishop_attacks(uint i, Bitboard occupied)
+{
+	return ray_attacks(NORTH_EAST, i, occupied) |
+		ray_attacks(NORTH_WEST, i, occupied) |
+		ray_attacks(SOUTH_EAST, i, occupied) |
+		ray_attacks(SOUTH_WEST, i, occupied);
+}
+
+Bitboard rook_attacks(uint i, Bitboard occupied)
+{
+	return ray_attacks(NORTH, i, occupied) |
+		ray_attacks(EAST, i, occupied) |
+		ray_attacks(SOUTH, i, occupied) |
+		ray_attacks(WEST, i, occupied);
+}
+
+Bitboard queen_attacks(uint i, Bitboard occupied)
+{
+	return bishop_attacks(i, occupied) | rook_attacks(i, occupied);
+}
+
+Bitboard attackers_of(Board *board, uint i, Player attacker, Bitboard occupied)
+{
+	Bitboard diagonal_sliders =
+		PIECES_OF(board, attacker, BISHOP) | PIECES_OF(board, attacker, QUEEN);
+	Bitboard straight_sliders =
+		PIECES_OF(board, attacker, ROOK) | PIECES_OF(board, attacker, QUEEN);
+
+	// A pawn of ours on i would attack exactly the squares that their pawns
+	// attack i from, and the same goes for every other piece.
+	Bitboard attackers =
+		(PAWN_ATTACKS(OTHER_PLAYER(attacker), i) & PIECES_OF(board, attacker, PAWN)) |
+		(KNIGHT_ATTACKS(i) & PIECES_OF(board, attacker, KNIGHT)) |
+		(KING_ATTACKS(i) & PIECES_OF(board, attacker, KING)) |
+		(bishop_attacks(i, occupied) & diagonal_sliders) |
+		(rook_attacks(i, occupied) & straight_sliders);
+
+	// Pieces that aren't in occupied have been "removed" by the caller
+	return attackers & occupied;
+}
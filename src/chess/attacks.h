@@ -0,0 +1,47 @@
+#ifndef ATTACKS_H_
+#define ATTACKS_H_
+
+#include "bitboard.h"
+#include "board.h"
+
+// Precomputed tables of which squares each piece attacks from each square.
+// All squares here are indices as given by SQUARE_INDEX.
+//
+// The tables are filled in by init_attack_tables. This is done by from_fen
+// and unpack_board, which every board starts life from, so the tables can be
+// assumed to be ready whenever there's a Board around.
+
+extern Bitboard pawn_attack_table[PLAYERS][BOARD_SIZE * BOARD_SIZE];
+extern Bitboard knight_attack_table[BOARD_SIZE * BOARD_SIZE];
+extern Bitboard king_attack_table[BOARD_SIZE * BOARD_SIZE];
+extern Bitboard between_table[BOARD_SIZE * BOARD_SIZE][BOARD_SIZE * BOARD_SIZE];
+extern Bitboard line_table[BOARD_SIZE * BOARD_SIZE][BOARD_SIZE * BOARD_SIZE];
+
+// The squares a pawn belonging to p on i attacks (not the squares it can
+// move to without capturing).
+#define PAWN_ATTACKS(p, i) (pawn_attack_table[p][i])
+#define KNIGHT_ATTACKS(i)  (knight_attack_table[i])
+#define KING_ATTACKS(i)    (king_attack_table[i])
+
+// The squares strictly between a and b if they share a rank, file or
+// diagonal, otherwise the empty set.
+#define BETWEEN(a, b) (between_table[a][b])
+// The whole rank, file or diagonal that a and b share (including a and b),
+// or the empty set if they don't share one.
+#define LINE(a, b)    (line_table[a][b])
+
+void init_attack_tables(void);
+
+// Sliding pieces are blocked by anything in occupied. The first blocker in
+// each direction is included in the result, as it can be captured (or is
+// defended, if it's one of our own pieces).
+Bitboard bishop_attacks(uint i, Bitboard occupied);
+Bitboard rook_attacks(uint i, Bitboard occupied);
+Bitboard queen_attacks(uint i, Bitboard occupied);
+
+// All pieces belonging to attacker which attack the square i, treating the
+// squares in occupied as the only occupied ones. Passing something other
+// than OCCUPIED(board) is useful to see through a piece that's about to move.
+Bitboard attackers_of(Board *board, uint i, Player attacker, Bitboard occupied);
+
+#endif // include guard
@@ -0,0 +1,43 @@
+#include "bitboard.h"
+#include "misc.h"
+
+#if !defined(__GNUC__)
+uint popcount(Bitboard b)
+{
+	uint n = 0;
+	while (b != 0) {
+		b &= b - 1;
+		n++;
+	}
+
+	return n;
+}
+
+uint lsb_index(Bitboard b)
+{
+	uint i = 0;
+	while ((b & 1) == 0) {
+		b >>= 1;
+		i++;
+	}
+
+	return i;
+}
+
+uint msb_index(Bitboard b)
+{
+	uint i = 0;
+	while (b >>= 1)
+		i++;
+
+	return i;
+}
+#endif
+
+uint lsb_index_pop(Bitboard *b)
+{
+	uint i = LSB_INDEX(*b);
+	*b &= *b - 1;
+
+	return i;
+}
@@ -0,0 +1,34 @@
+#ifndef BITBOARD_H_
+#define BITBOARD_H_
+
+#include <stdint.h>
+#include "misc.h"
+
+// A bitboard is a set of squares, with one bit per square. Bit n corresponds
+// to the square at index n, where squares are indexed rank by rank starting
+// from a1 (see SQUARE_INDEX in board.h). This is the same order that the
+// pieces array in Board uses.
+typedef uint64_t Bitboard;
+
+#define EMPTY_BITBOARD ((Bitboard)0)
+#define BIT(i) ((Bitboard)1 << (i))
+
+#if defined(__GNUC__)
+#define POPCOUNT(b)  ((uint)__builtin_popcountll(b))
+#define LSB_INDEX(b) ((uint)__builtin_ctzll(b))
+#define MSB_INDEX(b) ((uint)(63 - __builtin_clzll(b)))
+#else
+uint popcount(Bitboard b);
+uint lsb_index(Bitboard b);
+uint msb_index(Bitboard b);
+#define POPCOUNT(b)  popcount(b)
+#define LSB_INDEX(b) lsb_index(b)
+#define MSB_INDEX(b) msb_index(b)
+#endif
+
+// Removes the least significant set bit from b and returns its index.
+// b must be non-empty.
+#define POP_LSB(b) (lsb_index_pop(&(b)))
+uint lsb_index_pop(Bitboard *b);
+
+#endif // include guard
@@ -3,22 +3,50 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include "attacks.h"
 #include "board.h"
 #include "misc.h"
 #include "moves.h"
+#include "zobrist.h"
 
 void copy_board(Board *dst, Board *src)
 {
-	dst->turn = src->turn;
-	dst->castling[0] = src->castling[0];
-	dst->castling[1] = src->castling[1];
-	dst->en_passant = src->en_passant;
-	dst->half_move_clock = src->half_move_clock;
-	dst->move_number = src->move_number;
-
-	for (uint x = 0; x < BOARD_SIZE; x++)
-		for (uint y = 0; y < BOARD_SIZE; y++)
-			PIECE_AT(dst, x, y) = PIECE_AT(src, x, y);
+	*dst = *src;
+}
+
+// Empties every square. The rest of the board state is left alone, except
+// for the hash, which is reset to zero and so won't account for it.
+void clear_board(Board *board)
+{
+	for (uint i = 0; i < BOARD_SIZE * BOARD_SIZE; i++)
+		board->pieces[i] = EMPTY;
+
+	for (uint t = 0; t <= PIECE_TYPES; t++)
+		board->by_type[t] = EMPTY_BITBOARD;
+
+	board->by_player[WHITE] = EMPTY_BITBOARD;
+	board->by_player[BLACK] = EMPTY_BITBOARD;
+	board->hash = 0;
+}
+
+void set_piece(Board *board, Square square, Piece p)
+{
+	uint i = SQUARE_INDEX(square);
+	Bitboard bit = BIT(i);
+	Piece old = board->pieces[i];
+
+	if (old != EMPTY) {
+		board->by_type[PIECE_TYPE(old)] &= ~bit;
+		board->by_player[PLAYER(old)] &= ~bit;
+		board->hash ^= PIECE_KEY(old, i);
+	}
+	if (p != EMPTY) {
+		board->by_type[PIECE_TYPE(p)] |= bit;
+		board->by_player[PLAYER(p)] |= bit;
+		board->hash ^= PIECE_KEY(p, i);
+	}
+
+	board->pieces[i] = p;
 }
 
 // Converts a character into a piece, using the standard used in PGN and FEN.
@@ -53,6 +81,33 @@ char char_from_piece(Piece p)
 char *start_board_fen =
 	"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
 
+// The move generator assumes that each side has one king, that there are no
+// pawns on the first or last rank, and that an en passant square is just
+// behind a pawn that's just moved two squares. FEN strings can come from
+// anywhere, like PGN files, so they're checked for all that.
+static bool sensible_position(Board *board)
+{
+	Bitboard back_ranks = 0xFFULL | (0xFFULL << 56);
+	if (POPCOUNT(PIECES_OF(board, WHITE, KING)) != 1 ||
+			POPCOUNT(PIECES_OF(board, BLACK, KING)) != 1 ||
+			(board->by_type[PAWN] & back_ranks) != 0)
+		return false;
+
+	Square ep = board->en_passant;
+	if (ep == NULL_SQUARE)
+		return true;
+
+	// The pawn that just moved belongs to whoever isn't moving now
+	Player moved = OTHER_PLAYER(board->turn);
+	uint y = SQUARE_Y(ep);
+	uint pawn_y = moved == WHITE ? 3 : 4;
+	if (y != (moved == WHITE ? 2u : 5u))
+		return false;
+
+	return PIECE_AT_SQUARE(board, ep) == EMPTY &&
+		PIECE_AT(board, SQUARE_X(ep), pawn_y) == PIECE(moved, PAWN);
+}
+
 // Initializes a Board given a string containing Forsyth-Edwards Notation (FEN)
 // See <http://en.wikipedia.org/wiki/Forsyth%E2%80%93Edwards_Notation> for a
 // description, and <http://kirill-kryukov.com/chess/doc/fen.html> for the spec
@@ -61,21 +116,29 @@ bool from_fen(Board *board, const char *fen_str)
 {
 	uint i = 0;
 
+	init_attack_tables();
+	init_zobrist_keys();
+	clear_board(board);
+
 	for (int y = BOARD_SIZE - 1; y >= 0; y--) {
 		char c;
 		uint x = 0;
 		while ((c = fen_str[i++]) != '/' && c != ' ') {
+			if (c == '\0')
+				return false;
+
 			if (isdigit(c)) {
 				if (c == '0') // "Skip zero files" makes no sense
 					return false;
 
-				for (int n = 0; n < c - '0'; n++)
-					PIECE_AT(board, x + n, y) = EMPTY;
-
 				x += c - '0';
 				continue;
 			} else {
-				PIECE_AT(board, x, y) = piece_from_char(c);
+				Piece p = piece_from_char(c);
+				if (x >= BOARD_SIZE || p == EMPTY)
+					return false;
+
+				set_piece(board, SQUARE(x, y), p);
 			}
 
 			x++;
@@ -114,11 +177,11 @@ bool from_fen(Board *board, const char *fen_str)
 	if (file_char == '-') {
 		board->en_passant = NULL_SQUARE;
 	} else {
-		if (file_char < 'a' || file_char > 'g')
+		if (file_char < 'a' || file_char > 'h')
 			return false;
 
 		char rank_char = fen_str[i++];
-		if (!isdigit(rank_char))
+		if (rank_char < '1' || rank_char > '8')
 			return false;
 
 		board->en_passant = SQUARE(file_char - 'a', rank_char - '1');
@@ -132,8 +195,12 @@ bool from_fen(Board *board, const char *fen_str)
 		return false;
 
 	board->half_move_clock = half_move_clock;
-	while (fen_str[i++] != ' ')
-		;
+	while (fen_str[i] != ' ') {
+		if (fen_str[i] == '\0')
+			return false;
+		i++;
+	}
+	i++;
 
 	uint move_number;
 	if (sscanf(fen_str + i, "%u", &move_number) != 1)
@@ -141,8 +208,10 @@ bool from_fen(Board *board, const char *fen_str)
 
 	board->move_number = move_number;
 
+	board->hash = hash_board(board);
+
 	// TODO: check there's no trailing shit after a valid FEN string?
-	return true;
+	return sensible_position(board);
 }
 
 // For debugging
@@ -163,74 +232,25 @@ void print_board(Board *b)
 	printf("%s to move\n", b->turn == WHITE ? "White" : "Black");
 }
 
-static Square find_piece_looking_at(Board *board, Square square, Player piece_owner)
+// Returns the set of pieces belonging to attacker that attack square. This
+// includes pieces that couldn't actually move there because they're pinned.
+Bitboard attackers_to(Board *board, Square square, Player attacker)
 {
-	// We need to make sure we don't have infinite recursion in legal_move.
-	// This can happen with looking for checks - we need to see if there are
-	// any moves that put us in check to decide if the move is legal, but to
-	// see if we are in check we need to look at all the moves our opponent
-	// can make. And checking those moves will follow the same process.
-	//
-	// However, we don't actually need to see if the moves put us into check in
-	// this case, as it doesn't matter if taking their king puts us in check;
-	// we've already won.
-	bool care_about_check = PIECE_TYPE(PIECE_AT_SQUARE(board, square)) != KING;
-
-	Player initial_turn = board->turn;
-	board->turn = piece_owner;
-
-	Square ret = NULL_SQUARE;
-
-	for (uint y = 0; y < BOARD_SIZE; y++) {
-		for (uint x = 0; x < BOARD_SIZE; x++) {
-			Piece p = PIECE_AT(board, x, y);
-			Square s = SQUARE(x, y);
-			Move m = MOVE(s, square);
-
-			if (PLAYER(p) == piece_owner &&
-					legal_move(board, m, care_about_check)) {
-				ret = s;
-				goto cleanup;
-			}
-		}
-	}
-
-cleanup:
-	board->turn = initial_turn;
-	return ret;
-}
-
-static Square find_attacking_piece(Board *board, Square square, Player attacker)
-{
-	// The easiest way to do this without duplicating logic from legal_move
-	// is to put an enemy piece there and then check if moving there is legal.
-	// This will trigger the logic in legal_move for pawn captures.
-	Piece initial_piece = PIECE_AT_SQUARE(board, square);
-	PIECE_AT_SQUARE(board, square) =
-		PIECE(OTHER_PLAYER(attacker), PAWN);
-
-	Square s = find_piece_looking_at(board, square, attacker);
-
-	PIECE_AT_SQUARE(board, square) = initial_piece;
-
-	return s;
+	return attackers_of(board, SQUARE_INDEX(square), attacker, OCCUPIED(board));
 }
 
-static bool under_attack(Board *board, Square square, Player attacker)
+bool under_attack(Board *board, Square square, Player attacker)
 {
-	return find_attacking_piece(board, square, attacker) != NULL_SQUARE;
+	return attackers_to(board, square, attacker) != EMPTY_BITBOARD;
 }
 
 static Square find_king(Board *board, Player p)
 {
-	Piece king = PIECE(p, KING);
-
-	for (uint y = 0; y < BOARD_SIZE; y++)
-		for (uint x = 0; x < BOARD_SIZE; x++)
-			if (PIECE_AT(board, x, y) == king)
-				return SQUARE(x, y);
+	Bitboard king = PIECES_OF(board, p, KING);
+	if (king == EMPTY_BITBOARD)
+		return NULL_SQUARE;
 
-	return NULL_SQUARE;
+	return INDEX_SQUARE(LSB_INDEX(king));
 }
 
 bool in_check(Board *board, Player p)
@@ -240,89 +260,79 @@ bool in_check(Board *board, Player p)
 	return under_attack(board, king_location, OTHER_PLAYER(p));
 }
 
-// This could be more simply written as "number of legal moves = 0", if the
-// enumeration of all legal moves is implemented at some point.
-// As it is we don't have that, so this is simpler.
 bool checkmate(Board *board, Player p)
 {
 	// We must be in check
 	if (!in_check(board, p))
 		return false;
 
-	Square king_location = find_king(board, p);
-	Player other = OTHER_PLAYER(p);
-	int x = SQUARE_X(king_location);
-	int y = SQUARE_Y(king_location);
-
-	// Can the king move out of check?
-	for (int dx = -1; dx < 2; dx++) {
-		for (int dy = -1; dy < 2; dy++) {
-			if (x + dx < 0 || x + dx >= BOARD_SIZE ||
-					y + dy < 0 || y + dy >= BOARD_SIZE)
-				continue;
-			Move m = MOVE(king_location, SQUARE(x + dx, y + dy));
-			if (legal_move(board, m, true))
-				return false;
-		}
-	}
+	// ...and have no way out of it
+	Player initial_turn = board->turn;
+	board->turn = p;
 
-	// Can the attacking piece be captured?
-	Square attacker = find_attacking_piece(board, king_location, other);
-	if (under_attack(board, attacker, p))
-		return false;
+	Move_list moves;
+	generate_legal_moves(board, &moves);
 
-	// Can we block?
-	Piece_type type = PIECE_TYPE(PIECE_AT_SQUARE(board, attacker));
-	if (type != KNIGHT) {
-		int dx = SQUARE_X(attacker) - x;
-		int dy = SQUARE_Y(attacker) - y;
-
-		int ax = abs(dx);
-		int ay = abs(dy);
-
-		int x_direction = ax == 0 ? 0 : dx / ax;
-		int y_direction = ay == 0 ? 0 : dy / ay;
-
-		uint x = SQUARE_X(king_location) + x_direction;
-		uint y = SQUARE_Y(king_location) + y_direction;
-		while (!(x == SQUARE_X(attacker) &&
-					y == SQUARE_Y(attacker))) {
-			Square blocker = find_piece_looking_at(board, SQUARE(x, y), p);
-			if (blocker != NULL_SQUARE &&
-					PIECE_TYPE(PIECE_AT_SQUARE(board, blocker)) != KING)
-				return false;
+	board->turn = initial_turn;
 
-			x += x_direction;
-			y += y_direction;
-		}
-	}
+	return moves.count == 0;
+}
+
+#define LIGHT_SQUARES ((Bitboard)0x55AA55AA55AA55AAull)
+
+// Whether neither player has enough material left to checkmate. That's the
+// case with only kings and at most one minor piece, or only kings and
+// bishops that are all on the same color squares.
+bool insufficient_material(Board *board)
+{
+	if ((board->by_type[PAWN] | board->by_type[ROOK] | board->by_type[QUEEN])
+			!= EMPTY_BITBOARD)
+		return false;
+
+	Bitboard knights = board->by_type[KNIGHT];
+	Bitboard bishops = board->by_type[BISHOP];
+	if (POPCOUNT(knights | bishops) <= 1)
+		return true;
 
-	// All outta luck
-	return true;
+	return knights == EMPTY_BITBOARD &&
+		((bishops & LIGHT_SQUARES) == EMPTY_BITBOARD ||
+		 (bishops & ~LIGHT_SQUARES) == EMPTY_BITBOARD);
 }
 
+// The king and rook must not have moved, the squares between them must be
+// empty, and the king can't be in check or pass through or land on an
+// attacked square.
 bool can_castle_kingside(Board *board, Player p)
 {
 	uint y = p == WHITE ? 0 : BOARD_SIZE - 1;
 	Player other = OTHER_PLAYER(p);
-
-	return board->castling[p].kingside && !in_check(board, p) &&
-		PIECE_AT(board, 5, y) == EMPTY &&
-		PIECE_AT(board, 6, y) == EMPTY &&
-		!under_attack(board, SQUARE(5, y), other) &&
-		!under_attack(board, SQUARE(6, y), other);
+	Bitboard occupied = OCCUPIED(board);
+	uint king = SQUARE_INDEX(SQUARE(4, y));
+
+	return board->castling[p].kingside &&
+		PIECE_AT(board, 4, y) == PIECE(p, KING) &&
+		PIECE_AT(board, 7, y) == PIECE(p, ROOK) &&
+		(occupied & BETWEEN(king, king + 3)) == EMPTY_BITBOARD &&
+		attackers_of(board, king, other, occupied) == EMPTY_BITBOARD &&
+		attackers_of(board, king + 1, other, occupied) == EMPTY_BITBOARD &&
+		attackers_of(board, king + 2, other, occupied) == EMPTY_BITBOARD;
 }
 
+// As for kingside castling. The rook passes over the b-file, so that square
+// needs to be empty, but the king doesn't, so it doesn't matter if it's
+// attacked.
 bool can_castle_queenside(Board *board, Player p)
 {
 	uint y = p == WHITE ? 0 : BOARD_SIZE - 1;
 	Player other = OTHER_PLAYER(p);
-
-	return board->castling[p].queenside && !in_check(board, p) &&
-		PIECE_AT(board, 3, y) == EMPTY &&
-		PIECE_AT(board, 2, y) == EMPTY &&
-		PIECE_AT(board, 1, y) == EMPTY &&
-		!under_attack(board, SQUARE(3, y), other) &&
-		!under_attack(board, SQUARE(2, y), other) &&
-		!under_attack(board, SQUARE(1, y), other);
+	Bitboard occupied = OCCUPIED(board);
+	uint king = SQUARE_INDEX(SQUARE(4, y));
+
+	return board->castling[p].queenside &&
+		PIECE_AT(board, 4, y) == PIECE(p, KING) &&
+		PIECE_AT(board, 0, y) == PIECE(p, ROOK) &&
+		(occupied & BETWEEN(king, king - 4)) == EMPTY_BITBOARD &&
+		attackers_of(board, king, other, occupied) == EMPTY_BITBOARD &&
+		attackers_of(board, king - 1, other, occupied) == EMPTY_BITBOARD &&
+		attackers_of(board, king - 2, other, occupied) == EMPTY_BITBOARD;
 }
@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include "bitboard.h"
 #include "misc.h"
 
 #define BOARD_SIZE 8
@@ -15,6 +16,12 @@ typedef uint_fast16_t Square;
 
 #define NULL_SQUARE ((Square)(~((Square)0)))
 
+// Squares can also be referred to by an index from 0 to 63, going rank by
+// rank from a1. This is the index used for bitboards and the pieces array.
+#define SQUARE_INDEX(s) ((SQUARE_Y(s) * BOARD_SIZE) + SQUARE_X(s))
+#define INDEX_SQUARE(i) SQUARE((i) % BOARD_SIZE, (i) / BOARD_SIZE)
+#define SQUARE_BIT(s)   BIT(SQUARE_INDEX(s))
+
 // Pieces are represented as shorts, with the MSB used to store the color, and
 // the rest equal to one of a bunch of constants for the type of piece.
 typedef unsigned short Piece;
@@ -54,7 +61,8 @@ typedef struct Castling
 } Castling;
 
 
-// The board is an array of pieces, plus some other information:
+// The board is an array of pieces, along with bitboards for each piece type
+// and each player, plus some other information:
 // * Whose turn it is
 // * Castling availibility
 // * En passant target square (if any)
@@ -67,11 +75,9 @@ typedef struct Castling
 // about a board position.
 //
 // However, this structure does not contain information necessary to determine
-// if a draw can be claimed by threefold repetition. This is unlikely to
-// matter, as the most common case of threefold repetition is perpetual check,
-// in which case coming in part-way through does not matter. The other cases
-// are rare enough that it doesn't seem worthwhile to overly complicate the
-// board representation over them.
+// if a draw can be claimed by threefold repetition, as that depends on the
+// positions that came before. See draw_status in game.h, which works it out
+// from the game tree using the board hashes.
 typedef struct Board
 {
 	Player turn;
@@ -80,19 +86,41 @@ typedef struct Board
 	uint half_move_clock;
 	uint move_number;
 
+	// The same information as in pieces, as sets of squares. These make it
+	// cheap to answer questions like "where are the white knights" without
+	// looking at every square. by_type is indexed by Piece_type, so
+	// by_type[EMPTY] is unused.
+	Bitboard by_type[PIECE_TYPES + 1];
+	Bitboard by_player[PLAYERS];
+
+	// A Zobrist hash of everything above (see zobrist.h), kept up to date as
+	// pieces are moved. Equal positions have equal hashes, so this is a cheap
+	// way to tell positions apart.
+	uint64_t hash;
+
 	Piece pieces[BOARD_SIZE * BOARD_SIZE];
 } Board;
 
+// These should only be used for reading. Use set_piece to change what's on a
+// square, so that the bitboards are kept in sync.
 #define PIECE_AT(b, x, y) ((b)->pieces[((y) * BOARD_SIZE) + (x)])
 #define PIECE_AT_SQUARE(b, square) PIECE_AT(b, SQUARE_X(square), SQUARE_Y(square))
 
+#define OCCUPIED(b) ((b)->by_player[WHITE] | (b)->by_player[BLACK])
+#define PIECES_OF(b, p, t) ((b)->by_player[p] & (b)->by_type[t])
+
 void copy_board(Board *dst, Board *src);
+void clear_board(Board *board);
+void set_piece(Board *board, Square square, Piece p);
 Piece piece_from_char(char c);
 char char_from_piece(Piece p);
 bool from_fen(Board *board, const char *fen_str);
 void print_board(Board *b);
+Bitboard attackers_to(Board *board, Square square, Player attacker);
+bool under_attack(Board *board, Square square, Player attacker);
 bool in_check(Board *board, Player p);
 bool checkmate(Board *board, Player p);
+bool insufficient_material(Board *board);
 bool can_castle_kingside(Board *board, Player p);
 bool can_castle_queenside(Board *board, Player p);
 
@@ -0,0 +1,618 @@
+#include <assert.h>
+#include <errno.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "board.h"
+#include "database.h"
+#include "encoding.h"
+#include "game.h"
+#include "moves.h"
+#include "packed.h"
+#include "pgn.h"
+#include "tags.h"
+
+#define FORMAT_VERSION 1
+#define MAGIC "CHESSDB"
+
+#define HEADER_SIZE FILE_HEADER_SIZE
+#define TRAILER_SIZE (3 * 8 + 3 * 4 + FILE_MAGIC_SIZE)
+
+// Each game starts with its result, its flags, the number of tags and the
+// length of its moves in bytes. If it doesn't start from the usual position,
+// a packed board comes next. Then come its tags, as pairs of indices into
+// the names and values tables, and then its moves.
+#define GAME_HEADER_SIZE 8
+#define PACKED_BOARD_SIZE (BOARD_SIZE * BOARD_SIZE / 2 + 6)
+#define TAG_SIZE 8
+
+#define CUSTOM_START_POSITION 1
+
+// Bytes in the moves that aren't moves. There can never be this many legal
+// moves in a position. Variations go after the move that they're an
+// alternative to, as in PGN.
+#define VARIATION_START 0xFE
+#define VARIATION_END   0xFF
+
+static void put_byte(GByteArray *out, uint8_t b)
+{
+	g_byte_array_append(out, &b, 1);
+}
+
+static void put_board(GByteArray *out, Packed_board *packed)
+{
+	g_byte_array_append(out, packed->squares, sizeof packed->squares);
+	put_byte(out, packed->flags);
+	put_byte(out, packed->en_passant);
+	put_number(out, packed->half_move_clock, 2);
+	put_number(out, packed->move_number, 2);
+}
+
+static void get_board(Packed_board *packed, const uint8_t *p)
+{
+	memcpy(packed->squares, p, sizeof packed->squares);
+	p += sizeof packed->squares;
+	packed->flags = p[0];
+	packed->en_passant = p[1];
+	packed->half_move_clock = get_number(p + 2, 2);
+	packed->move_number = get_number(p + 4, 2);
+}
+
+// Bit 3 is set for black pieces
+#define PACKED_BLACK 0x8
+
+static uint packed_square(Packed_board *packed, uint i)
+{
+	return (packed->squares[i / 2] >> ((i % 2) * 4)) & 0xF;
+}
+
+// The en passant square is the one a pawn has just moved two squares over, so
+// it's on the third rank with black to move or the sixth with white to move.
+// It's empty, and the pawn is just past it.
+static bool valid_en_passant(Packed_board *packed)
+{
+	uint square = packed->en_passant;
+	if (square == 0xFF)
+		return true;
+	if (square >= BOARD_SIZE * BOARD_SIZE)
+		return false;
+
+	bool white_to_move = (packed->flags & 1) != 0;
+	if (square / BOARD_SIZE != (white_to_move ? 5u : 2u))
+		return false;
+
+	uint pawn = white_to_move ? square - BOARD_SIZE : square + BOARD_SIZE;
+	uint moved = PAWN | (white_to_move ? PACKED_BLACK : 0);
+
+	return packed_square(packed, square) == 0 &&
+		packed_square(packed, pawn) == moved;
+}
+
+// Packed boards aren't checked when they're unpacked, and the move generator
+// assumes it's been given a sensible position, so anything read from a file
+// has to be checked first.
+static bool valid_packed_board(Packed_board *packed)
+{
+	uint kings[PLAYERS] = { 0, 0 };
+	for (uint i = 0; i < BOARD_SIZE * BOARD_SIZE; i++) {
+		uint nibble = packed_square(packed, i);
+		Piece_type type = nibble & 0x7;
+		uint rank = i / BOARD_SIZE;
+
+		if (type > KING)
+			return false;
+		if (type == PAWN && (rank == 0 || rank == BOARD_SIZE - 1))
+			return false;
+		if (type == KING)
+			kings[nibble & PACKED_BLACK ? BLACK : WHITE]++;
+	}
+
+	return kings[WHITE] == 1 && kings[BLACK] == 1 && valid_en_passant(packed);
+}
+
+struct Game_db_writer
+{
+	FILE *file;
+	// How much has been written so far, which is where the next game goes
+	uint64_t position;
+	GArray *offsets;
+
+	// Each distinct tag name and value is written once, and games refer to
+	// them by their index in these tables. Names are looked up by Tag_name,
+	// and values by their pooled pointers, as equal values always have the
+	// same one. Both give the index plus one, so that 0 means it's new.
+	GArray *name_indices;
+	GByteArray *names;
+	uint name_count;
+	GHashTable *value_indices;
+	GByteArray *values;
+	uint value_count;
+
+	// The game being encoded
+	GByteArray *buf;
+	Packed_board start_board;
+
+	// Once a write has failed we stop writing, and keep reporting the error
+	GError *error;
+};
+
+static void set_write_error(Game_db_writer *writer)
+{
+	int err = errno;
+	g_set_error(&writer->error, G_FILE_ERROR, g_file_error_from_errno(err),
+			"Failed to write game database: %s", g_strerror(err));
+}
+
+static void write_bytes(Game_db_writer *writer, const void *bytes, size_t length)
+{
+	// The tables can be empty, in which case there might not be any bytes
+	if (writer->error == NULL && length != 0 &&
+			fwrite(bytes, 1, length, writer->file) != length)
+		set_write_error(writer);
+
+	writer->position += length;
+}
+
+Game_db_writer *game_db_writer_new(FILE *file)
+{
+	Game_db_writer *writer = malloc(sizeof *writer);
+	writer->file = file;
+	writer->position = 0;
+	writer->offsets = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+	writer->name_indices = g_array_new(FALSE, TRUE, sizeof(uint32_t));
+	writer->names = g_byte_array_new();
+	writer->name_count = 0;
+	writer->value_indices = g_hash_table_new(g_direct_hash, g_direct_equal);
+	writer->values = g_byte_array_new();
+	writer->value_count = 0;
+	writer->buf = g_byte_array_new();
+	writer->error = NULL;
+
+	Board start;
+	from_fen(&start, start_board_fen);
+	pack_board(&writer->start_board, &start);
+
+	GByteArray *header = writer->buf;
+	put_file_header(header, MAGIC, FORMAT_VERSION);
+	write_bytes(writer, header->data, header->len);
+
+	return writer;
+}
+
+static uint32_t name_index(Game_db_writer *writer, Tag_name name)
+{
+	if (name >= writer->name_indices->len)
+		g_array_set_size(writer->name_indices, name + 1);
+
+	uint32_t *index = &g_array_index(writer->name_indices, uint32_t, name);
+	if (*index == 0) {
+		const char *str = tag_name_string(name);
+		g_byte_array_append(writer->names, (const uint8_t *)str, strlen(str) + 1);
+		*index = ++writer->name_count;
+	}
+
+	return *index - 1;
+}
+
+static uint32_t value_index(Game_db_writer *writer, const char *value)
+{
+	uint index = GPOINTER_TO_UINT(
+			g_hash_table_lookup(writer->value_indices, value));
+	if (index == 0) {
+		g_byte_array_append(writer->values,
+				(const uint8_t *)value, strlen(value) + 1);
+		index = ++writer->value_count;
+		g_hash_table_insert(writer->value_indices,
+				(gpointer)value, GUINT_TO_POINTER(index));
+	}
+
+	return index - 1;
+}
+
+static uint8_t move_index(Move_list *moves, Move move)
+{
+	uint i = 0;
+	while (i < moves->count && moves->moves[i] != move)
+		i++;
+
+	// Everything in a game tree has to be legal to have got there
+	assert(i < moves->count);
+
+	return i;
+}
+
+// The boards for the moves are worked out as we go along, as for writing
+// PGN, rather than getting each node's board from the tree.
+static void encode_moves(GByteArray *out, Game *node, Board *board)
+{
+	while (node->children != NULL) {
+		Game *child = node->children;
+		Move_list moves;
+		generate_legal_moves(board, &moves);
+
+		put_byte(out, move_index(&moves, child->move));
+
+		for (Game *variation = child->sibling; variation != NULL;
+				variation = variation->sibling) {
+			Board variation_board = *board;
+
+			put_byte(out, VARIATION_START);
+			put_byte(out, move_index(&moves, variation->move));
+			perform_move(&variation_board, variation->move);
+			encode_moves(out, variation, &variation_board);
+			put_byte(out, VARIATION_END);
+		}
+
+		perform_move(board, child->move);
+		node = child;
+	}
+}
+
+static void encode_game(Game_db_writer *writer, PGN *pgn)
+{
+	GByteArray *out = writer->buf;
+	g_byte_array_set_size(out, GAME_HEADER_SIZE);
+
+	uint8_t flags = 0;
+	if (pgn->game != NULL) {
+		Packed_board packed;
+		pack_board(&packed, game_board(pgn->game));
+		if (memcmp(&packed, &writer->start_board, sizeof packed) != 0) {
+			flags |= CUSTOM_START_POSITION;
+			put_board(out, &packed);
+		}
+	}
+
+	for (uint i = 0; i < pgn->tag_count; i++) {
+		put_number(out, name_index(writer, pgn->tags[i].name), 4);
+		put_number(out, value_index(writer, pgn->tags[i].value), 4);
+	}
+
+	size_t moves_start = out->len;
+	if (pgn->game != NULL) {
+		Board board = *game_board(pgn->game);
+		encode_moves(out, pgn->game, &board);
+	}
+
+	// Now we know how long everything is, the header can be filled in
+	out->data[0] = pgn->result;
+	out->data[1] = flags;
+	set_number(out->data + 2, pgn->tag_count, 2);
+	set_number(out->data + 4, out->len - moves_start, 4);
+}
+
+bool game_db_writer_add(Game_db_writer *writer, PGN *pgn, GError **error)
+{
+	g_array_append_val(writer->offsets, writer->position);
+
+	encode_game(writer, pgn);
+	write_bytes(writer, writer->buf->data, writer->buf->len);
+
+	if (writer->error != NULL) {
+		g_propagate_error(error, g_error_copy(writer->error));
+		return false;
+	}
+
+	return true;
+}
+
+bool game_db_writer_close(Game_db_writer *writer, GError **error)
+{
+	uint64_t names_offset = writer->position;
+	write_bytes(writer, writer->names->data, writer->names->len);
+	uint64_t values_offset = writer->position;
+	write_bytes(writer, writer->values->data, writer->values->len);
+	uint64_t offsets_offset = writer->position;
+
+	GByteArray *out = writer->buf;
+	g_byte_array_set_size(out, 0);
+	for (uint i = 0; i < writer->offsets->len; i++)
+		put_number(out, g_array_index(writer->offsets, uint64_t, i), 8);
+
+	put_number(out, names_offset, 8);
+	put_number(out, values_offset, 8);
+	put_number(out, offsets_offset, 8);
+	put_number(out, writer->name_count, 4);
+	put_number(out, writer->value_count, 4);
+	put_number(out, writer->offsets->len, 4);
+	g_byte_array_append(out, (const uint8_t *)MAGIC, FILE_MAGIC_SIZE);
+	write_bytes(writer, out->data, out->len);
+
+	if (writer->error == NULL && fflush(writer->file) != 0)
+		set_write_error(writer);
+
+	bool success = writer->error == NULL;
+	if (!success) {
+		g_propagate_error(error, writer->error);
+		writer->error = NULL;
+	}
+
+	game_db_writer_free(writer);
+
+	return success;
+}
+
+void game_db_writer_free(Game_db_writer *writer)
+{
+	if (writer->error != NULL)
+		g_error_free(writer->error);
+
+	g_array_free(writer->offsets, TRUE);
+	g_array_free(writer->name_indices, TRUE);
+	g_byte_array_free(writer->names, TRUE);
+	g_hash_table_destroy(writer->value_indices);
+	g_byte_array_free(writer->values, TRUE);
+	g_byte_array_free(writer->buf, TRUE);
+	free(writer);
+}
+
+struct Game_db
+{
+	GMappedFile *file;
+	const uint8_t *data;
+	// Where the games end and the tables start
+	uint64_t games_end;
+
+	const uint8_t *offsets;
+	uint32_t game_count;
+	Game_db_stamp stamp;
+
+	// The strings in the file's tables, already put in the tag pool
+	Tag_name *names;
+	uint32_t name_count;
+	const char **values;
+	uint32_t value_count;
+
+	Board start_board;
+};
+
+static void set_invalid_error(GError **error, const char *what)
+{
+	g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+			"Invalid game database: %s", what);
+}
+
+// Reads count null-terminated strings from start to end, calling add on
+// each. Returns false if they don't fit.
+static bool read_strings(const uint8_t *start, const uint8_t *end,
+		uint32_t count, Game_db *db,
+		void (*add)(Game_db *db, uint32_t i, const char *str, size_t length))
+{
+	const uint8_t *p = start;
+	for (uint32_t i = 0; i < count; i++) {
+		const uint8_t *nul = memchr(p, '\0', end - p);
+		if (nul == NULL)
+			return false;
+
+		add(db, i, (const char *)p, nul - p);
+		p = nul + 1;
+	}
+
+	return true;
+}
+
+static void add_name(Game_db *db, uint32_t i, const char *str, size_t length)
+{
+	db->names[i] = intern_tag_name(str, length);
+}
+
+static void add_value(Game_db *db, uint32_t i, const char *str, size_t length)
+{
+	db->values[i] = intern_tag_value(str, length);
+}
+
+Game_db *game_db_open(const char *filename, GError **error)
+{
+	GMappedFile *file = g_mapped_file_new(filename, FALSE, error);
+	if (file == NULL)
+		return NULL;
+
+	GStatBuf file_stat;
+	if (g_stat(filename, &file_stat) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat '%s': %s", filename, g_strerror(err));
+		g_mapped_file_unref(file);
+		return NULL;
+	}
+
+	const uint8_t *data = (const uint8_t *)g_mapped_file_get_contents(file);
+	uint64_t length = g_mapped_file_get_length(file);
+
+	if (length < HEADER_SIZE + TRAILER_SIZE ||
+			memcmp(data + length - FILE_MAGIC_SIZE, MAGIC, FILE_MAGIC_SIZE) != 0 ||
+			!check_file_header(data, length, MAGIC, FORMAT_VERSION, NULL, 0)) {
+		set_invalid_error(error, "not a game database, or an unsupported version");
+		g_mapped_file_unref(file);
+		return NULL;
+	}
+
+	const uint8_t *trailer = data + length - TRAILER_SIZE;
+	uint64_t names_offset = get_number(trailer, 8);
+	uint64_t values_offset = get_number(trailer + 8, 8);
+	uint64_t offsets_offset = get_number(trailer + 16, 8);
+	uint32_t name_count = get_number(trailer + 24, 4);
+	uint32_t value_count = get_number(trailer + 28, 4);
+	uint32_t game_count = get_number(trailer + 32, 4);
+
+	uint64_t trailer_offset = length - TRAILER_SIZE;
+	if (names_offset < HEADER_SIZE || names_offset > values_offset ||
+			values_offset > offsets_offset || offsets_offset > trailer_offset ||
+			(trailer_offset - offsets_offset) / 8 != game_count ||
+			// Every string takes up at least its null terminator
+			name_count > values_offset - names_offset ||
+			value_count > offsets_offset - values_offset) {
+		set_invalid_error(error, "bad tables");
+		g_mapped_file_unref(file);
+		return NULL;
+	}
+
+	Game_db *db = malloc(sizeof *db);
+	db->file = file;
+	db->data = data;
+	db->games_end = names_offset;
+	db->offsets = data + offsets_offset;
+	db->game_count = game_count;
+	db->stamp.games = game_count;
+	db->stamp.size = length;
+	db->stamp.mtime = file_stat.st_mtime;
+	db->names = malloc(name_count * sizeof *db->names);
+	db->name_count = name_count;
+	db->values = malloc(value_count * sizeof *db->values);
+	db->value_count = value_count;
+	from_fen(&db->start_board, start_board_fen);
+
+	if (!read_strings(data + names_offset, data + values_offset,
+				name_count, db, add_name) ||
+			!read_strings(data + values_offset, data + offsets_offset,
+				value_count, db, add_value)) {
+		set_invalid_error(error, "bad string tables");
+		game_db_close(db);
+		return NULL;
+	}
+
+	return db;
+}
+
+size_t game_db_game_count(Game_db *db)
+{
+	return db->game_count;
+}
+
+Game_db_stamp game_db_stamp(Game_db *db)
+{
+	return db->stamp;
+}
+
+bool game_db_stamp_matches(Game_db *db, const Game_db_stamp *stamp)
+{
+	return stamp->games == db->stamp.games && stamp->size == db->stamp.size &&
+		stamp->mtime == db->stamp.mtime;
+}
+
+// Adds the moves from *p up to end under node, leaving *p after them. Returns
+// false if they aren't valid.
+static bool decode_moves(const uint8_t **p, const uint8_t *end, Game *node,
+		bool in_variation)
+{
+	Game *last = node;
+
+	while (*p != end) {
+		uint8_t b = *(*p)++;
+
+		if (b == VARIATION_END)
+			return in_variation;
+
+		if (b == VARIATION_START) {
+			// There has to be a move for this to be an alternative to
+			if (last == node ||
+					!decode_moves(p, end, last->parent, true))
+				return false;
+
+			continue;
+		}
+
+		Move_list moves;
+		generate_legal_moves(game_board(last), &moves);
+		if (b >= moves.count)
+			return false;
+
+		last = add_child(last, moves.moves[b]);
+	}
+
+	return !in_variation;
+}
+
+// Reads a game, or just its result and tags if tags_only is set, in which
+// case the game is left NULL and the moves aren't even looked at.
+static bool read_game(Game_db *db, size_t game, PGN *pgn, bool tags_only,
+		GError **error)
+{
+	assert(game < db->game_count);
+
+	uint64_t offset = get_number(db->offsets + 8 * game, 8);
+	const uint8_t *end = db->data + db->games_end;
+	if (offset < HEADER_SIZE || offset + GAME_HEADER_SIZE > db->games_end) {
+		set_invalid_error(error, "bad game offset");
+		return false;
+	}
+
+	const uint8_t *p = db->data + offset;
+	uint8_t result = p[0];
+	uint8_t flags = p[1];
+	uint tag_count = get_number(p + 2, 2);
+	uint64_t moves_length = get_number(p + 4, 4);
+	p += GAME_HEADER_SIZE;
+
+	uint64_t board_size = flags & CUSTOM_START_POSITION ? PACKED_BOARD_SIZE : 0;
+	if (result > OTHER ||
+			(uint64_t)(end - p) < board_size + tag_count * TAG_SIZE + moves_length) {
+		set_invalid_error(error, "bad game header");
+		return false;
+	}
+
+	pgn->result = result;
+	pgn->tags = tag_count == 0 ? NULL : malloc(tag_count * sizeof *pgn->tags);
+	pgn->tag_count = tag_count;
+	pgn->game = tags_only ? NULL : new_game();
+
+	bool valid = true;
+	if (tags_only) {
+		p += board_size;
+	} else if (flags & CUSTOM_START_POSITION) {
+		Packed_board packed;
+		get_board(&packed, p);
+		valid = valid_packed_board(&packed);
+		if (valid)
+			unpack_board(pgn->game->board, &packed);
+		p += PACKED_BOARD_SIZE;
+	} else {
+		copy_board(pgn->game->board, &db->start_board);
+	}
+
+	for (uint i = 0; valid && i < tag_count; i++, p += TAG_SIZE) {
+		uint32_t name = get_number(p, 4);
+		uint32_t value = get_number(p + 4, 4);
+		if (name >= db->name_count || value >= db->value_count) {
+			valid = false;
+			break;
+		}
+
+		pgn->tags[i].name = db->names[name];
+		pgn->tags[i].value = db->values[value];
+	}
+
+	if (valid && !tags_only) {
+		const uint8_t *moves_end = p + moves_length;
+		valid = decode_moves(&p, moves_end, pgn->game, false);
+	}
+
+	if (!valid) {
+		set_invalid_error(error, "bad game");
+		free_pgn(pgn);
+		return false;
+	}
+
+	return true;
+}
+
+bool game_db_read_game(Game_db *db, size_t game, PGN *pgn, GError **error)
+{
+	return read_game(db, game, pgn, false, error);
+}
+
+bool game_db_read_tags(Game_db *db, size_t game, PGN *pgn, GError **error)
+{
+	return read_game(db, game, pgn, true, error);
+}
+
+void game_db_close(Game_db *db)
+{
+	g_mapped_file_unref(db->file);
+	free(db->names);
+	free(db->values);
+	free(db);
+}
@@ -0,0 +1,69 @@
+#ifndef DATABASE_H_
+#define DATABASE_H_
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "pgn.h"
+
+// A compact binary format for storing lots of games, which is much quicker
+// to load than PGN, as there's no text to parse and the moves are already
+// known to be legal.
+//
+// Each move is stored as a single byte: its index in the list of legal
+// moves from generate_legal_moves. This means that the order moves are
+// generated in is part of the format, so FORMAT_VERSION in database.c needs
+// bumping if that ever changes.
+//
+// A file looks like this, with all numbers little-endian:
+//
+//     magic ("CHESSDB\0"), version (u32), padding (u32)
+//     games, one after another (see encode_game for the layout)
+//     tag names: null-terminated strings, one after another
+//     tag values: the same
+//     game offsets: u64 each, from the start of the file
+//     trailer: u64 offsets of the names, values and game offsets, then
+//              u32 counts of the names, values and games, then the magic
+//
+// All the tables go at the end, so that a file can be written in one pass.
+
+typedef struct Game_db_writer Game_db_writer;
+
+Game_db_writer *game_db_writer_new(FILE *file);
+bool game_db_writer_add(Game_db_writer *writer, PGN *pgn, GError **error);
+// Writes the tables, flushes the file (but doesn't close it) and frees the
+// writer. Returns false if anything failed to write since it was created.
+bool game_db_writer_close(Game_db_writer *writer, GError **error);
+// Frees the writer without writing the tables, for when the file is being
+// thrown away.
+void game_db_writer_free(Game_db_writer *writer);
+
+// The file is memory mapped, and each game is decoded when it's asked for.
+typedef struct Game_db Game_db;
+
+Game_db *game_db_open(const char *filename, GError **error);
+size_t game_db_game_count(Game_db *db);
+// The game must then be freed with free_pgn
+bool game_db_read_game(Game_db *db, size_t game, PGN *pgn, GError **error);
+// Much quicker than reading the whole game, for when only the tags and
+// result are needed. pgn->game is left NULL, but it still needs free_pgn.
+bool game_db_read_tags(Game_db *db, size_t game, PGN *pgn, GError **error);
+void game_db_close(Game_db *db);
+
+// What an index built from a database records about it, so that it can tell
+// when the database has been replaced and it needs building again. Games are
+// only ever added by writing a new file, so any change shows up in one of
+// these.
+typedef struct Game_db_stamp
+{
+	uint64_t games;
+	uint64_t size;
+	uint64_t mtime;
+} Game_db_stamp;
+
+Game_db_stamp game_db_stamp(Game_db *db);
+// Whether an index with this stamp was built from the database as it is now
+bool game_db_stamp_matches(Game_db *db, const Game_db_stamp *stamp);
+
+#endif // include guard
@@ -0,0 +1,89 @@
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "encoding.h"
+
+void set_number(uint8_t *p, uint64_t n, uint bytes)
+{
+	for (uint i = 0; i < bytes; i++)
+		p[i] = (n >> (8 * i)) & 0xFF;
+}
+
+void put_number(GByteArray *out, uint64_t n, uint bytes)
+{
+	uint8_t buf[8];
+	set_number(buf, n, bytes);
+	g_byte_array_append(out, buf, bytes);
+}
+
+uint64_t get_number(const uint8_t *p, uint bytes)
+{
+	uint64_t n = 0;
+	for (uint i = 0; i < bytes; i++)
+		n |= (uint64_t)p[i] << (8 * i);
+
+	return n;
+}
+
+void set_file_header(uint8_t *p, const char *magic, uint version)
+{
+	memcpy(p, magic, FILE_MAGIC_SIZE);
+	set_number(p + FILE_MAGIC_SIZE, version, 4);
+	set_number(p + FILE_MAGIC_SIZE + 4, 0, 4);
+}
+
+void put_file_header(GByteArray *out, const char *magic, uint version)
+{
+	uint8_t buf[FILE_HEADER_SIZE];
+	set_file_header(buf, magic, version);
+	g_byte_array_append(out, buf, FILE_HEADER_SIZE);
+}
+
+bool check_file_header(const uint8_t *data, uint64_t length, const char *magic,
+		uint version, uint64_t *counts, uint count)
+{
+	if (length < FILE_HEADER_SIZE + 8 * (uint64_t)count ||
+			memcmp(data, magic, FILE_MAGIC_SIZE) != 0 ||
+			get_number(data + FILE_MAGIC_SIZE, 4) != version)
+		return false;
+
+	for (uint i = 0; i < count; i++)
+		counts[i] = get_number(data + FILE_HEADER_SIZE + 8 * i, 8);
+
+	return true;
+}
+
+uint set_varint(uint8_t *p, uint64_t n)
+{
+	uint length = 0;
+	while (n >= 0x80) {
+		p[length++] = (n & 0x7F) | 0x80;
+		n >>= 7;
+	}
+	p[length++] = n;
+
+	return length;
+}
+
+void put_varint(GByteArray *out, uint64_t n)
+{
+	uint8_t buf[MAX_VARINT_SIZE];
+	g_byte_array_append(out, buf, set_varint(buf, n));
+}
+
+const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint64_t *n)
+{
+	uint64_t value = 0;
+	for (uint shift = 0; p != end && shift < 64; shift += 7) {
+		uint8_t b = *p++;
+		value |= (uint64_t)(b & 0x7F) << shift;
+
+		if ((b & 0x80) == 0) {
+			*n = value;
+			return p;
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,41 @@
+#ifndef ENCODING_H_
+#define ENCODING_H_
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "misc.h"
+
+// Reading and writing numbers in the binary file formats. Fixed-size numbers
+// are little-endian, whatever the machine is. Variable-length numbers take
+// 7 bits per byte, low bits first, with the top bit set on every byte but the
+// last, so that small numbers only take a single byte.
+
+#define MAX_VARINT_SIZE 10
+
+// Every file format starts with the same header, followed by whatever counts
+// it needs as u64s:
+//
+//     magic (7 characters and a null terminator), version (u32), padding (u32)
+#define FILE_MAGIC_SIZE 8
+#define FILE_HEADER_SIZE (FILE_MAGIC_SIZE + 8)
+
+void set_number(uint8_t *p, uint64_t n, uint bytes);
+void put_number(GByteArray *out, uint64_t n, uint bytes);
+uint64_t get_number(const uint8_t *p, uint bytes);
+
+void set_file_header(uint8_t *p, const char *magic, uint version);
+void put_file_header(GByteArray *out, const char *magic, uint version);
+// Checks that a file starts with the header for this magic and version,
+// followed by count u64s, which are read into counts. Returns false if it
+// doesn't, or if the file's too short for them.
+bool check_file_header(const uint8_t *data, uint64_t length, const char *magic,
+		uint version, uint64_t *counts, uint count);
+
+// Returns the number of bytes written, which is at most MAX_VARINT_SIZE.
+uint set_varint(uint8_t *p, uint64_t n);
+void put_varint(GByteArray *out, uint64_t n);
+// Returns a pointer to just after the number, or NULL if it runs past end.
+const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint64_t *n);
+
+#endif // include guard
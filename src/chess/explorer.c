@@ -0,0 +1,345 @@
+#include <errno.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "encoding.h"
+#include "explorer.h"
+#include "game.h"
+#include "moves.h"
+#include "pgn.h"
+#include "tags.h"
+
+#define FORMAT_VERSION 1
+#define MAGIC "CHESSOE"
+
+// A saved explorer is a header with the number of positions and moves,
+// followed by a record for each move: the hash of the position it's played
+// from, and then all the fields of its Explorer_move in order. Numbers are
+// encoded as in encoding.h.
+#define HEADER_SIZE (FILE_HEADER_SIZE + 16)
+#define RECORD_SIZE (8 + 7 * 4 + 2 * 8)
+
+// Records are written out in batches of about this many bytes
+#define WRITE_BATCH_SIZE (1 << 20)
+
+#define INITIAL_TABLE_SIZE 1024
+#define NO_ENTRY UINT32_MAX
+
+typedef struct Entry
+{
+	Explorer_move stats;
+	// The next move played from the same position, or NO_ENTRY
+	uint32_t next;
+} Entry;
+
+typedef struct Slot
+{
+	uint64_t hash;
+	// The first move played from the position, or NO_ENTRY if the slot is
+	// empty
+	uint32_t first;
+} Slot;
+
+struct Explorer
+{
+	// An open addressing hash table of positions, with linear probing. The
+	// size is always a power of two, and at least twice the number of
+	// positions. Zobrist hashes are already random, so they're used as is.
+	Slot *slots;
+	size_t size;
+	size_t positions;
+
+	// Moves are kept in one big array rather than allocated separately, and
+	// the moves from each position are linked together by index
+	GArray *entries;
+
+	Tag_name white_elo;
+	Tag_name black_elo;
+};
+
+static Slot *new_slots(size_t size)
+{
+	Slot *slots = malloc(size * sizeof *slots);
+	for (size_t i = 0; i < size; i++)
+		slots[i].first = NO_ENTRY;
+
+	return slots;
+}
+
+static Explorer *explorer_new_sized(size_t positions, size_t moves)
+{
+	Explorer *explorer = malloc(sizeof *explorer);
+
+	explorer->size = INITIAL_TABLE_SIZE;
+	while (explorer->size < 2 * positions)
+		explorer->size *= 2;
+	explorer->slots = new_slots(explorer->size);
+	explorer->positions = 0;
+	explorer->entries = g_array_sized_new(FALSE, FALSE, sizeof(Entry), moves);
+
+	explorer->white_elo = intern_tag_name("WhiteElo", strlen("WhiteElo"));
+	explorer->black_elo = intern_tag_name("BlackElo", strlen("BlackElo"));
+
+	return explorer;
+}
+
+Explorer *explorer_new(void)
+{
+	return explorer_new_sized(0, 0);
+}
+
+static Slot *find_slot(Slot *slots, size_t size, uint64_t hash)
+{
+	size_t mask = size - 1;
+	size_t i = hash & mask;
+	while (slots[i].first != NO_ENTRY && slots[i].hash != hash)
+		i = (i + 1) & mask;
+
+	return &slots[i];
+}
+
+static void grow_table(Explorer *explorer)
+{
+	size_t new_size = 2 * explorer->size;
+	Slot *new = new_slots(new_size);
+
+	for (size_t i = 0; i < explorer->size; i++) {
+		Slot *slot = &explorer->slots[i];
+		if (slot->first != NO_ENTRY)
+			*find_slot(new, new_size, slot->hash) = *slot;
+	}
+
+	free(explorer->slots);
+	explorer->slots = new;
+	explorer->size = new_size;
+}
+
+static Entry *entry(Explorer *explorer, uint32_t i)
+{
+	return &g_array_index(explorer->entries, Entry, i);
+}
+
+// The stats for a move from a position, which are added if they're not there
+static Explorer_move *find_move(Explorer *explorer, uint64_t hash, Move move)
+{
+	Slot *slot = find_slot(explorer->slots, explorer->size, hash);
+	if (slot->first == NO_ENTRY) {
+		if (2 * (explorer->positions + 1) > explorer->size) {
+			grow_table(explorer);
+			slot = find_slot(explorer->slots, explorer->size, hash);
+		}
+
+		slot->hash = hash;
+		explorer->positions++;
+	}
+
+	for (uint32_t i = slot->first; i != NO_ENTRY; i = entry(explorer, i)->next) {
+		Explorer_move *stats = &entry(explorer, i)->stats;
+		if (stats->move == move)
+			return stats;
+	}
+
+	Entry new;
+	memset(&new, 0, sizeof new);
+	new.stats.move = move;
+	new.next = slot->first;
+	g_array_append_val(explorer->entries, new);
+	slot->first = explorer->entries->len - 1;
+
+	return &entry(explorer, slot->first)->stats;
+}
+
+void explorer_add_game(Explorer *explorer, PGN *pgn)
+{
+	if (pgn->game == NULL)
+		return;
+
+	uint white_elo = parse_elo_tag(pgn_tag(pgn, explorer->white_elo));
+	uint black_elo = parse_elo_tag(pgn_tag(pgn, explorer->black_elo));
+
+	Game *node = pgn->game;
+	Game *child;
+	while (node->ply < EXPLORER_MAX_PLY && (child = first_child(node)) != NULL) {
+		Explorer_move *stats = find_move(explorer, game_hash(node), child->move);
+
+		stats->games++;
+		switch (pgn->result) {
+		case WHITE_WINS: stats->white_wins++; break;
+		case BLACK_WINS: stats->black_wins++; break;
+		case DRAW:       stats->draws++;      break;
+		case OTHER:                           break;
+		}
+
+		if (white_elo != 0) {
+			stats->white_rated++;
+			stats->white_elo_total += white_elo;
+		}
+		if (black_elo != 0) {
+			stats->black_rated++;
+			stats->black_elo_total += black_elo;
+		}
+
+		node = child;
+	}
+}
+
+static int compare_by_games(const void *a, const void *b)
+{
+	const Explorer_move *x = a;
+	const Explorer_move *y = b;
+
+	if (x->games != y->games)
+		return x->games > y->games ? -1 : 1;
+
+	// Keep the order the same every time for moves played equally often
+	return x->move < y->move ? -1 : x->move > y->move;
+}
+
+void explorer_lookup(Explorer *explorer, uint64_t hash,
+		Explorer_move_list *list)
+{
+	Slot *slot = find_slot(explorer->slots, explorer->size, hash);
+
+	// There can only be more moves than fit if two positions with the same
+	// hash have both been counted
+	list->count = 0;
+	for (uint32_t i = slot->first; i != NO_ENTRY && list->count < MAX_MOVES;
+			i = entry(explorer, i)->next)
+		list->moves[list->count++] = entry(explorer, i)->stats;
+
+	qsort(list->moves, list->count, sizeof *list->moves, compare_by_games);
+}
+
+static void put_record(GByteArray *out, uint64_t hash, Explorer_move *stats)
+{
+	put_number(out, hash, 8);
+	put_number(out, stats->move, 4);
+	put_number(out, stats->games, 4);
+	put_number(out, stats->white_wins, 4);
+	put_number(out, stats->draws, 4);
+	put_number(out, stats->black_wins, 4);
+	put_number(out, stats->white_rated, 4);
+	put_number(out, stats->black_rated, 4);
+	put_number(out, stats->white_elo_total, 8);
+	put_number(out, stats->black_elo_total, 8);
+}
+
+static void add_record(Explorer *explorer, const uint8_t *p)
+{
+	Explorer_move *stats = find_move(explorer, get_number(p, 8),
+			get_number(p + 8, 4));
+
+	stats->games           += get_number(p + 12, 4);
+	stats->white_wins      += get_number(p + 16, 4);
+	stats->draws           += get_number(p + 20, 4);
+	stats->black_wins      += get_number(p + 24, 4);
+	stats->white_rated     += get_number(p + 28, 4);
+	stats->black_rated     += get_number(p + 32, 4);
+	stats->white_elo_total += get_number(p + 36, 8);
+	stats->black_elo_total += get_number(p + 44, 8);
+}
+
+Explorer *explorer_load(const char *filename, GError **error)
+{
+	GMappedFile *file = g_mapped_file_new(filename, FALSE, error);
+	if (file == NULL)
+		return NULL;
+
+	const uint8_t *data = (const uint8_t *)g_mapped_file_get_contents(file);
+	uint64_t length = g_mapped_file_get_length(file);
+	// The number of positions, and then of moves
+	uint64_t counts[2];
+	bool valid = check_file_header(data, length, MAGIC, FORMAT_VERSION,
+			counts, 2);
+	uint64_t positions = counts[0];
+	uint64_t moves = counts[1];
+
+	if (!valid || moves > (length - HEADER_SIZE) / RECORD_SIZE ||
+			HEADER_SIZE + moves * RECORD_SIZE != length || positions > moves) {
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+				"Invalid opening explorer '%s'", filename);
+		g_mapped_file_unref(file);
+		return NULL;
+	}
+
+	Explorer *explorer = explorer_new_sized(positions, moves);
+	for (uint64_t i = 0; i < moves; i++)
+		add_record(explorer, data + HEADER_SIZE + i * RECORD_SIZE);
+
+	g_mapped_file_unref(file);
+
+	return explorer;
+}
+
+static bool write_out(FILE *file, GByteArray *buf)
+{
+	bool success = buf->len == 0 || fwrite(buf->data, 1, buf->len, file) == buf->len;
+	g_byte_array_set_size(buf, 0);
+
+	return success;
+}
+
+// This writes to a temporary file first, so that if anything goes wrong
+// there's still the last saved copy.
+bool explorer_save(Explorer *explorer, const char *filename, GError **error)
+{
+	char *temp_filename = g_strdup_printf("%s.tmp", filename);
+	FILE *file = fopen(temp_filename, "wb");
+	if (file == NULL) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Couldn't open '%s' for writing: %s", temp_filename,
+				g_strerror(err));
+		g_free(temp_filename);
+		return false;
+	}
+
+	GByteArray *buf = g_byte_array_sized_new(WRITE_BATCH_SIZE + RECORD_SIZE);
+	put_file_header(buf, MAGIC, FORMAT_VERSION);
+	put_number(buf, explorer->positions, 8);
+	put_number(buf, explorer->entries->len, 8);
+
+	bool success = true;
+	for (size_t i = 0; success && i < explorer->size; i++) {
+		Slot *slot = &explorer->slots[i];
+		for (uint32_t j = slot->first; j != NO_ENTRY; j = entry(explorer, j)->next)
+			put_record(buf, slot->hash, &entry(explorer, j)->stats);
+
+		if (buf->len >= WRITE_BATCH_SIZE)
+			success = write_out(file, buf);
+	}
+
+	success = success && write_out(file, buf);
+	int err = errno;
+	if (fclose(file) != 0 && success) {
+		err = errno;
+		success = false;
+	}
+
+	if (success && g_rename(temp_filename, filename) != 0) {
+		err = errno;
+		success = false;
+	}
+
+	if (!success) {
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to save opening explorer: %s", g_strerror(err));
+		g_remove(temp_filename);
+	}
+
+	g_byte_array_free(buf, TRUE);
+	g_free(temp_filename);
+
+	return success;
+}
+
+void explorer_free(Explorer *explorer)
+{
+	free(explorer->slots);
+	g_array_free(explorer->entries, TRUE);
+	free(explorer);
+}
@@ -0,0 +1,59 @@
+#ifndef EXPLORER_H_
+#define EXPLORER_H_
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "board.h"
+#include "moves.h"
+#include "pgn.h"
+
+// An opening explorer: for each position reached in a set of games, the moves
+// played from it, how often, how those games ended, and the average ratings
+// of the players. Positions are found by hash, so transpositions are all
+// counted together.
+//
+// Everything is kept in memory, so that looking up a position is just a hash
+// table lookup, and games can be added at any time. Explorers can be saved
+// and loaded again, to add more games later without going back over the ones
+// already counted.
+
+// Only moves this far into each game are counted, as that's the part anyone
+// looks at in an opening explorer, and the number of positions grows much
+// faster than the number of games after that.
+#define EXPLORER_MAX_PLY 40
+
+typedef struct Explorer_move
+{
+	Move move;
+	uint32_t games;
+	uint32_t white_wins;
+	uint32_t draws;
+	uint32_t black_wins;
+
+	// Each side is counted on its own: a game with a WhiteElo tag counts
+	// towards the White totals even if it has no BlackElo, and vice versa
+	uint32_t white_rated;
+	uint32_t black_rated;
+	uint64_t white_elo_total;
+	uint64_t black_elo_total;
+} Explorer_move;
+
+typedef struct Explorer_move_list
+{
+	// The most played moves come first
+	Explorer_move moves[MAX_MOVES];
+	uint count;
+} Explorer_move_list;
+
+typedef struct Explorer Explorer;
+
+Explorer *explorer_new(void);
+void explorer_add_game(Explorer *explorer, PGN *pgn);
+void explorer_lookup(Explorer *explorer, uint64_t hash,
+		Explorer_move_list *list);
+Explorer *explorer_load(const char *filename, GError **error);
+bool explorer_save(Explorer *explorer, const char *filename, GError **error);
+void explorer_free(Explorer *explorer);
+
+#endif // include guard
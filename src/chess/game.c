@@ -1,50 +1,239 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include "arena.h"
 #include "board.h"
 #include "game.h"
 
-Game *new_game()
+// The number of boards kept around for nodes that aren't checkpoints. This
+// needs to be at least 2, so that adding a child never evicts its parent.
+#define BOARD_CACHE_SIZE 4
+
+typedef struct Cached_board
+{
+	Game *node;
+	uint last_used;
+	Board board;
+} Cached_board;
+
+// Everything that belongs to a whole tree rather than a single node.
+typedef struct Game_tree
 {
-	Game *game = malloc(sizeof(Game));
+	Arena nodes;
+	Arena boards;
+
+	// Nodes added this many plies after the nearest node with a board keep
+	// their own board
+	uint checkpoint_interval;
+	// NULL until a board needs to be rebuilt, as trees which keep every board
+	// never need it.
+	Cached_board *cache;
+	uint cache_clock;
+} Game_tree;
+
+// Roughly enough for a typical game, so that most trees only need one block
+// of each.
+#define INITIAL_NODES 128
+
+static Game *new_node(Game_tree *tree)
+{
+	Game *game = arena_alloc(&tree->nodes, sizeof *game);
 
 	game->move     = NULL_MOVE;
 	game->board    = NULL;
+	game->hash     = 0;
+	game->ply      = 0;
 	game->parent   = NULL;
 	game->children = NULL;
 	game->sibling  = NULL;
+	game->tree     = tree;
 
 	return game;
 }
 
-Game *add_child(Game *game, Move move)
+// Creates a new tree with just a root node. The root's board is allocated but
+// not filled in, so this needs to be followed by from_fen or similar.
+Game *new_game()
 {
-	Board *board = malloc(sizeof *board);
-	copy_board(board, game->board);
-	perform_move(board, move);
+	Game_tree *tree = malloc(sizeof *tree);
+	arena_init(&tree->nodes, INITIAL_NODES * sizeof(Game));
+	arena_init(&tree->boards, INITIAL_NODES * sizeof(Board));
+	tree->checkpoint_interval = 1;
+	tree->cache = NULL;
+	tree->cache_clock = 0;
+
+	Game *game = new_node(tree);
+	game->board = arena_alloc(&tree->boards, sizeof(Board));
+
+	return game;
+}
+
+// Sets how often nodes added to game's tree from now on keep their own board.
+// 1 (the default) means every node does. Existing nodes are left as they are,
+// and the spacing is counted from the nearest board already in the tree, so
+// changing this part way through a game never leaves a longer gap between
+// boards than the largest interval used.
+void set_checkpoint_interval(Game *game, uint interval)
+{
+	if (interval < 1)
+		interval = 1;
+	if (interval > MAX_CHECKPOINT_INTERVAL)
+		interval = MAX_CHECKPOINT_INTERVAL;
+
+	game->tree->checkpoint_interval = interval;
+}
+
+static Cached_board *find_cached_board(Game_tree *tree, Game *node)
+{
+	if (tree->cache == NULL)
+		return NULL;
+
+	for (uint i = 0; i < BOARD_CACHE_SIZE; i++) {
+		Cached_board *c = &tree->cache[i];
+		if (c->node == node) {
+			c->last_used = ++tree->cache_clock;
+			return c;
+		}
+	}
+
+	return NULL;
+}
+
+// Claims the least recently used cache entry for node. Its board is left for
+// the caller to fill in.
+static Cached_board *claim_cached_board(Game_tree *tree, Game *node)
+{
+	if (tree->cache == NULL) {
+		tree->cache = malloc(BOARD_CACHE_SIZE * sizeof *tree->cache);
+		for (uint i = 0; i < BOARD_CACHE_SIZE; i++) {
+			tree->cache[i].node = NULL;
+			tree->cache[i].last_used = 0;
+		}
+	}
+
+	Cached_board *oldest = &tree->cache[0];
+	for (uint i = 1; i < BOARD_CACHE_SIZE; i++)
+		if (tree->cache[i].last_used < oldest->last_used)
+			oldest = &tree->cache[i];
+
+	oldest->node = node;
+	oldest->last_used = ++tree->cache_clock;
+
+	return oldest;
+}
+
+// Returns the board for the position at game. For nodes that aren't
+// checkpoints, this may be a cached board that gets reused once a few other
+// boards in the same tree have been asked for, so it shouldn't be held onto.
+Board *game_board(Game *game)
+{
+	if (game->board != NULL)
+		return game->board;
+
+	Game_tree *tree = game->tree;
+	Cached_board *cached = find_cached_board(tree, game);
+	if (cached != NULL)
+		return &cached->board;
+
+	// Walk back to the nearest node we have a board for, remembering the way
+	// so we can replay the moves forwards from there.
+	Game *path[MAX_CHECKPOINT_INTERVAL];
+	uint path_length = 0;
+	Board *base;
+
+	Game *node = game;
+	for (;;) {
+		path[path_length++] = node;
+		node = node->parent;
+
+		if (node->board != NULL) {
+			base = node->board;
+			break;
+		}
+		if ((cached = find_cached_board(tree, node)) != NULL) {
+			base = &cached->board;
+			break;
+		}
+	}
+
+	// If the base is itself the oldest cache entry, this copies it onto
+	// itself, which is fine.
+	Cached_board *slot = claim_cached_board(tree, game);
+	copy_board(&slot->board, base);
+	while (path_length > 0)
+		perform_move(&slot->board, path[--path_length]->move);
+
+	return &slot->board;
+}
 
+// How many plies back from game the nearest node with its own board is. This
+// is always less than the checkpoint interval was when game was added.
+static uint plies_since_checkpoint(Game *game)
+{
+	uint plies = 0;
+	for (; game->board == NULL; game = game->parent)
+		plies++;
+
+	return plies;
+}
+
+// The hash of the position at game, which doesn't need the board to be rebuilt.
+uint64_t game_hash(Game *game)
+{
+	// The root's board is filled in after it's created, so its hash is only
+	// on the board.
+	return game->board != NULL ? game->board->hash : game->hash;
+}
+
+// Frees the boards cached for game's tree. This is worth doing for trees that
+// are being kept around but aren't going to be looked at for a while. They'll
+// be rebuilt if they're needed again.
+void release_board_cache(Game *game)
+{
+	free(game->tree->cache);
+	game->tree->cache = NULL;
+}
+
+Game *add_child(Game *game, Move move)
+{
 	Game *children = game->children;
 
 	while (children != NULL && children->sibling != NULL &&
 			children->move != move)
 		children = children->sibling;
 
-	if (children != NULL && children->move == move) {
-		free(board);
+	if (children != NULL && children->move == move)
 		return children;
-	} else {
-		Game *new_node = new_game();
-		new_node->move = move;
-		new_node->board = board;
-		new_node->parent = game;
 
-		if (children == NULL)
-			game->children = new_node;
-		else
-			children->sibling = new_node;
+	Game_tree *tree = game->tree;
+	Board *parent_board = game_board(game);
+
+	Game *node = new_node(tree);
+	node->move = move;
+	node->ply = game->ply + 1;
+	node->parent = game;
 
-		return new_node;
+	// We need to work out the board either way, to get the hash. If this
+	// isn't a checkpoint, we keep it in the cache, as the next thing we're
+	// asked to do is quite likely to be adding a child to this node.
+	Board *board;
+	if (plies_since_checkpoint(game) + 1 >= tree->checkpoint_interval) {
+		board = arena_alloc(&tree->boards, sizeof *board);
+		node->board = board;
+	} else {
+		board = &claim_cached_board(tree, node)->board;
 	}
+
+	copy_board(board, parent_board);
+	perform_move(board, move);
+	node->hash = board->hash;
+
+	if (children == NULL)
+		game->children = node;
+	else
+		children->sibling = node;
+
+	return node;
 }
 
 Game *first_child(Game *game)
@@ -68,17 +257,102 @@ Game *last_node(Game *game)
 	return game;
 }
 
+// Writes the algebraic notation for each move of the mainline following game
+// (the moves that first_child leads to) into notation, which has room for max
+// moves. Returns the number written.
+//
+// The moves are played out on a single copy of game's board, rather than
+// getting a board for each node, which would mean rebuilding boards that
+// aren't checkpoints.
+uint mainline_notation(Game *game,
+		char notation[][MAX_ALGEBRAIC_NOTATION_LENGTH], uint max)
+{
+	Board board = *game_board(game);
+	uint count = 0;
+
+	for (Game *node = first_child(game); node != NULL && count < max;
+			node = first_child(node)) {
+		algebraic_notation_for(&board, node->move, notation[count++]);
+
+		Undo undo;
+		make_move(&board, node->move, &undo);
+	}
+
+	return count;
+}
+
 bool has_children(Game *game)
 {
 	return game->children != NULL;
 }
 
+// Frees the whole tree that game is a part of, not just game and its
+// children.
 void free_game(Game *game)
 {
-	free(game->board);
+	Game_tree *tree = game->tree;
+
+	arena_free(&tree->nodes);
+	arena_free(&tree->boards);
+	free(tree->cache);
+	free(tree);
+}
+
+// How many times the position at this node has occurred in the game so far,
+// including this one.
+//
+// A position can't repeat one from before a capture or pawn move, so we only
+// need to look back as far as the half-move clock goes. We also only need to
+// look at every other node, as the same player must be to move.
+uint repetition_count(Game *game)
+{
+	uint64_t hash = game_hash(game);
+	uint plies_left = game_board(game)->half_move_clock;
+	uint count = 1;
+
+	Game *node = game;
+	while (plies_left >= 2 && node->parent != NULL &&
+			node->parent->parent != NULL) {
+		node = node->parent->parent;
+		plies_left -= 2;
+
+		if (game_hash(node) == hash)
+			count++;
+	}
+
+	return count;
+}
+
+// Works out which of the draw rules apply to the position at this node. The
+// result is a combination of Draw_reasons, or zero if none apply.
+// Checkmate takes precedence over all of them.
+uint draw_status(Game *game)
+{
+	Board *board = game_board(game);
+
+	Move_list moves;
+	generate_legal_moves(board, &moves);
+	bool stuck = moves.count == 0;
+	bool check = in_check(board, board->turn);
+	if (stuck && check)
+		return 0;
+
+	uint status = 0;
+	if (stuck)
+		status |= DRAW_STALEMATE;
+	if (insufficient_material(board))
+		status |= DRAW_INSUFFICIENT_MATERIAL;
+
+	if (board->half_move_clock >= 150)
+		status |= DRAW_SEVENTY_FIVE_MOVE_RULE;
+	if (board->half_move_clock >= 100)
+		status |= DRAW_FIFTY_MOVE_RULE;
+
+	uint repetitions = repetition_count(game);
+	if (repetitions >= 5)
+		status |= DRAW_FIVEFOLD_REPETITION;
+	if (repetitions >= 3)
+		status |= DRAW_THREEFOLD_REPETITION;
 
-	if (game->sibling != NULL)
-		free_game(game->sibling);
-	if (game->children != NULL)
-		free_game(game->sibling);
+	return status;
 }
@@ -7,25 +7,75 @@
 // Games are represented as trees where each node has an arbitrary number of
 // children. This is to make variations easy to store. Linked lists are used
 // to store the children for ease of inserting new elements.
+//
+// All the nodes and boards in a tree are allocated from arenas belonging to
+// the tree, so that they're packed together in the order they were added,
+// and the whole tree can be freed at once.
+//
+// By default every node has its own board. To save memory, a tree can instead
+// keep boards only every so many plies (see set_checkpoint_interval). The
+// boards in between are rebuilt when needed by replaying moves from the last
+// checkpoint, and the most recently used ones are cached. Either way, use
+// game_board to get at the board for a node rather than the board field.
 
 struct Game;
+struct Game_tree;
 
 typedef struct Game
 {
 	Move move;
+	// NULL if this node isn't a checkpoint. The root always has a board.
 	Board *board;
+	// The hash of the board at this node, so that positions can be compared
+	// without rebuilding boards.
+	uint64_t hash;
+	// The number of half-moves since the root
+	uint ply;
 
 	struct Game *parent;
 	struct Game *children;
 	struct Game *sibling;
+
+	struct Game_tree *tree;
 } Game;
 
+// Never keep a board for more than this many plies in a row, so that
+// rebuilding a board never replays more moves than this.
+#define MAX_CHECKPOINT_INTERVAL 64
+#define DEFAULT_CHECKPOINT_INTERVAL 16
+
 Game *new_game();
+void set_checkpoint_interval(Game *game, uint interval);
+Board *game_board(Game *game);
+uint64_t game_hash(Game *game);
+void release_board_cache(Game *game);
 Game *add_child(Game *game, Move move);
 Game *first_child(Game *game);
 Game *root_node(Game *game);
 Game *last_node(Game *game);
+uint mainline_notation(Game *game,
+		char notation[][MAX_ALGEBRAIC_NOTATION_LENGTH], uint max);
 bool has_children(Game *game);
 void free_game(Game *game);
 
+// Reasons a game might be drawn. draw_status returns a combination of these.
+typedef enum Draw_reason
+{
+	// These can be claimed by either player
+	DRAW_THREEFOLD_REPETITION   = 1 << 0,
+	DRAW_FIFTY_MOVE_RULE        = 1 << 1,
+	// These end the game straight away
+	DRAW_FIVEFOLD_REPETITION    = 1 << 2,
+	DRAW_SEVENTY_FIVE_MOVE_RULE = 1 << 3,
+	DRAW_INSUFFICIENT_MATERIAL  = 1 << 4,
+	DRAW_STALEMATE              = 1 << 5,
+} Draw_reason;
+
+#define DRAW_CLAIMABLE (DRAW_THREEFOLD_REPETITION | DRAW_FIFTY_MOVE_RULE)
+#define DRAW_AUTOMATIC (DRAW_FIVEFOLD_REPETITION | \
+		DRAW_SEVENTY_FIVE_MOVE_RULE | DRAW_INSUFFICIENT_MATERIAL | DRAW_STALEMATE)
+
+uint repetition_count(Game *game);
+uint draw_status(Game *game);
+
 #endif // include guard
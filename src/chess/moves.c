@@ -1,30 +1,63 @@
+#include <ctype.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "attacks.h"
+#include "bitboard.h"
 #include "board.h"
 #include "moves.h"
+#include "zobrist.h"
 
 // Assumes the move is legal. This is necessary as the easiest way to test
 // whether a move doesn't put the moving player in check (illegal) is to
 // perform the move and then test if they are in check.
 void perform_move(Board *board, Move move)
+{
+	Undo undo;
+	make_move(board, move, &undo);
+}
+
+// The square of the pawn captured by an en passant capture ending on end.
+#define EN_PASSANT_VICTIM(end, capturer) \
+	SQUARE(SQUARE_X(end), (capturer) == WHITE ? 4 : 3)
+
+// Like perform_move, but also fills in undo with everything needed to take
+// the move back again with unmake_move.
+void make_move(Board *board, Move move, Undo *undo)
 {
 	Square start = START_SQUARE(move);
 	Square end = END_SQUARE(move);
 	Piece p = PIECE_AT_SQUARE(board, start);
 	Piece_type type = PIECE_TYPE(p);
 
+	undo->moved = p;
+	undo->captured = PIECE_AT_SQUARE(board, end);
+	undo->castling[WHITE] = board->castling[WHITE];
+	undo->castling[BLACK] = board->castling[BLACK];
+	undo->en_passant = board->en_passant;
+	undo->half_move_clock = board->half_move_clock;
+	undo->move_number = board->move_number;
+	undo->hash = board->hash;
+
+	// Castling rights and en passant are easiest to update in the hash by
+	// taking out the old values now and putting in the new ones at the end.
+	board->hash ^= zobrist_castling_keys[CASTLING_INDEX(board)] ^
+		en_passant_key(board);
+
 	board->half_move_clock++;
 	if (PLAYER(p) == BLACK)
 		board->move_number++;
 
 	// Check if we're capturing en passant
-	if (type == PAWN && end == board->en_passant)
-		PIECE_AT(board, SQUARE_X(end), PLAYER(p) == WHITE ? 4 : 3) = EMPTY;
+	if (type == PAWN && end == board->en_passant) {
+		Square victim = EN_PASSANT_VICTIM(end, PLAYER(p));
+		undo->captured = PIECE_AT_SQUARE(board, victim);
+		set_piece(board, victim, EMPTY);
+	}
 
 	// Check if this move enables our opponent to perform en passant
-	uint dy = SQUARE_Y(end) - SQUARE_Y(start);
+	int dy = SQUARE_Y(end) - SQUARE_Y(start);
 	if (type == PAWN && abs(dy) == 2) {
 		int en_passant_rank = PLAYER(p) == WHITE ? 2 : 5;
 		board->en_passant = SQUARE(SQUARE_X(start), en_passant_rank);
@@ -34,25 +67,26 @@ void perform_move(Board *board, Move move)
 	}
 
 	// Check if we're castling so we can move the rook too
-	uint dx = SQUARE_X(end) - SQUARE_X(start);
+	int dx = SQUARE_X(end) - SQUARE_X(start);
 	if (type == KING && abs(dx) > 1) {
 		uint y = PLAYER(p) == WHITE ? 0 : BOARD_SIZE - 1;
 		bool kingside = SQUARE_X(end) == 6;
 		if (kingside) {
-			PIECE_AT(board, 7, y) = EMPTY;
-			PIECE_AT(board, 5, y) = PIECE(PLAYER(p), ROOK);
+			set_piece(board, SQUARE(7, y), EMPTY);
+			set_piece(board, SQUARE(5, y), PIECE(PLAYER(p), ROOK));
 		} else {
-			PIECE_AT(board, 0, y) = EMPTY;
-			PIECE_AT(board, 3, y) = PIECE(PLAYER(p), ROOK);
+			set_piece(board, SQUARE(0, y), EMPTY);
+			set_piece(board, SQUARE(3, y), PIECE(PLAYER(p), ROOK));
 		}
 	}
 
 	// Check if we're depriving ourself of castling rights
 	Castling *c = &board->castling[PLAYER(p)];
+	uint home_rank = PLAYER(p) == WHITE ? 0 : BOARD_SIZE - 1;
 	if (type == KING) {
 		c->kingside = false;
 		c->queenside = false;
-	} else if (type == ROOK) {
+	} else if (type == ROOK && SQUARE_Y(start) == home_rank) {
 		if (SQUARE_X(start) == BOARD_SIZE - 1) {
 			c->kingside = false;
 		} else if (SQUARE_X(start) == 0) {
@@ -60,6 +94,18 @@ void perform_move(Board *board, Move move)
 		}
 	}
 
+	// Check if we're depriving our opponent of castling rights by capturing
+	// one of their rooks before it's moved
+	Castling *other_c = &board->castling[OTHER_PLAYER(PLAYER(p))];
+	uint other_home_rank = PLAYER(p) == WHITE ? BOARD_SIZE - 1 : 0;
+	if (SQUARE_Y(end) == other_home_rank) {
+		if (SQUARE_X(end) == BOARD_SIZE - 1) {
+			other_c->kingside = false;
+		} else if (SQUARE_X(end) == 0) {
+			other_c->queenside = false;
+		}
+	}
+
 	// Check if we should reset the half-move clock
 	if (type == PAWN || PIECE_AT_SQUARE(board, end) != EMPTY)
 		board->half_move_clock = 0;
@@ -67,8 +113,59 @@ void perform_move(Board *board, Move move)
 	// Update the turn tracker
 	board->turn = OTHER_PLAYER(board->turn);
 
-	PIECE_AT_SQUARE(board, end) = PIECE_AT_SQUARE(board, start);
-	PIECE_AT_SQUARE(board, start) = EMPTY;
+	// Check if we're promoting. If the move doesn't say what to promote to,
+	// we assume a queen, as that's almost always what's wanted.
+	if (type == PAWN && SQUARE_Y(end) == other_home_rank) {
+		Piece_type promotion = PROMOTION(move);
+		p = PIECE(PLAYER(p), promotion == EMPTY ? QUEEN : promotion);
+	}
+
+	set_piece(board, end, p);
+	set_piece(board, start, EMPTY);
+
+	board->hash ^= zobrist_castling_keys[CASTLING_INDEX(board)] ^
+		zobrist_black_to_move_key ^ en_passant_key(board);
+}
+
+// Takes back a move made by make_move. The board must be exactly as make_move
+// left it.
+void unmake_move(Board *board, Move move, const Undo *undo)
+{
+	Square start = START_SQUARE(move);
+	Square end = END_SQUARE(move);
+	Piece p = undo->moved;
+	Player player = PLAYER(p);
+
+	// This also turns promoted pieces back into pawns
+	set_piece(board, start, p);
+
+	if (PIECE_TYPE(p) == PAWN && end == undo->en_passant) {
+		set_piece(board, end, EMPTY);
+		set_piece(board, EN_PASSANT_VICTIM(end, player), undo->captured);
+	} else {
+		set_piece(board, end, undo->captured);
+	}
+
+	// Put the rook back if we castled
+	if (PIECE_TYPE(p) == KING &&
+			abs((int)SQUARE_X(end) - (int)SQUARE_X(start)) > 1) {
+		uint y = player == WHITE ? 0 : BOARD_SIZE - 1;
+		if (SQUARE_X(end) == 6) {
+			set_piece(board, SQUARE(5, y), EMPTY);
+			set_piece(board, SQUARE(7, y), PIECE(player, ROOK));
+		} else {
+			set_piece(board, SQUARE(3, y), EMPTY);
+			set_piece(board, SQUARE(0, y), PIECE(player, ROOK));
+		}
+	}
+
+	board->turn = player;
+	board->castling[WHITE] = undo->castling[WHITE];
+	board->castling[BLACK] = undo->castling[BLACK];
+	board->en_passant = undo->en_passant;
+	board->half_move_clock = undo->half_move_clock;
+	board->move_number = undo->move_number;
+	board->hash = undo->hash;
 }
 
 bool legal_move(Board *board, Move move, bool check_for_check)
@@ -105,12 +202,13 @@ bool legal_move(Board *board, Move move, bool check_for_check)
 
 	// Pieces other than knights are blocked by intervening pieces
 	if (type != KNIGHT) {
+		Bitboard occupied = OCCUPIED(board);
 		uint x = SQUARE_X(start) + x_direction;
 		uint y = SQUARE_Y(start) + y_direction;
 
 		while ((!(x == SQUARE_X(end) && y == SQUARE_Y(end))) &&
 				x < BOARD_SIZE && y < BOARD_SIZE) {
-			if (PIECE_AT(board, x, y) != EMPTY)
+			if ((occupied & SQUARE_BIT(SQUARE(x, y))) != 0)
 				return false;
 
 			x += x_direction;
@@ -194,47 +292,380 @@ bool legal_move(Board *board, Move move, bool check_for_check)
 		return legal_movement;
 }
 
+// Adds a move from start to each of the squares in targets.
+static void add_moves(Move_list *list, uint start, Bitboard targets)
+{
+	Square s = INDEX_SQUARE(start);
+	while (targets != EMPTY_BITBOARD) {
+		uint end = POP_LSB(targets);
+		list->moves[list->count++] = MOVE(s, INDEX_SQUARE(end));
+	}
+}
+
+// Adds a pawn move, or all four promotions if the pawn is reaching the last
+// rank.
+static void add_pawn_move(Move_list *list, uint start, uint end)
+{
+	Square s = INDEX_SQUARE(start);
+	Square e = INDEX_SQUARE(end);
+
+	if (SQUARE_Y(e) == 0 || SQUARE_Y(e) == BOARD_SIZE - 1) {
+		list->moves[list->count++] = PROMOTION_MOVE(s, e, QUEEN);
+		list->moves[list->count++] = PROMOTION_MOVE(s, e, ROOK);
+		list->moves[list->count++] = PROMOTION_MOVE(s, e, BISHOP);
+		list->moves[list->count++] = PROMOTION_MOVE(s, e, KNIGHT);
+	} else {
+		list->moves[list->count++] = MOVE(s, e);
+	}
+}
+
+#define RANK_MASK(y) ((Bitboard)0xFF << ((y) * BOARD_SIZE))
+
+static void generate_castling_moves(Board *board, Move_list *list)
+{
+	Player us = board->turn;
+	uint y = us == WHITE ? 0 : BOARD_SIZE - 1;
+
+	if (can_castle_kingside(board, us))
+		list->moves[list->count++] = MOVE(SQUARE(4, y), SQUARE(6, y));
+	if (can_castle_queenside(board, us))
+		list->moves[list->count++] = MOVE(SQUARE(4, y), SQUARE(2, y));
+}
+
+// The pieces that are the only thing between the king on king and one of
+// slider_owner's sliders. Looking straight through everything finds all the
+// sliders lined up on the king. If the blocker belongs to the king's side
+// it's pinned, and if it belongs to slider_owner moving it out of the way
+// gives a discovered check.
+static Bitboard lone_blockers(Board *board, uint king, Player slider_owner)
+{
+	Bitboard occupied = OCCUPIED(board);
+	Bitboard result = EMPTY_BITBOARD;
+	Bitboard snipers =
+		(rook_attacks(king, EMPTY_BITBOARD) &
+			(PIECES_OF(board, slider_owner, ROOK) |
+			 PIECES_OF(board, slider_owner, QUEEN))) |
+		(bishop_attacks(king, EMPTY_BITBOARD) &
+			(PIECES_OF(board, slider_owner, BISHOP) |
+			 PIECES_OF(board, slider_owner, QUEEN)));
+
+	while (snipers != EMPTY_BITBOARD) {
+		uint sniper = POP_LSB(snipers);
+		Bitboard blockers = BETWEEN(king, sniper) & occupied;
+		if (POPCOUNT(blockers) == 1)
+			result |= blockers;
+	}
+
+	return result;
+}
+
+// Fills list with every legal move for the player whose turn it is.
+//
+// Rather than generating every move and then weeding out the ones that leave
+// the king in check, we work out up front which pieces are pinned and what
+// (if anything) is giving check, and only generate moves that respect those.
+// The only move that needs to be tried out is en passant, as it can uncover
+// an attack along the rank by removing two pieces at once.
+void generate_legal_moves(Board *board, Move_list *list)
+{
+	Player us = board->turn;
+	Player them = OTHER_PLAYER(us);
+	Bitboard ours = board->by_player[us];
+	Bitboard theirs = board->by_player[them];
+	Bitboard occupied = ours | theirs;
+
+	list->count = 0;
+
+	Bitboard king_bit = PIECES_OF(board, us, KING);
+	if (king_bit == EMPTY_BITBOARD)
+		return;
+	uint king = LSB_INDEX(king_bit);
+
+	Bitboard checkers = attackers_of(board, king, them, occupied);
+
+	// The king can go anywhere that isn't attacked. We take it off the board
+	// while checking, otherwise it could hide from a slider behind itself.
+	Bitboard king_targets = KING_ATTACKS(king) & ~ours;
+	while (king_targets != EMPTY_BITBOARD) {
+		uint target = POP_LSB(king_targets);
+		if (attackers_of(board, target, them, occupied ^ king_bit) == 0)
+			list->moves[list->count++] =
+				MOVE(INDEX_SQUARE(king), INDEX_SQUARE(target));
+	}
+
+	if (checkers == EMPTY_BITBOARD)
+		generate_castling_moves(board, list);
+
+	// In double check only the king can move
+	if (POPCOUNT(checkers) > 1)
+		return;
+
+	// In check, other pieces must capture the checking piece or block it
+	Bitboard allowed = ~ours;
+	if (checkers != EMPTY_BITBOARD) {
+		uint checker = LSB_INDEX(checkers);
+		allowed = BETWEEN(king, checker) | checkers;
+	}
+
+	Bitboard pinned = lone_blockers(board, king, them) & ours;
+
+	for (Piece_type type = KNIGHT; type <= QUEEN; type++) {
+		Bitboard pieces = PIECES_OF(board, us, type);
+
+		while (pieces != EMPTY_BITBOARD) {
+			uint start = POP_LSB(pieces);
+			Bitboard targets;
+
+			switch (type) {
+			case KNIGHT: targets = KNIGHT_ATTACKS(start); break;
+			case BISHOP: targets = bishop_attacks(start, occupied); break;
+			case ROOK:   targets = rook_attacks(start, occupied); break;
+			default:     targets = queen_attacks(start, occupied); break;
+			}
+
+			targets &= allowed;
+			// Pinned pieces can only move along the line of the pin
+			if ((pinned & BIT(start)) != 0)
+				targets &= LINE(king, start);
+
+			add_moves(list, start, targets);
+		}
+	}
+
+	// Pawns on the first or last rank can only come from a bad FEN string,
+	// and would push off the edge of the board.
+	Bitboard pawns = PIECES_OF(board, us, PAWN) &
+		~(RANK_MASK(0) | RANK_MASK(BOARD_SIZE - 1));
+	int forward = us == WHITE ? BOARD_SIZE : -BOARD_SIZE;
+	uint double_push_rank = us == WHITE ? 1 : BOARD_SIZE - 2;
+
+	while (pawns != EMPTY_BITBOARD) {
+		uint start = POP_LSB(pawns);
+		Bitboard targets = EMPTY_BITBOARD;
+
+		uint one_step = start + forward;
+		if ((occupied & BIT(one_step)) == 0) {
+			targets |= BIT(one_step);
+
+			uint two_steps = one_step + forward;
+			if (start / BOARD_SIZE == double_push_rank &&
+					(occupied & BIT(two_steps)) == 0)
+				targets |= BIT(two_steps);
+		}
+
+		targets |= PAWN_ATTACKS(us, start) & theirs;
+
+		targets &= allowed;
+		if ((pinned & BIT(start)) != 0)
+			targets &= LINE(king, start);
+
+		while (targets != EMPTY_BITBOARD)
+			add_pawn_move(list, start, POP_LSB(targets));
+	}
+
+	if (board->en_passant != NULL_SQUARE) {
+		uint target = SQUARE_INDEX(board->en_passant);
+		uint captured = target - forward;
+
+		// En passant is the one move where we just try it and see. Taking two
+		// pieces off the same rank can expose the king in a way that
+		// checking for pins doesn't catch.
+		Bitboard capturers = PAWN_ATTACKS(them, target) &
+			PIECES_OF(board, us, PAWN);
+		if ((PIECES_OF(board, them, PAWN) & BIT(captured)) == 0)
+			capturers = EMPTY_BITBOARD;
+
+		while (capturers != EMPTY_BITBOARD) {
+			uint start = POP_LSB(capturers);
+			Bitboard after = (occupied ^ BIT(start) ^ BIT(captured)) | BIT(target);
+
+			if (attackers_of(board, king, them, after) == EMPTY_BITBOARD)
+				list->moves[list->count++] =
+					MOVE(INDEX_SQUARE(start), INDEX_SQUARE(target));
+		}
+	}
+}
+
+// Finds the move in list from start to end. If promotion is EMPTY and the move
+// is a promotion, the queen promotion is returned.
+Move find_legal_move(Move_list *list, Square start, Square end,
+		Piece_type promotion)
+{
+	for (uint i = 0; i < list->count; i++) {
+		Move m = list->moves[i];
+		if (START_SQUARE(m) != start || END_SQUARE(m) != end)
+			continue;
+
+		if (PROMOTION(m) == promotion ||
+				(promotion == EMPTY && PROMOTION(m) == QUEEN))
+			return m;
+	}
+
+	return NULL_MOVE;
+}
+
 bool gives_check(Board *board, Move move, Player player)
 {
-	Board copy;
-	copy_board(&copy, board);
-	perform_move(&copy, move);
+	Undo undo;
+	make_move(board, move, &undo);
+	bool check = in_check(board, player);
+	unmake_move(board, move, &undo);
 
-	return in_check(&copy, player);
+	return check;
 }
 
-bool gives_mate(Board *board, Move move, Player player)
+// Everything about a position that writing moves in algebraic notation
+// needs, worked out once and shared between all the moves from it. This
+// saves trying each move out on the board to see if it's a check, and
+// testing every other square to see if a move needs disambiguating.
+typedef struct Notation_context
+{
+	Bitboard occupied;
+	// Our king, for pins
+	uint king;
+	// Their king, for checks. Only a bad FEN string could leave either of
+	// them off the board, in which case the bit is empty.
+	Bitboard their_king;
+	// Our pieces that can't leave the line between them and our king
+	Bitboard pinned;
+	// Our pieces that give a discovered check if they move off the line
+	// between them and their king
+	Bitboard discoverers;
+} Notation_context;
+
+static void init_notation_context(Board *board, Notation_context *ctx)
 {
-	Board copy;
-	copy_board(&copy, board);
-	perform_move(&copy, move);
+	Player us = board->turn;
+	Player them = OTHER_PLAYER(us);
+	Bitboard ours = board->by_player[us];
+	Bitboard king_bit = PIECES_OF(board, us, KING);
+
+	ctx->occupied = OCCUPIED(board);
+	ctx->their_king = PIECES_OF(board, them, KING);
+	ctx->pinned = EMPTY_BITBOARD;
+	ctx->discoverers = EMPTY_BITBOARD;
+
+	if (king_bit != EMPTY_BITBOARD) {
+		ctx->king = LSB_INDEX(king_bit);
+		ctx->pinned = lone_blockers(board, ctx->king, them) & ours;
+	}
+	if (ctx->their_king != EMPTY_BITBOARD)
+		ctx->discoverers =
+			lone_blockers(board, LSB_INDEX(ctx->their_king), us) & ours;
+}
 
-	return checkmate(&copy, player);
+// The squares a piece of the given type belonging to player on i attacks.
+static Bitboard piece_attacks(Piece_type type, Player player, uint i,
+		Bitboard occupied)
+{
+	switch (type) {
+	case PAWN:   return PAWN_ATTACKS(player, i);
+	case KNIGHT: return KNIGHT_ATTACKS(i);
+	case BISHOP: return bishop_attacks(i, occupied);
+	case ROOK:   return rook_attacks(i, occupied);
+	case QUEEN:  return queen_attacks(i, occupied);
+	case KING:   return KING_ATTACKS(i);
+	default:     return EMPTY_BITBOARD;
+	}
 }
 
-// Check whether we need to disambiguate between two pieces for a particular
-// move. e.g.: there are two rooks that can move to the square. If so, return
-// the location of the other piece that is confusing things.
-static Square ambiguous_piece(Board *board, Move move)
+// Check whether we need to disambiguate between pieces for a particular
+// move. e.g.: there are two rooks that can move to the square. The file is
+// given if that's enough to tell them apart, otherwise the rank, and if
+// neither is enough on its own (which takes three pieces), both.
+//
+// The move is legal, so if we're in check, moving to the end square deals
+// with it, and so would moving any other piece there. That leaves pins as the
+// only thing that could stop another piece that attacks the end square from
+// moving there. Pawns and kings never need this: a pawn capture always gives
+// its file anyway, and there's only one king.
+static void disambiguation_needed(Board *board, Notation_context *ctx,
+		Move move, bool *need_file, bool *need_rank)
 {
+	uint start = SQUARE_INDEX(START_SQUARE(move));
+	uint end = SQUARE_INDEX(END_SQUARE(move));
+	Player us = board->turn;
 	Piece_type type = PIECE_TYPE(PIECE_AT_SQUARE(board, START_SQUARE(move)));
-	for (uint x = 0; x < BOARD_SIZE; x++) {
-		for (uint y = 0; y < BOARD_SIZE; y++) {
-			Square curr_square = SQUARE(x, y);
-			if (curr_square == START_SQUARE(move))
-				continue;
-			if (PIECE_TYPE(PIECE_AT_SQUARE(board, curr_square)) == type &&
-					legal_move(board, MOVE(curr_square, END_SQUARE(move)), true))
-				return curr_square;
-		}
+
+	// Pieces that attack the end square are exactly the ones the end square
+	// would attack as the same type of piece
+	Bitboard others = piece_attacks(type, us, end, ctx->occupied) &
+		PIECES_OF(board, us, type) & ~BIT(start);
+	bool ambiguous = false;
+	bool same_file = false;
+	bool same_rank = false;
+
+	while (others != EMPTY_BITBOARD) {
+		uint other = POP_LSB(others);
+		if ((ctx->pinned & BIT(other)) != 0 &&
+				(LINE(ctx->king, other) & BIT(end)) == 0)
+			continue;
+
+		ambiguous = true;
+		same_file = same_file || other % BOARD_SIZE == start % BOARD_SIZE;
+		same_rank = same_rank || other / BOARD_SIZE == start / BOARD_SIZE;
 	}
 
-	return NULL_SQUARE;
+	*need_file = ambiguous && (!same_file || same_rank);
+	*need_rank = ambiguous && same_file;
 }
 
-// str should have space for at least 7 (MAX_ALGEBRAIC_NOTATION_LENGTH)
-// characters, to be able to fit the longest of moves.
-void algebraic_notation_for(Board *board, Move move, char *str)
+// Whether the move puts the other player in check, going by what the moving
+// piece attacks from where it lands and what it uncovers by leaving. Castling
+// and en passant move two pieces, so they're tried out on the board instead.
+static bool notation_gives_check(Board *board, Notation_context *ctx,
+		Move move)
+{
+	Player us = board->turn;
+	Square start = START_SQUARE(move);
+	Square end = END_SQUARE(move);
+	Piece_type type = PIECE_TYPE(PIECE_AT_SQUARE(board, start));
+	int dx = SQUARE_X(end) - SQUARE_X(start);
+
+	if (ctx->their_king == EMPTY_BITBOARD)
+		return false;
+
+	if ((type == KING && abs(dx) > 1) ||
+			(type == PAWN && end == board->en_passant))
+		return gives_check(board, move, OTHER_PLAYER(us));
+
+	uint s = SQUARE_INDEX(start);
+	uint e = SQUARE_INDEX(end);
+	uint their_king = LSB_INDEX(ctx->their_king);
+
+	if ((ctx->discoverers & BIT(s)) != 0 &&
+			(LINE(their_king, s) & BIT(e)) == 0)
+		return true;
+
+	// Same as in make_move, a promotion that doesn't say what it's to is to a
+	// queen
+	uint last_rank = us == WHITE ? BOARD_SIZE - 1 : 0;
+	if (type == PAWN && SQUARE_Y(end) == last_rank)
+		type = PROMOTION(move) == EMPTY ? QUEEN : PROMOTION(move);
+
+	// The piece has left its start square, which matters for a promoted
+	// piece looking back along the line it came from
+	Bitboard occupied = (ctx->occupied ^ BIT(s)) | BIT(e);
+	return (piece_attacks(type, us, e, occupied) & ctx->their_king) != 0;
+}
+
+// Whether a move that gives check is also mate. Checks are rare enough that
+// simply making the move and looking for replies is fine.
+static bool notation_gives_mate(Board *board, Move move)
+{
+	Undo undo;
+	make_move(board, move, &undo);
+
+	Move_list replies;
+	generate_legal_moves(board, &replies);
+
+	unmake_move(board, move, &undo);
+
+	return replies.count == 0;
+}
+
+static void notation_with_context(Board *board, Notation_context *ctx,
+		Move move, char *str)
 {
 	uint i = 0;
 	Square start = START_SQUARE(move);
@@ -242,50 +673,185 @@ void algebraic_notation_for(Board *board, Move move, char *str)
 	Piece p = PIECE_AT_SQUARE(board, start);
 	Piece_type type = PIECE_TYPE(p);
 
-	// Castling
-	// TODO: Castling can cause a check or a mate - needs +/#
-	if (type == KING && abs(SQUARE_X(start) - SQUARE_X(end)) > 1) {
-		if (SQUARE_X(end) == 6)
+	if (type == KING && abs((int)SQUARE_X(start) - (int)SQUARE_X(end)) > 1) {
+		// Castling
+		if (SQUARE_X(end) == 6) {
 			strcpy(str, "O-O");
-		else
+			i = 3;
+		} else {
 			strcpy(str, "O-O-O");
-
-		return;
+			i = 5;
+		}
+	} else {
+		// Pawns only change file when capturing, which catches en passant too
+		bool capture = PIECE_AT_SQUARE(board, end) != EMPTY ||
+			(type == PAWN && SQUARE_X(start) != SQUARE_X(end));
+
+		// Add the letter denoting the type of piece moving
+		if (type != PAWN)
+			str[i++] = "\0\0NBRQK"[type];
+
+		// Add the number/letter of the rank/file of the moving piece if
+		// necessary. We always add the file if it's a pawn capture, and
+		// that's all a pawn move ever needs.
+		bool need_file = type == PAWN && capture;
+		bool need_rank = false;
+		if (type != PAWN && type != KING)
+			disambiguation_needed(board, ctx, move, &need_file, &need_rank);
+
+		if (need_file)
+			str[i++] = FILE_CHAR(SQUARE_X(start));
+		if (need_rank)
+			str[i++] = RANK_CHAR(SQUARE_Y(start));
+
+		// Add an 'x' if its a capture
+		if (capture)
+			str[i++] = 'x';
+
+		// Add the target square
+		str[i++] = FILE_CHAR(SQUARE_X(end));
+		str[i++] = RANK_CHAR(SQUARE_Y(end));
+
+		// Add the piece being promoted to
+		if (PROMOTION(move) != EMPTY) {
+			str[i++] = '=';
+			str[i++] = "\0\0NBRQK"[PROMOTION(move)];
+		}
 	}
 
-	bool capture = PIECE_AT_SQUARE(board, END_SQUARE(move)) != EMPTY;
+	// Add a '#' if its mate, or a '+' if its check
+	if (notation_gives_check(board, ctx, move))
+		str[i++] = notation_gives_mate(board, move) ? '#' : '+';
 
-	// Add the letter denoting the type of piece moving
-	if (type != PAWN)
-		str[i++] = "\0\0NBRQK"[type];
+	str[i++] = '\0';
+}
 
-	// Add the number/letter of the rank/file of the moving piece if necessary
-	Square ambig = ambiguous_piece(board, move);
-	// We always add the file if it's a pawn capture
-	if (ambig != NULL_SQUARE || (type == PAWN && capture)) {
-		char disambiguate;
-		if (SQUARE_X(ambig) == SQUARE_X(start))
-			disambiguate = RANK_CHAR(SQUARE_Y(start));
-		else
-			disambiguate = FILE_CHAR(SQUARE_X(start));
+// str should have space for at least 8 (MAX_ALGEBRAIC_NOTATION_LENGTH)
+// characters, to be able to fit the longest of moves.
+void algebraic_notation_for(Board *board, Move move, char *str)
+{
+	Notation_context ctx;
+	init_notation_context(board, &ctx);
+	notation_with_context(board, &ctx, move, str);
+}
+
+// Writes the algebraic notation for every move in list into notation, in the
+// same order. All the moves must be legal moves from board. This is much
+// cheaper than calling algebraic_notation_for on each one, as what they have
+// in common is only worked out once.
+void algebraic_notation_for_moves(Board *board, Move_list *list,
+		char notation[][MAX_ALGEBRAIC_NOTATION_LENGTH])
+{
+	Notation_context ctx;
+	init_notation_context(board, &ctx);
+
+	for (uint i = 0; i < list->count; i++)
+		notation_with_context(board, &ctx, list->moves[i], notation[i]);
+}
 
-		str[i++] = disambiguate;
+// Finds the legal move that a move in algebraic notation refers to, e.g.
+// Nbd7 or exd8=Q+. notation doesn't need to be null-terminated. Returns
+// NULL_MOVE if it isn't a legal move, or isn't algebraic notation at all.
+//
+// Rather than working out where the piece could have come from, we generate
+// all the legal moves and pick out the one that fits. It's impossible to
+// parse a move without a reference to a particular board anyway, as something
+// like Bd5 could start from any square on that diagonal.
+Move parse_algebraic_notation(Board *board, const char *notation, size_t length)
+{
+	// First we remove 'x's, '+'s, '#'s and '='s, as we don't need them and
+	// they only complicate parsing.
+	char stripped[6]; // max length without 'x#+='s, + 1 for null terminator
+	size_t j = 0;
+	for (size_t i = 0; i < length; i++) {
+		char c = notation[i];
+		if (c == 'x' || c == '#' || c == '+' || c == '=')
+			continue;
+		if (j == sizeof stripped - 1)
+			return NULL_MOVE;
+
+		stripped[j++] = c;
 	}
+	stripped[j] = '\0';
 
-	// Add an 'x' if its a capture
-	if (capture)
-		str[i++] = 'x';
+	Move_list moves;
 
-	// Add the target square
-	str[i++] = FILE_CHAR(SQUARE_X(end));
-	str[i++] = RANK_CHAR(SQUARE_Y(end));
+	// Some programs write castling with zeros rather than 'O's
+	if (strcmp(stripped, "O-O") == 0 || strcmp(stripped, "O-O-O") == 0 ||
+			strcmp(stripped, "0-0") == 0 || strcmp(stripped, "0-0-0") == 0) {
+		uint y = board->turn == WHITE ? 0 : BOARD_SIZE - 1;
+		uint x = j == 3 ? 6 : 2;
 
-	// Add a '#' if its mate
-	if (gives_mate(board, move, OTHER_PLAYER(PLAYER(p))))
-		str[i++] = '#';
-	// Add a '+' if its check
-	else if (gives_check(board, move, OTHER_PLAYER(PLAYER(p))))
-		str[i++] = '+';
+		generate_legal_moves(board, &moves);
+		return find_legal_move(&moves, SQUARE(4, y), SQUARE(x, y), EMPTY);
+	}
 
-	str[i++] = '\0';
+	size_t i = 0;
+	Piece_type type;
+	Piece_type promotion = EMPTY;
+	// If it's a pawn move, the first char is a file, and there may be a piece
+	// to promote to at the end.
+	if (islower(stripped[0])) {
+		type = PAWN;
+
+		if (j > 0 && isupper(stripped[j - 1])) {
+			promotion = PIECE_TYPE(piece_from_char(stripped[--j]));
+			if (promotion == EMPTY || promotion == PAWN || promotion == KING)
+				return NULL_MOVE;
+		}
+	} else {
+		type = PIECE_TYPE(piece_from_char(stripped[0]));
+		if (type == EMPTY)
+			return NULL_MOVE;
+
+		i++;
+	}
+
+	// The target square is always the last two chars. Anything between the
+	// piece and the target square disambiguates the starting square.
+	if (j < i + 2)
+		return NULL_MOVE;
+
+	int disambig_file = -1;
+	int disambig_rank = -1;
+	for (; i < j - 2; i++) {
+		char c = stripped[i];
+		if (c >= 'a' && c <= 'h')
+			disambig_file = CHAR_FILE(c);
+		else if (c >= '1' && c <= '8')
+			disambig_rank = CHAR_RANK(c);
+		else
+			return NULL_MOVE;
+	}
+
+	char file_char = stripped[j - 2];
+	char rank_char = stripped[j - 1];
+	if (file_char < 'a' || file_char > 'h' || rank_char < '1' || rank_char > '8')
+		return NULL_MOVE;
+	Square target = SQUARE(CHAR_FILE(file_char), CHAR_RANK(rank_char));
+
+	// We know everything we need to from the notation, so now we can look
+	// for the move
+	generate_legal_moves(board, &moves);
+
+	for (uint n = 0; n < moves.count; n++) {
+		Move m = moves.moves[n];
+		Square start = START_SQUARE(m);
+
+		if (END_SQUARE(m) != target ||
+				PIECE_TYPE(PIECE_AT_SQUARE(board, start)) != type)
+			continue;
+		if (disambig_file != -1 && SQUARE_X(start) != (uint)disambig_file)
+			continue;
+		if (disambig_rank != -1 && SQUARE_Y(start) != (uint)disambig_rank)
+			continue;
+		// Promotions without a piece given are taken to be to a queen
+		if (PROMOTION(m) != promotion &&
+				!(promotion == EMPTY && PROMOTION(m) == QUEEN))
+			continue;
+
+		return m;
+	}
+
+	return NULL_MOVE;
 }
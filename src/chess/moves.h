@@ -1,14 +1,22 @@
 #ifndef MOVES_H_
 #define MOVES_H_
+
+#include <stddef.h>
+
 //
 // A move is represented as 4 bytes, with the start square in the two most
 // significant bytes, and the end square in the two least significant
 // bytes. Each pair of bytes has the file in the most significant byte, and
 // the rank in the least significant byte.
+// Squares only need the low 12 bits of their pair of bytes, so the top 4 bits
+// of the end square's pair hold the type of piece a pawn promotes to, or
+// EMPTY if the move isn't a promotion.
 typedef uint_fast32_t Move;
 #define MOVE(start, end) ((Move)(((start) << 16) | (end)))
+#define PROMOTION_MOVE(start, end, type) (MOVE(start, end) | ((Move)(type) << 12))
 #define START_SQUARE(m)  ((m) >> 16)
-#define END_SQUARE(m)    ((m) & 0xFFFF)
+#define END_SQUARE(m)    ((m) & 0x0FFF)
+#define PROMOTION(m)     ((Piece_type)(((m) >> 12) & 0xF))
 
 #define NULL_MOVE ((Move)(~((Move)0)))
 
@@ -19,13 +27,45 @@ typedef uint_fast32_t Move;
 #define CHAR_RANK(c)    ((c) - '1')
 
 
+// No legal position has more than 218 legal moves, so this is always enough.
+#define MAX_MOVES 256
+
+// A list of moves, intended to be stack allocated.
+typedef struct Move_list
+{
+	Move moves[MAX_MOVES];
+	uint count;
+} Move_list;
+
+// Everything about a board that making a move loses, so that the move can be
+// taken back without keeping a copy of the whole board.
+typedef struct Undo
+{
+	Piece moved;
+	Piece captured;
+	Castling castling[PLAYERS];
+	Square en_passant;
+	uint half_move_clock;
+	uint move_number;
+	uint64_t hash;
+} Undo;
+
 void perform_move(Board *board, Move move);
+void make_move(Board *board, Move move, Undo *undo);
+void unmake_move(Board *board, Move move, const Undo *undo);
 bool legal_move(Board *board, Move move, bool check_for_check);
 bool gives_check(Board *board, Move move, Player player);
+void generate_legal_moves(Board *board, Move_list *list);
+Move find_legal_move(Move_list *list, Square start, Square end,
+		Piece_type promotion);
 
 // Longest possible length of a move in algebraic notation.
-// e.g. Raxd1+\0
-#define MAX_ALGEBRAIC_NOTATION_LENGTH 7
+// e.g. exd8=Q+\0
+#define MAX_ALGEBRAIC_NOTATION_LENGTH 8
 void algebraic_notation_for(Board *board, Move move, char *str);
+void algebraic_notation_for_moves(Board *board, Move_list *list,
+		char notation[][MAX_ALGEBRAIC_NOTATION_LENGTH]);
+Move parse_algebraic_notation(Board *board, const char *notation,
+		size_t length);
 
 #endif // include guard
@@ -0,0 +1,88 @@
+#include <stdint.h>
+#include "attacks.h"
+#include "board.h"
+#include "moves.h"
+#include "packed.h"
+#include "zobrist.h"
+
+#define PACKED_START(p)     ((p) & 0x3F)
+#define PACKED_END(p)       (((p) >> 6) & 0x3F)
+#define PACKED_PROMOTION(p) ((Piece_type)((p) >> 12))
+
+#define PACKED_BLACK 0x8
+#define NO_EN_PASSANT 0xFF
+
+Packed_move pack_move(Move move)
+{
+	if (move == NULL_MOVE)
+		return NULL_PACKED_MOVE;
+
+	return (Packed_move)(SQUARE_INDEX(START_SQUARE(move)) |
+			(SQUARE_INDEX(END_SQUARE(move)) << 6) |
+			(PROMOTION(move) << 12));
+}
+
+Move unpack_move(Packed_move packed)
+{
+	if (packed == NULL_PACKED_MOVE)
+		return NULL_MOVE;
+
+	return PROMOTION_MOVE(INDEX_SQUARE(PACKED_START(packed)),
+			INDEX_SQUARE(PACKED_END(packed)), PACKED_PROMOTION(packed));
+}
+
+void pack_board(Packed_board *packed, Board *board)
+{
+	for (uint i = 0; i < BOARD_SIZE * BOARD_SIZE; i += 2) {
+		uint8_t byte = 0;
+		for (uint j = 0; j < 2; j++) {
+			Piece p = board->pieces[i + j];
+			uint8_t nibble = 0;
+			if (p != EMPTY)
+				nibble = PIECE_TYPE(p) | (PLAYER(p) == BLACK ? PACKED_BLACK : 0);
+
+			byte |= nibble << (j * 4);
+		}
+
+		packed->squares[i / 2] = byte;
+	}
+
+	packed->flags = (board->turn == WHITE ? 1 : 0) | (CASTLING_INDEX(board) << 1);
+	packed->en_passant = board->en_passant == NULL_SQUARE ?
+		NO_EN_PASSANT :
+		SQUARE_INDEX(board->en_passant);
+	packed->half_move_clock = board->half_move_clock;
+	packed->move_number = board->move_number;
+}
+
+void unpack_board(Board *board, Packed_board *packed)
+{
+	// A board that comes from here might be the first one the program sees
+	init_attack_tables();
+	init_zobrist_keys();
+
+	clear_board(board);
+
+	for (uint i = 0; i < BOARD_SIZE * BOARD_SIZE; i++) {
+		uint nibble = (packed->squares[i / 2] >> ((i % 2) * 4)) & 0xF;
+		if (nibble == 0)
+			continue;
+
+		Player player = (nibble & PACKED_BLACK) ? BLACK : WHITE;
+		set_piece(board, INDEX_SQUARE(i), PIECE(player, nibble & ~PACKED_BLACK));
+	}
+
+	uint castling = packed->flags >> 1;
+	board->turn = (packed->flags & 1) ? WHITE : BLACK;
+	board->castling[WHITE].kingside  = (castling & 1) != 0;
+	board->castling[WHITE].queenside = (castling & 2) != 0;
+	board->castling[BLACK].kingside  = (castling & 4) != 0;
+	board->castling[BLACK].queenside = (castling & 8) != 0;
+	board->en_passant = packed->en_passant == NO_EN_PASSANT ?
+		NULL_SQUARE :
+		INDEX_SQUARE(packed->en_passant);
+	board->half_move_clock = packed->half_move_clock;
+	board->move_number = packed->move_number;
+
+	board->hash = hash_board(board);
+}
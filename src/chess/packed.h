@@ -0,0 +1,39 @@
+#ifndef PACKED_H_
+#define PACKED_H_
+
+#include <stdint.h>
+#include "board.h"
+#include "moves.h"
+
+// Compact versions of Move and Board, for storing lots of them. These aren't
+// meant to be worked with directly: unpack them first.
+
+// A move packed into 16 bits. The low 6 bits are the index of the start
+// square, the next 6 bits the index of the end square, and the top 4 bits the
+// type of piece promoted to, as for Move.
+typedef uint16_t Packed_move;
+
+#define NULL_PACKED_MOVE ((Packed_move)0xFFFF)
+
+// 64 squares at 4 bits each, plus the rest of the state in Board. The hash
+// and bitboards aren't stored, as they can be worked out from the rest.
+typedef struct Packed_board
+{
+	// Two squares per byte, with the lower index in the low nibble. Each
+	// nibble holds the Piece_type, with bit 3 set for black pieces.
+	uint8_t squares[BOARD_SIZE * BOARD_SIZE / 2];
+	// Bit 0 is set if it's white to move, and bits 1-4 hold the castling
+	// rights, in the same order as CASTLING_INDEX in zobrist.h.
+	uint8_t flags;
+	// The index of the en passant square, or 0xFF if there isn't one
+	uint8_t en_passant;
+	uint16_t half_move_clock;
+	uint16_t move_number;
+} Packed_board;
+
+Packed_move pack_move(Move move);
+Move unpack_move(Packed_move packed);
+void pack_board(Packed_board *packed, Board *board);
+void unpack_board(Board *board, Packed_board *packed);
+
+#endif // include guard
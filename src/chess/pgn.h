@@ -1,5 +1,10 @@
+#ifndef PGN_H_
+#define PGN_H_
+
 #include <glib.h>
+#include <stdio.h>
 #include "game.h"
+#include "tags.h"
 
 // PGN spec, section 7
 // Numbers are one higher to include null-termination
@@ -18,11 +23,75 @@ typedef enum Result
 
 typedef struct PGN
 {
-	GHashTable *tags;
+	// In the order they're given in the file
+	Tag *tags;
+	uint tag_count;
 	Result result;
 	
 	Game *game;
 } PGN;
 
+// The value of one of a game's tags, or NULL if it doesn't have it
+const char *pgn_tag(PGN *pgn, Tag_name name);
+
+// Reads the first game in a file. Use a PGN_reader to get at the rest.
 bool read_pgn(PGN *pgn, const char *input_filename, GError **error);
 bool write_pgn(PGN *pgn, FILE *file);
+void free_pgn(PGN *pgn);
+
+// Writes games out through a large buffer, so that exporting lots of games
+// takes few write calls. Games are separated by blank lines, and movetext is
+// wrapped to fit in 80 columns. The file is flushed by pgn_writer_close, but
+// not closed.
+typedef struct PGN_writer PGN_writer;
+
+PGN_writer *pgn_writer_new(FILE *file);
+// Returns false if writing has failed, in which case error is set. Nothing
+// more gets written after a failure.
+bool pgn_writer_write(PGN_writer *writer, PGN *pgn, GError **error);
+// Writes out anything still buffered, and frees the writer.
+bool pgn_writer_close(PGN_writer *writer, GError **error);
+
+// Reads the games in a PGN file one at a time. The file is read in chunks
+// rather than all at once, so files of any size can be read in a small,
+// fixed amount of memory.
+typedef struct PGN_reader PGN_reader;
+
+PGN_reader *pgn_reader_open(const char *input_filename, GError **error);
+// Memory maps the file instead of reading it. Tokens then point straight into
+// the mapping, so nothing gets copied.
+PGN_reader *pgn_reader_open_mapped(const char *input_filename, GError **error);
+// Reads the next game into pgn, which must then be freed with free_pgn.
+// Returns false when there are no more games, or if there was an error, in
+// which case error is set.
+bool pgn_reader_next(PGN_reader *reader, PGN *pgn, GError **error);
+// Tokenizes the input in smaller chunks than usual, between 1 byte and the
+// default. This is only really useful for testing, as smaller chunks mean
+// more tokens get cut off by the end of a chunk. Call it before reading any
+// games.
+void pgn_reader_set_chunk_size(PGN_reader *reader, size_t chunk_size);
+void pgn_reader_close(PGN_reader *reader);
+
+// An index of where each game in a PGN file is, along with its seven tag
+// roster, so that any game can be read without reading the ones before it.
+// Working it out only means scanning the tags, not parsing any movetext, and
+// it's saved next to the PGN file (see pgn_index_open), so that opening the
+// file again is almost instant.
+typedef struct PGN_index PGN_index;
+
+PGN_index *pgn_index_open(const char *input_filename, GError **error);
+size_t pgn_index_game_count(PGN_index *index);
+const char *pgn_index_tag(PGN_index *index, size_t game, Roster_tag tag);
+// Parses a single game, which must then be freed with free_pgn
+bool pgn_index_read_game(PGN_index *index, size_t game, PGN *pgn,
+		GError **error);
+void pgn_index_free(PGN_index *index);
+
+// Reads every game in a file at once, splitting the work between the given
+// number of threads (0 means one per processor). On success *pgns is set to
+// an array of *game_count games, in the same order as they are in the file.
+// Each game must be freed with free_pgn, and then the array with free.
+bool import_pgn(const char *input_filename, uint threads,
+		PGN **pgns, size_t *game_count, GError **error);
+
+#endif // include guard
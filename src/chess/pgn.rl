@@ -1,14 +1,20 @@
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <gio/gio.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <zstd.h>
+#include "attacks.h"
 #include "board.h"
 #include "moves.h"
 #include "pgn.h"
+#include "zobrist.h"
 
 // TODO: error messages
 
@@ -26,24 +32,28 @@ typedef enum Token_type
 	L_BRACKET, R_BRACKET, L_ANGLE_BRACKET, R_ANGLE_BRACKET, 
 } Token_type;
 
-typedef union Token_value {
-	char *string;
-	uint integer;
-} Token_value;
-
+// Tokens are parsed as soon as the tokenizer finds them, so they can point
+// straight into the input rather than having their own copies of their text.
+// For strings, the text doesn't include the quotes, and escape sequences are
+// still in it.
 typedef struct Token
 {
 	Token_type type;
-	Token_value value;
+	const char *text;
+	size_t length;
+	// Only for integers
+	uint integer;
 } Token;
 
 void print_token(Token *t)
 {
+	int length = (int)t->length;
+
 	switch (t->type) {
-	case STRING: printf("STRING: %s\n", t->value.string); break;
-	case SYMBOL: printf("SYMBOL: %s\n", t->value.string); break;
-	case NAG: printf("NAG: %s\n", t->value.string); break;
-	case INTEGER: printf("INTEGER: %d\n", t->value.integer); break;
+	case STRING: printf("STRING: %.*s\n", length, t->text); break;
+	case SYMBOL: printf("SYMBOL: %.*s\n", length, t->text); break;
+	case NAG: printf("NAG: %.*s\n", length, t->text); break;
+	case INTEGER: printf("INTEGER: %d\n", t->integer); break;
 	case DOT: puts("DOT"); break;
 	case ASTERISK: puts("DOT"); break;
 	case L_SQUARE_BRACKET: puts("L_SQUARE_BRACKET"); break;
@@ -57,16 +67,21 @@ void print_token(Token *t)
 
 static bool symbol_is_integer(Token *t)
 {
-	char *str = t->value.string;
-	for (size_t i = 0; str[i] != '\0'; i++)
-		if (!isdigit(str[i]))
+	for (size_t i = 0; i < t->length; i++)
+		if (!isdigit(t->text[i]))
 			return false;
 
 	return true;
 }
-		
 
-static char *read_escaped_string(char *str, size_t length)
+// Is t the symbol str?
+static bool symbol_is(Token *t, const char *str)
+{
+	return t->type == SYMBOL && t->length == strlen(str) &&
+		memcmp(t->text, str, t->length) == 0;
+}
+
+static char *read_escaped_string(const char *str, size_t length)
 {
 	char *out = malloc(length + 1);
 	size_t j = 0;
@@ -104,483 +119,1982 @@ static char *read_escaped_string(char *str, size_t length)
 	return out;
 }
 
-static GArray *tokenize_pgn(char *buf, gsize length)
+// The pooled copy of a token's text (see tags.h), with escape sequences
+// taken out of strings.
+static const char *intern_token_text(Token *t)
 {
-	// The initial size (140) is just a rough estimate of the average number of
-	// tokens, based on 4 tokens for each of the 7 required tags, plus 4 tokens
-	// for each of 30 moves.
-	GArray *tokens = g_array_sized_new(FALSE, FALSE, sizeof(Token), 140);
+	if (t->type == STRING && memchr(t->text, '\\', t->length) != NULL) {
+		char *unescaped = read_escaped_string(t->text, t->length);
+		const char *pooled = intern_tag_value(unescaped, strlen(unescaped));
+		free(unescaped);
 
-	// Variables that Ragel needs
-	char *p = buf, *pe = buf + length;
-	char *eof = NULL;
-	char *ts, *te;
-	int cs, act;
-	// act is initialized for scanners, so it must be declared, but in this
-	// scanner we don't actually use it. This silences the compiler warning.
-	IGNORE(act);
+		return pooled;
+	}
 
-	%%write init;
-	%%{
-		action add_string {
-			// - 2 for quotes
-			size_t length = te - ts - 2;
-			char *token = read_escaped_string(ts + 1, length);
+	return intern_tag_value(t->text, t->length);
+}
 
-			Token t = { STRING, { token } };
+static Result parse_game_termination_marker(Token *t)
+{
+	if (t->type == ASTERISK)
+		return OTHER;
+	if (symbol_is(t, "1-0"))
+		return WHITE_WINS;
+	if (symbol_is(t, "0-1"))
+		return BLACK_WINS;
+	if (symbol_is(t, "1/2-1/2"))
+		return DRAW;
+	
+	return NULL_RESULT;
+}
 
-			g_array_append_val(tokens, t);
-		}
+static char *game_termination_marker(Result r)
+{
+	switch (r) {
+	case WHITE_WINS: return "1-0";
+	case BLACK_WINS: return "0-1";
+	case DRAW: return "1/2-1/2";
+	default: return "*";
+	}
+}
 
-		action add_symbol {
-			// + 1 for null terminator
-			size_t length = te - ts + 1;
-			char *token = malloc(length); 
-			strncpy(token, ts, length - 1);
-			token[length - 1] = '\0';
+// The characters that fixed tokens stand for, for error messages
+static const char fixed_token_chars[] =
+{
+	[DOT] = '.', [ASTERISK] = '*',
+	[L_SQUARE_BRACKET] = '[', [R_SQUARE_BRACKET] = ']',
+	[L_BRACKET] = '(', [R_BRACKET] = ')',
+	[L_ANGLE_BRACKET] = '<', [R_ANGLE_BRACKET] = '>',
+};
+
+static void unexpected_token_error(GError **err, const char *expected, Token *t)
+{
+	if (t->type == INTEGER) {
+		g_set_error(err, 0, 0, "%s, got %u", expected, t->integer);
+	} else if (t->type == STRING || t->type == SYMBOL || t->type == NAG) {
+		g_set_error(err, 0, 0, "%s, got %.*s", expected,
+				(int)t->length, t->text);
+	} else {
+		g_set_error(err, 0, 0, "%s, got %c", expected,
+				fixed_token_chars[t->type]);
+	}
+}
+
+// Input is tokenized this much at a time. Tokens are parsed as soon as
+// they're found, so there's never more than a chunk of input in memory (or
+// a little more, if a token is cut off by the end of a chunk).
+#define READ_CHUNK_SIZE (64 * 1024)
+
+// Compressed input is decompressed on a thread of its own, so that it
+// overlaps with parsing. The decompressed input is handed over in blocks
+// through a queue. There are only a few blocks, which go back and forth
+// between the two threads, so the decompressor can't get too far ahead.
+#define DECOMPRESS_BLOCK_SIZE (256 * 1024)
+#define DECOMPRESS_BLOCKS 4
+
+// How much compressed gzip input is read at a time
+#define GZIP_INPUT_SIZE (64 * 1024)
+
+typedef enum Compression
+{
+	UNCOMPRESSED,
+	GZIP,
+	ZSTD,
+} Compression;
+
+typedef struct Decompressed_block
+{
+	char *data;
+	size_t length;
+	// The last block is always empty, and says why it's the last
+	bool last;
+	GError *error;
+} Decompressed_block;
+
+typedef struct Decompressor
+{
+	Compression compression;
+	// The raw input
+	GInputStream *stream;
+
+	GConverter *gzip;
+	char *gzip_input;
+	size_t gzip_input_size;
+	size_t gzip_input_pos;
+	// Set while we're part way through a gzip member. A file can be several
+	// members one after the other, as from concatenating gzip files, or
+	// bgzip, and it only ends when there's no input left after one.
+	bool gzip_in_member;
+	// Like zstd_flushing below
+	bool gzip_flushing;
+
+	ZSTD_DStream *zstd;
+	ZSTD_inBuffer zstd_input;
+	// What ZSTD_decompressStream last returned, which is 0 only at the end
+	// of a frame
+	size_t zstd_remaining;
+	// Set when the last call filled the output, as there might be more
+	// output to come without any more input
+	bool zstd_flushing;
+
+	GThread *thread;
+	// Blocks waiting to be filled, and blocks waiting to be read
+	GAsyncQueue *empty;
+	GAsyncQueue *full;
+	Decompressed_block blocks[DECOMPRESS_BLOCKS];
+	gint cancelled;
+
+	// The block the reader is reading from, and how far through it it is
+	Decompressed_block *current;
+	size_t offset;
+} Decompressor;
+
+// Works out the compression from the magic number the input starts with
+static Compression detect_compression(const unsigned char *start, size_t length)
+{
+	if (length >= 2 && start[0] == 0x1F && start[1] == 0x8B)
+		return GZIP;
+	if (length >= 4 && start[0] == 0x28 && start[1] == 0xB5 &&
+			start[2] == 0x2F && start[3] == 0xFD)
+		return ZSTD;
+
+	return UNCOMPRESSED;
+}
+
+// Fills out with as much decompressed zstd input as will fit. Returns how much
+// was written, which is only 0 at the end of the input, or -1 on error.
+static gssize zstd_fill(Decompressor *d, char *out, size_t size,
+		GError **error)
+{
+	ZSTD_outBuffer output = { out, size, 0 };
+	// Input is read into the buffer that zstd_input points to
+	char *input_buf = (char *)d->zstd_input.src;
+
+	while (output.pos < output.size) {
+		if (d->zstd_input.pos == d->zstd_input.size && !d->zstd_flushing) {
+			gssize length = g_input_stream_read(d->stream, input_buf,
+					ZSTD_DStreamInSize(), NULL, error);
+			if (length < 0)
+				return -1;
+			if (length == 0) {
+				if (d->zstd_remaining != 0) {
+					g_set_error(error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+							"Truncated zstd input");
+					return -1;
+				}
+
+				break;
+			}
 
-			Token t = { SYMBOL, { token } };
+			d->zstd_input.size = length;
+			d->zstd_input.pos = 0;
+		}
 
-			g_array_append_val(tokens, t);
+		size_t ret = ZSTD_decompressStream(d->zstd, &output, &d->zstd_input);
+		if (ZSTD_isError(ret)) {
+			g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+					"Invalid zstd input: %s", ZSTD_getErrorName(ret));
+			return -1;
 		}
 
-		action add_nag {
-			// + 1 for null terminator
-			size_t length = te - ts + 1;
-			char *token = malloc(length); 
-			strncpy(token, ts, length - 1);
-			token[length - 1] = '\0';
+		d->zstd_remaining = ret;
+		d->zstd_flushing = output.pos == output.size;
+	}
+
+	return output.pos;
+}
 
-			Token t = { NAG, { token } };
+// Fills out with as much decompressed gzip input as will fit. Returns how much
+// was written, which is only 0 at the end of the input, or -1 on error.
+static gssize gzip_fill(Decompressor *d, char *out, size_t size,
+		GError **error)
+{
+	size_t written = 0;
+
+	while (written < size) {
+		if (d->gzip_input_pos == d->gzip_input_size && !d->gzip_flushing) {
+			gssize length = g_input_stream_read(d->stream, d->gzip_input,
+					GZIP_INPUT_SIZE, NULL, error);
+			if (length < 0)
+				return -1;
+			if (length == 0) {
+				if (d->gzip_in_member) {
+					g_set_error(error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+							"Truncated gzip input");
+					return -1;
+				}
+
+				break;
+			}
 
-			g_array_append_val(tokens, t);
+			d->gzip_input_size = length;
+			d->gzip_input_pos = 0;
 		}
 
-		# Token types, as per PGN spec section 7
-		# Integers are read as symbols, and we convert them in the second pass
+		// There's more input after the end of the last member, so it's the
+		// start of another one
+		if (!d->gzip_in_member) {
+			g_converter_reset(d->gzip);
+			d->gzip_in_member = true;
+		}
 
-		# We cheat a little bit here.
-		# According to the PGN spec, game termination markers are simply symbols.
-		# However, according to the definition of the symbol token, symbols
-		# cannot contain the '/' character. This seems like a contradiction, so
-		# to work around it we allow '/'s in symbols.
-		symbol = alnum (alnum | [_+#=:\-/])*;
-		string = '"' (('\\' print) | (print - '\\"'))* '"';
-		nag = '$' digit+;
+		gsize bytes_read, bytes_written;
+		GError *convert_error = NULL;
+		GConverterResult result = g_converter_convert(d->gzip,
+				d->gzip_input + d->gzip_input_pos,
+				d->gzip_input_size - d->gzip_input_pos,
+				out + written, size - written, G_CONVERTER_NO_FLAGS,
+				&bytes_read, &bytes_written, &convert_error);
+		if (result == G_CONVERTER_ERROR) {
+			// We thought there might be more output without more input,
+			// but there wasn't
+			if (d->gzip_flushing && g_error_matches(convert_error,
+						G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT)) {
+				g_error_free(convert_error);
+				d->gzip_flushing = false;
+				continue;
+			}
 
+			g_propagate_error(error, convert_error);
+			return -1;
+		}
 
-		main := |*
-			space;
-			symbol  => add_symbol;
-			string  => add_string;
-			nag     => add_nag;
-			'.'     => { Token t = { DOT,              { 0 } }; g_array_append_val(tokens, t); };
-			'*'     => { Token t = { ASTERISK,         { 0 } }; g_array_append_val(tokens, t); };
-			'['     => { Token t = { L_SQUARE_BRACKET, { 0 } }; g_array_append_val(tokens, t); };
-			']'     => { Token t = { R_SQUARE_BRACKET, { 0 } }; g_array_append_val(tokens, t); };
-			'('     => { Token t = { L_BRACKET,        { 0 } }; g_array_append_val(tokens, t); };
-			')'     => { Token t = { R_BRACKET,        { 0 } }; g_array_append_val(tokens, t); };
-			'<'     => { Token t = { L_ANGLE_BRACKET,  { 0 } }; g_array_append_val(tokens, t); };
-			'>'     => { Token t = { R_ANGLE_BRACKET,  { 0 } }; g_array_append_val(tokens, t); };
-		*|;
+		d->gzip_input_pos += bytes_read;
+		written += bytes_written;
+		d->gzip_in_member = result != G_CONVERTER_FINISHED;
+		d->gzip_flushing = d->gzip_in_member && written == size;
+	}
 
+	return written;
+}
 
-		write exec;
-	}%%
+static gpointer decompress_thread(gpointer data)
+{
+	Decompressor *d = data;
+
+	for (;;) {
+		Decompressed_block *block = g_async_queue_pop(d->empty);
+		block->length = 0;
+		block->last = false;
+		block->error = NULL;
+
+		// The reader's been closed before the end of the input
+		if (g_atomic_int_get(&d->cancelled)) {
+			block->last = true;
+			g_async_queue_push(d->full, block);
+			break;
+		}
 
-	// Integers are a subset of symbols, and unfortunately Ragel scanners
-	// attempt to match longer patterns before shorter ones.
-	// So we do a second pass to look for symbols that are integers.
-	for (size_t i = 0; i < tokens->len; i++) {
-		Token *t = &g_array_index(tokens, Token, i);
-		if (t->type == SYMBOL && symbol_is_integer(t)) {
-			int n;
-			sscanf(t->value.string, "%d", &n);
+		gssize length;
+		if (d->compression == GZIP) {
+			length = gzip_fill(d, block->data, DECOMPRESS_BLOCK_SIZE,
+					&block->error);
+		} else {
+			length = zstd_fill(d, block->data, DECOMPRESS_BLOCK_SIZE,
+					&block->error);
+		}
 
-			t->type = INTEGER;
-			t->value.integer = n;
+		if (length <= 0) {
+			block->last = true;
+			g_async_queue_push(d->full, block);
+			break;
 		}
+
+		block->length = length;
+		g_async_queue_push(d->full, block);
 	}
 
-	return tokens;
+	return NULL;
 }
 
-// It is impossible to parse a move without a reference to a particular board,
-// as something like Bd5 could start from any square on that diagonal.
-static Move parse_move(Board *board, char *notation)
+// Starts decompressing stream, which is compressed with the given
+// compression, on another thread.
+static Decompressor *new_decompressor(GInputStream *stream,
+		Compression compression)
 {
-	// First we remove 'x's, '+'s, and '#'s, as we don't need them and they only
-	// complicate parsing.
-	char stripped[5]; // max length without 'x#+'s, + 1 for null terminator
-	size_t j = 0;
-	for (size_t i = 0; notation[i] != '\0'; i++)
-		if (notation[i] != 'x' && notation[i] != '#' && notation[i] != '+')
-			stripped[j++] = notation[i];
-	stripped[j] = '\0';
-
-	if (strcmp(notation, "O-O") == 0) {
-		uint y = board->turn == WHITE ? 0 : 7;
-		return MOVE(SQUARE(4, y), SQUARE(6, y));
-	}
-	if (strcmp(notation, "O-O-O") == 0) {
-		uint y = board->turn == WHITE ? 0 : 7;
-		return MOVE(SQUARE(4, y), SQUARE(2, y));
-	}
-
-	size_t i = 0;
-	Piece_type type;
-	// If it's a pawn move, the target square starts at the beginning of the
-	// string
-	if (islower(stripped[0])) {
-		type = PAWN;
-
-		// An exception: if it's a move like exd5, the target square starts one 
-		// char further on
-		if (islower(stripped[1]))
-			i++;
+	Decompressor *d = malloc(sizeof *d);
+	d->compression = compression;
+	d->stream = g_object_ref(stream);
+	d->gzip = NULL;
+	d->zstd = NULL;
+
+	if (compression == GZIP) {
+		d->gzip = G_CONVERTER(
+				g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+		d->gzip_input = malloc(GZIP_INPUT_SIZE);
+		d->gzip_input_size = 0;
+		d->gzip_input_pos = 0;
+		d->gzip_in_member = false;
+		d->gzip_flushing = false;
 	} else {
-		type = PIECE_TYPE(piece_from_char(stripped[0]));
-		i++;
+		d->zstd = ZSTD_createDStream();
+		ZSTD_initDStream(d->zstd);
+		d->zstd_input.src = malloc(ZSTD_DStreamInSize());
+		d->zstd_input.size = 0;
+		d->zstd_input.pos = 0;
+		d->zstd_remaining = 0;
+		d->zstd_flushing = false;
 	}
-	
-	char disambig = 0;
-	if (j == 4)
-		// If it's this long, there must be a disambiguation char in there
-		disambig = stripped[i++];
-	
-	uint target_file = CHAR_FILE(stripped[i++]);
-	uint target_rank = CHAR_RANK(stripped[i++]);
-
-	if (disambig != 0) {
-		uint x = 0, y = 0, dx = 0, dy = 0;
-		if (disambig >= 'a' && disambig <= 'g') {
-			x = CHAR_FILE(disambig);
-			dy = 1;
-		} else if (disambig >= '1' && disambig <= '8') {
-			y = CHAR_RANK(disambig);
-			dx = 1;
-		} else {
-			return NULL_MOVE;
-		}
 
-		for (; x < BOARD_SIZE && y < BOARD_SIZE; x += dx, y += dy) {
-			Piece p = PIECE_AT(board, x, y);
-			if (PIECE_TYPE(p) != type || PLAYER(p) != board->turn)
-				continue;
+	d->empty = g_async_queue_new();
+	d->full = g_async_queue_new();
+	for (uint i = 0; i < DECOMPRESS_BLOCKS; i++) {
+		d->blocks[i].data = malloc(DECOMPRESS_BLOCK_SIZE);
+		g_async_queue_push(d->empty, &d->blocks[i]);
+	}
 
-			Move m = MOVE(SQUARE(x, y), SQUARE(target_file, target_rank));
-			if (legal_move(board, m, true))
-				return m;
+	d->cancelled = FALSE;
+	d->current = NULL;
+	d->offset = 0;
+
+	d->thread = g_thread_new("pgn-decompress", decompress_thread, d);
+
+	return d;
+}
+
+// Copies up to size bytes of decompressed input into buf. Returns how many
+// were copied, which is only 0 at the end of the input, or -1 on error.
+static gssize decompressor_read(Decompressor *d, char *buf, size_t size,
+		GError **error)
+{
+	while (d->current == NULL || d->offset == d->current->length) {
+		if (d->current != NULL) {
+			// Once we've had the last block, the thread has finished
+			if (d->current->last) {
+				if (d->current->error == NULL)
+					return 0;
+
+				g_propagate_error(error, d->current->error);
+				d->current->error = NULL;
+				return -1;
+			}
+
+			g_async_queue_push(d->empty, d->current);
 		}
 
-		return NULL_MOVE;
+		d->current = g_async_queue_pop(d->full);
+		d->offset = 0;
 	}
 
-	for (uint x = 0; x < BOARD_SIZE; x++) {
-		for (uint y = 0; y < BOARD_SIZE; y++) {
-			Piece p = PIECE_AT(board, x, y);
-			if (PIECE_TYPE(p) != type || PLAYER(p) != board->turn)
-				continue;
+	size_t length = d->current->length - d->offset;
+	if (length > size)
+		length = size;
 
-			Move m = MOVE(SQUARE(x, y), SQUARE(target_file, target_rank));
-			if (legal_move(board, m, true))
-				return m;
-		}
+	memcpy(buf, d->current->data + d->offset, length);
+	d->offset += length;
+
+	return length;
+}
+
+static void free_decompressor(Decompressor *d)
+{
+	// The thread might be waiting for an empty block, so keep giving them
+	// back to it until it sees that it's been cancelled.
+	g_atomic_int_set(&d->cancelled, TRUE);
+	while (d->current == NULL || !d->current->last) {
+		if (d->current != NULL)
+			g_async_queue_push(d->empty, d->current);
+
+		d->current = g_async_queue_pop(d->full);
+	}
+
+	g_thread_join(d->thread);
+
+	if (d->current->error != NULL)
+		g_error_free(d->current->error);
+	for (uint i = 0; i < DECOMPRESS_BLOCKS; i++)
+		free(d->blocks[i].data);
+	g_async_queue_unref(d->empty);
+	g_async_queue_unref(d->full);
+
+	if (d->gzip != NULL) {
+		g_object_unref(d->gzip);
+		free(d->gzip_input);
+	}
+	if (d->zstd != NULL) {
+		ZSTD_freeDStream(d->zstd);
+		free((char *)d->zstd_input.src);
 	}
 
-	return NULL_MOVE;
+	g_object_unref(d->stream);
+	free(d);
 }
 
-static Result parse_game_termination_marker(Token *t)
+// Where we're up to in parsing the current game
+// Recursive annotation variations can be nested inside each other, but
+// anything near this deep is almost certainly a broken file.
+#define MAX_VARIATION_DEPTH 64
+
+typedef enum Parse_state
 {
-	if (t->type == ASTERISK)
-		return OTHER;
-	if (t->type != SYMBOL)
-		return NULL_RESULT;
+	BETWEEN_GAMES,
+	// Expecting another tag, or the start of the movetext
+	TAGS, TAG_NAME, TAG_VALUE, TAG_END,
+	MOVETEXT,
+	// We've just had a move number, which can be followed by dots
+	AFTER_MOVE_NUMBER,
+	// There was an error in this game, so we ignore everything until the end
+	// of it. This way the next game can still be read.
+	SKIPPING_GAME,
+} Parse_state;
+
+struct PGN_reader
+{
+	// Input comes either from a memory mapped file, or from a stream which we
+	// read into our own buffer. Whichever one we're not using is NULL.
+	GMappedFile *mapped_file;
+	GInputStream *stream;
+	// Set if the stream is compressed, in which case we read from this
+	// instead of the stream
+	Decompressor *decompressor;
+	// Set once there's nothing left to read, whether or not it's all been
+	// through the tokenizer
+	bool end_of_input;
+	// Set once everything has been tokenized
+	bool finished;
+
+	// For mapped files, this is the whole file. For streams, it's the input
+	// we've read but not tokenized yet, plus any token that was cut off by
+	// the end of the last chunk.
+	char *buf;
+	// How much is allocated, for streams
+	size_t buf_size;
+	// How much of buf holds input, and how much of that has been tokenized
+	size_t length;
+	size_t tokenized;
+	// How much is read or tokenized at a time, which is READ_CHUNK_SIZE
+	// unless it's set smaller for testing
+	size_t chunk_size;
+
+	// Tokenizer state that has to survive from one chunk to the next
+	int cs, act;
+	char *ts, *te;
 
-	char *symbol = t->value.string;
-	if (strcmp(symbol, "1-0") == 0)
-		return WHITE_WINS;
-	if (strcmp(symbol, "0-1") == 0)
-		return BLACK_WINS;
-	if (strcmp(symbol, "1/2-1/2") == 0)
-		return DRAW;
-	
-	return NULL_RESULT;
+	// Parser state. The game being parsed is the PGN that was passed to
+	// pgn_reader_next, as a game is always read within a single call.
+	Parse_state state;
+	PGN *pgn;
+	// The last node added to the game
+	Game *game;
+	uint half_move_number;
+	// The half-move number of the game's first move, which is 2 unless it
+	// starts from a FEN tag
+	uint first_half_move;
+	// For each variation we're inside, the node to go back to at the end of
+	// it
+	Game *variation_stack[MAX_VARIATION_DEPTH];
+	uint variation_depth;
+	// The name of the tag whose value we're waiting for
+	Tag_name tag_name;
+	Tag_name fen_tag;
+	// Set when the tokenizer should stop, either because we've finished a
+	// game or because we've hit an error
+	bool game_done;
+	GError *error;
+};
+
+// Tags arrays start off big enough for the seven tag roster and one more,
+// which covers most games, and double in size from there.
+#define INITIAL_TAGS_SIZE 8
+
+static void add_tag(PGN *pgn, Tag_name name, const char *value)
+{
+	uint n = pgn->tag_count;
+	if (n == 0)
+		pgn->tags = malloc(INITIAL_TAGS_SIZE * sizeof *pgn->tags);
+	else if (n >= INITIAL_TAGS_SIZE && (n & (n - 1)) == 0)
+		pgn->tags = realloc(pgn->tags, 2 * n * sizeof *pgn->tags);
+
+	pgn->tags[n].name = name;
+	pgn->tags[n].value = value;
+	pgn->tag_count++;
 }
 
-static char *game_termination_marker(Result r)
+const char *pgn_tag(PGN *pgn, Tag_name name)
 {
-	switch (r) {
-	case WHITE_WINS: return "1-0";
-	case BLACK_WINS: return "0-1";
-	case DRAW: return "1/2-1/2";
-	default: return "*";
-	}
+	for (uint i = 0; i < pgn->tag_count; i++)
+		if (pgn->tags[i].name == name)
+			return pgn->tags[i].value;
+
+	return NULL;
 }
 
-static bool parse_tokens(PGN *pgn, GArray *tokens, GError **err)
+static void start_game(PGN_reader *reader)
 {
-	// Start with tags
-	pgn->tags = g_hash_table_new(g_str_hash, g_str_equal);
+	PGN *pgn = reader->pgn;
 
-	size_t i = 0;
-	while ((&g_array_index(tokens, Token, i))->type == L_SQUARE_BRACKET) {
-		Token *tag_name_token = &g_array_index(tokens, Token, ++i);
-		if (tag_name_token->type != SYMBOL) {
-			if (tag_name_token->type == INTEGER) {
-				g_set_error(err, 0, 0,
-						"Unexpected token: %d", tag_name_token->value.integer);
-			} else {
-				g_set_error(err, 0, 0,
-						"Unexpected token: %s", tag_name_token->value.string);
-			}
+	// The tags array is only allocated once there's a tag to put in it
+	pgn->tags = NULL;
+	pgn->tag_count = 0;
+	pgn->result = OTHER;
+	pgn->game = NULL;
 
-			return false;
-		}
+	reader->state = TAGS;
+}
 
-		char *tag_name = tag_name_token->value.string;
+static void start_movetext(PGN_reader *reader)
+{
+	Game *game = new_game();
+	reader->pgn->game = game;
+
+	// Games that don't start from the usual position have a FEN tag with the
+	// one they start from. There should be a SetUp tag too, but the FEN tag
+	// is plenty to go on.
+	const char *fen = pgn_tag(reader->pgn, reader->fen_tag);
+	if (!from_fen(game->board, fen == NULL ? start_board_fen : fen))
+		g_set_error(&reader->error, 0, 0, "Invalid FEN tag: %s", fen);
+
+	Board *board = game->board;
+	reader->game = game;
+	reader->first_half_move = 2 * board->move_number + (board->turn == BLACK);
+	reader->half_move_number = reader->first_half_move;
+	reader->variation_depth = 0;
+	reader->state = MOVETEXT;
+}
 
-		if (g_hash_table_contains(pgn->tags, tag_name)) {
-			g_set_error(err, 0, 0, "Duplicate tag: %s", tag_name);
-			return false;
-		}
+static void finish_game(PGN_reader *reader)
+{
+	PGN *pgn = reader->pgn;
 
-		Token *tag_value_token = &g_array_index(tokens, Token, ++i);
-		if (tag_value_token->type != STRING) {
-			if (tag_name_token->type == INTEGER) {
-				g_set_error(err, 0, 0, "Tag values must be strings, %d is not",
-						tag_value_token->value.integer);
-			} else {
-				g_set_error(err, 0, 0, "Tag values must be strings, %s is not",
-						tag_value_token->value.string);
-			}
+	// A game can have tags and no movetext, and it still gets a board
+	if (pgn->game == NULL)
+		start_movetext(reader);
 
-			return false;
-		}
+	// Give back the unused part of the tags array, as games can be kept
+	// around for a long time
+	if (pgn->tag_count != 0)
+		pgn->tags = realloc(pgn->tags, pgn->tag_count * sizeof *pgn->tags);
 
-		char *tag_value = tag_value_token->value.string;
+	reader->state = BETWEEN_GAMES;
+	reader->game_done = true;
+}
 
-		char *tag_name_copy = malloc(strlen(tag_name) + 1);
-		strcpy(tag_name_copy, tag_name);
-		char *tag_value_copy = malloc(strlen(tag_value) + 1);
-		strcpy(tag_value_copy, tag_value);
+static bool parse_tag_token(PGN_reader *reader, Token *t)
+{
+	PGN *pgn = reader->pgn;
 
-		g_hash_table_insert(pgn->tags, tag_name_copy, tag_value_copy);
+	switch (reader->state) {
+	case TAGS:
+		if (t->type == L_SQUARE_BRACKET) {
+			reader->state = TAG_NAME;
+			return true;
+		}
 
-		Token *close_square_bracket_token = &g_array_index(tokens, Token, ++i);
-		if (close_square_bracket_token->type != R_SQUARE_BRACKET) {
-			g_set_error(err, 0, 0,
-					"Tag %s has no matching close bracket", tag_name);
+		// Anything else is the start of the movetext
+		start_movetext(reader);
+		return false;
+	case TAG_NAME:
+		if (t->type != SYMBOL) {
+			unexpected_token_error(&reader->error, "Expected a tag name", t);
 			return false;
 		}
 
-		i++;
-	}
-
-	// Now the movetext section
-	uint half_move_number = 2;
+		reader->tag_name = intern_tag_name(t->text, t->length);
 
-	Game *game = new_game();
-	game->board = malloc(sizeof(Board));
-	pgn->game = game;
-	// TODO: Use value in start board tag if present.
-	from_fen(game->board, start_board_fen);
-
-	// TODO: variations, NAG
-	while (i < tokens->len) {
-		Token *t = &g_array_index(tokens, Token, i++);
-		if (t->type == INTEGER) {
-			if (t->value.integer != half_move_number / 2) {
-				g_set_error(err, 0, 0,
-						"Incorrect move number %d (should be %d)",
-						t->value.integer, half_move_number / 2);
-				return false;
-			}
+		if (pgn_tag(pgn, reader->tag_name) != NULL) {
+			g_set_error(&reader->error, 0, 0,
+					"Duplicate tag: %s", tag_name_string(reader->tag_name));
+			return false;
+		}
 
-			while ((t = &g_array_index(tokens, Token, i++))->type == DOT)
-				;
+		reader->state = TAG_VALUE;
+		return true;
+	case TAG_VALUE:
+		if (t->type != STRING) {
+			unexpected_token_error(&reader->error,
+					"Tag values must be strings", t);
+			return false;
 		}
 
-		if (t->type != SYMBOL && t->type != ASTERISK) {
-			if (t->type == INTEGER) {
-				g_set_error(err, 0, 0, "Expected a move, got %d",
-						t->value.integer);
-			} else {
-				g_set_error(err, 0, 0, "Expected a move, got %s",
-						t->value.string);
-			}
+		add_tag(pgn, reader->tag_name, intern_token_text(t));
 
+		reader->state = TAG_END;
+		return true;
+	case TAG_END:
+		if (t->type != R_SQUARE_BRACKET) {
+			g_set_error(&reader->error, 0, 0, "Tag %s has no matching close bracket",
+					tag_name_string(reader->tag_name));
 			return false;
 		}
 
-		Result r;
-		if ((r = parse_game_termination_marker(t)) != NULL_RESULT) {
-			pgn->result = r;
-
-			// If we didn't see a result tag, try to fill it in with the value
-			// in the game termination marker
+		reader->state = TAGS;
+		return true;
+	default:
+		assert(false);
+		return false;
+	}
+}
 
-			if (!g_hash_table_contains(pgn->tags, "Result")) {
-				char *tmp = malloc(strlen(t->value.string));
-				strcpy(tmp, t->value.string);
-				g_hash_table_insert(pgn->tags, "Result", tmp);
-			}
+static bool parse_movetext_token(PGN_reader *reader, Token *t)
+{
+	PGN *pgn = reader->pgn;
 
+	if (reader->state == AFTER_MOVE_NUMBER) {
+		if (t->type == DOT)
 			return true;
-		}
 
-		Move m;
-		if ((m = parse_move(game->board, t->value.string)) == NULL_MOVE) {
-			g_set_error(err, 0, 0, "Expected a move, got %s", t->value.string);
-			
+		reader->state = MOVETEXT;
+	}
+
+	// Annotations don't change the game, so we skip them
+	if (t->type == NAG)
+		return true;
+
+	// A variation is an alternative to the last move, so it carries on from
+	// the node before it. At the end we go back to where we were.
+	if (t->type == L_BRACKET) {
+		if (reader->game->parent == NULL) {
+			g_set_error(&reader->error, 0, 0,
+					"Variation with no move before it");
+			return false;
+		}
+		if (reader->variation_depth == MAX_VARIATION_DEPTH) {
+			g_set_error(&reader->error, 0, 0, "Variations nested too deeply");
 			return false;
 		}
 
-		game = add_child(game, m);
+		reader->variation_stack[reader->variation_depth++] = reader->game;
+		reader->game = reader->game->parent;
+		reader->half_move_number--;
+		return true;
+	}
+	if (t->type == R_BRACKET) {
+		if (reader->variation_depth == 0) {
+			g_set_error(&reader->error, 0, 0,
+					"Close bracket with no variation to close");
+			return false;
+		}
 
-		half_move_number++;
+		reader->game = reader->variation_stack[--reader->variation_depth];
+		reader->half_move_number =
+			reader->game->ply + reader->first_half_move;
+		return true;
 	}
 
-	return true;
-}
+	if (t->type == INTEGER) {
+		if (t->integer != reader->half_move_number / 2) {
+			g_set_error(&reader->error, 0, 0,
+					"Incorrect move number %d (should be %d)",
+					t->integer, reader->half_move_number / 2);
+			return false;
+		}
 
-static void free_tokens(GArray *tokens)
-{
-	for (size_t i = 0; i < tokens->len; i++) {
-		Token *t = &g_array_index(tokens, Token, i);
-		if (t->type == SYMBOL || t->type == STRING || t->type == NAG)
-			free(t->value.string);
+		reader->state = AFTER_MOVE_NUMBER;
+		return true;
 	}
 
-	g_array_free(tokens, TRUE);
-}
+	Result r;
+	if ((r = parse_game_termination_marker(t)) != NULL_RESULT) {
+		if (reader->variation_depth != 0) {
+			g_set_error(&reader->error, 0, 0,
+					"Game ended inside a variation");
+			return false;
+		}
 
+		pgn->result = r;
 
-bool read_pgn(PGN *pgn, const char *input_filename, GError **error)
-{
-	assert(*error == NULL);
+		// If we didn't see a result tag, try to fill it in with the value
+		// in the game termination marker
 
-	bool ret = true;
-	char *buf;
-	gsize length;
+		if (pgn_tag(pgn, TAG_RESULT) == NULL)
+			add_tag(pgn, TAG_RESULT, intern_token_text(t));
 
-	// We just load the whole file into memory.
-	// PGN files are typically very short: even the longest game in tournament
-	// history is only about 3.5KB.
-	// If someone tries to load a 2GB PGN and complains about it crashing, they
-	// need to take a long, hard look at themself.
-	GFile *file = g_file_new_for_path(input_filename);
-	if (!g_file_load_contents(file, NULL, &buf, &length, NULL, error)) {
-		ret = false;
-		goto cleanup;
+		finish_game(reader);
+		return true;
 	}
 
-	GArray *tokens = tokenize_pgn(buf, length);
-	ret = parse_tokens(pgn, tokens, error);
-	free_tokens(tokens);
+	Move m = NULL_MOVE;
+	if (t->type == SYMBOL) {
+		Board *board = game_board(reader->game);
+		m = parse_algebraic_notation(board, t->text, t->length);
+	}
+	if (m == NULL_MOVE) {
+		unexpected_token_error(&reader->error, "Expected a move", t);
+		return false;
+	}
 
-cleanup:
-	g_free(buf);
-	g_object_unref(file);
+	reader->game = add_child(reader->game, m);
+	reader->half_move_number++;
 
-	return ret;
+	return true;
 }
 
-static const char *seven_tag_roster[] =
+// Called by the tokenizer for every token. Returns false if the tokenizer
+// should stop, because we've got to the end of a game or hit an error.
+static bool handle_token(PGN_reader *reader, Token *t)
 {
-	"Event", "Site", "Date", "Round", "White", "Black", "Result"
-};
+	// Integers are a subset of symbols, and unfortunately Ragel scanners
+	// attempt to match longer patterns before shorter ones.
+	// So we check symbols here to see if they're really integers.
+	if (t->type == SYMBOL && symbol_is_integer(t)) {
+		t->type = INTEGER;
+		t->integer = 0;
+		for (size_t i = 0; i < t->length; i++)
+			t->integer = t->integer * 10 + (t->text[i] - '0');
+	}
 
-static bool in_seven_tag_roster(char *tag_name)
-{
-	size_t size = sizeof(seven_tag_roster) / sizeof(seven_tag_roster[0]);
-	for (size_t i = 0; i < size; i++)
-		if (strcmp(tag_name, seven_tag_roster[i]) == 0)
+	switch (reader->state) {
+	case SKIPPING_GAME:
+		if (parse_game_termination_marker(t) != NULL_RESULT)
+			reader->state = BETWEEN_GAMES;
+
+		return true;
+	case BETWEEN_GAMES:
+		// This token is the first of a new game
+		start_game(reader);
+		// Fall through
+	case TAGS: case TAG_NAME: case TAG_VALUE: case TAG_END:
+		if (parse_tag_token(reader, t))
 			return true;
-	
+		if (reader->error != NULL)
+			break;
+
+		// The tags have finished, and this token is part of the movetext
+		// Fall through
+	case MOVETEXT: case AFTER_MOVE_NUMBER:
+		if (parse_movetext_token(reader, t))
+			return !reader->game_done;
+
+		break;
+	}
+
+	// Skip the rest of the game, unless the token that caused the error was
+	// the end of it anyway
+	reader->state = parse_game_termination_marker(t) == NULL_RESULT ?
+		SKIPPING_GAME : BETWEEN_GAMES;
+
 	return false;
 }
 
-static void write_tag(FILE *file, const char *tag_name, const char *tag_value)
+// Reads the next chunk of a stream onto the end of the buffer. Before that,
+// anything we're finished with is dropped from the start of the buffer.
+static bool read_chunk(PGN_reader *reader, GError **error)
 {
-	// TODO: handle IO errors
-	fprintf(file, "[%s \"" , tag_name);
+	// Everything before the token the tokenizer is part way through, if
+	// there is one, can go.
+	size_t keep_from = reader->ts != NULL ?
+		(size_t)(reader->ts - reader->buf) :
+		reader->length;
+
+	if (keep_from > 0) {
+		memmove(reader->buf, reader->buf + keep_from,
+				reader->length - keep_from);
+		reader->length -= keep_from;
+		reader->tokenized -= keep_from;
+
+		if (reader->ts != NULL) {
+			reader->ts -= keep_from;
+			reader->te -= keep_from;
+		}
+	}
 
-	for (size_t i = 0; tag_value[i] != '\0'; i++) {
-		char c = tag_value[i];
-		if (c == '\\' || c == '"')
-			putc('\\', file);
+	// A token might not fit in the buffer, in which case it has to grow
+	if (reader->buf_size - reader->length < reader->chunk_size) {
+		size_t ts_offset = 0;
+		ptrdiff_t te_offset = 0;
+		if (reader->ts != NULL) {
+			ts_offset = reader->ts - reader->buf;
+			te_offset = reader->te - reader->ts;
+		}
+
+		reader->buf_size *= 2;
+		reader->buf = realloc(reader->buf, reader->buf_size);
 
-		putc(c, file);
+		if (reader->ts != NULL) {
+			reader->ts = reader->buf + ts_offset;
+			reader->te = reader->ts + te_offset;
+		}
 	}
 
-	fputs("\"]\n", file);
-}
+	gssize length = reader->decompressor != NULL ?
+		decompressor_read(reader->decompressor,
+				reader->buf + reader->length, reader->chunk_size, error) :
+		g_input_stream_read(reader->stream,
+				reader->buf + reader->length, reader->chunk_size, NULL, error);
+	if (length < 0)
+		return false;
 
-static char *default_tag_value(const char *tag_name)
-{
-	if (strcmp(tag_name, "Date") == 0)
-		return "????.??.??";
-	if (strcmp(tag_name, "Result") == 0)
-		return "*";
-	else
-		return "?";
+	// A read of zero bytes means we're at the end of the input
+	if (length == 0)
+		reader->end_of_input = true;
+
+	reader->length += length;
+
+	return true;
 }
 
-static void process_tag(gpointer key, gpointer value, gpointer user_data)
+// Runs the next chunk of input through the tokenizer, which hands the tokens
+// straight to the parser. This stops early if the parser finishes a game.
+// If the chunk ends part way through a token, the tokenizer picks up where
+// it left off with the next chunk.
+static bool tokenize_chunk(PGN_reader *reader, GError **error)
 {
-	FILE *file = (FILE *)user_data;
-	char *tag_name = (char *)key;
-	char *tag_value = (char *)value;
+	// For streams, we need more input once we've tokenized all we have
+	if (reader->stream != NULL && reader->tokenized == reader->length &&
+			!read_chunk(reader, error))
+		return false;
 
-	// We print the standard seven tags first, in a specified order, so don't
-	// print them again.
-	if (in_seven_tag_roster(tag_name))
-		return;
+	size_t chunk_end = reader->tokenized + reader->chunk_size;
+	if (chunk_end > reader->length)
+		chunk_end = reader->length;
 
-	write_tag(file, tag_name, tag_value);
-}
+	// Variables that Ragel needs
+	char *p = reader->buf + reader->tokenized, *pe = reader->buf + chunk_end;
+	char *eof = NULL;
+	char *ts = reader->ts, *te = reader->te;
+	int cs = reader->cs, act = reader->act;
 
-// TODO: handle IO errors
-bool write_pgn(PGN *pgn, FILE *file)
-{
-	size_t size = sizeof(seven_tag_roster) / sizeof(seven_tag_roster[0]);
-	for (size_t i = 0; i < size; i++) {
-		const char *tag_name = seven_tag_roster[i];
-		const char *tag_value = g_hash_table_contains(pgn->tags, tag_name) ?
-			g_hash_table_lookup(pgn->tags, tag_name) :
-			default_tag_value(tag_name);
-		write_tag(file, tag_name, tag_value);
-	}
-	g_hash_table_foreach(pgn->tags, process_tag, (void *)file);
+	// Running the tokenizer with eof set finishes off the last token
+	if (reader->end_of_input && chunk_end == reader->length)
+		eof = pe;
 
-	putc('\n', file);
-	
-	Game *game = pgn->game->children;
-	do {
-		// A lot of the logic in here seems reversed/offset by one. This is
-		// because the board associated with a particular move actually lives
-		// at the parent node for that board
-		if (game->board->turn == BLACK)
-			fprintf(file, game->board->move_number == 1 ?
-				"%d." :
-				" %d.", game->board->move_number);
-
-		char move_str[MAX_ALGEBRAIC_NOTATION_LENGTH];
-		algebraic_notation_for(game->parent->board, game->move, move_str);
-		fprintf(file, " %s", move_str);
-		
-		game = first_child(game);
-	} while (game != NULL);
-
-	fprintf(file, " %s\n", game_termination_marker(pgn->result));
+	%%{
+		action add_string {
+			// Leave out the quotes
+			Token t = { STRING, ts + 1, te - ts - 2, 0 };
+			if (!handle_token(reader, &t))
+				fbreak;
+		}
 
-	return true;
+		action add_symbol {
+			Token t = { SYMBOL, ts, te - ts, 0 };
+			if (!handle_token(reader, &t))
+				fbreak;
+		}
+
+		action add_nag {
+			Token t = { NAG, ts, te - ts, 0 };
+			if (!handle_token(reader, &t))
+				fbreak;
+		}
+
+		# Token types, as per PGN spec section 7
+		# Integers are read as symbols, and the parser picks them out
+
+		# We cheat a little bit here.
+		# According to the PGN spec, game termination markers are simply symbols.
+		# However, according to the definition of the symbol token, symbols
+		# cannot contain the '/' character. This seems like a contradiction, so
+		# to work around it we allow '/'s in symbols.
+		symbol = alnum (alnum | [_+#=:\-/])*;
+		string = '"' (('\\' print) | (print - '\\"'))* '"';
+		nag = '$' digit+;
+		# Comments can't be nested, and we don't keep them
+		comment = '{' (any - '}')* '}';
+
+
+		main := |*
+			space;
+			comment;
+			symbol  => add_symbol;
+			string  => add_string;
+			nag     => add_nag;
+			'.'     => { Token t = { DOT,              ts, 1, 0 }; if (!handle_token(reader, &t)) fbreak; };
+			'*'     => { Token t = { ASTERISK,         ts, 1, 0 }; if (!handle_token(reader, &t)) fbreak; };
+			'['     => { Token t = { L_SQUARE_BRACKET, ts, 1, 0 }; if (!handle_token(reader, &t)) fbreak; };
+			']'     => { Token t = { R_SQUARE_BRACKET, ts, 1, 0 }; if (!handle_token(reader, &t)) fbreak; };
+			'('     => { Token t = { L_BRACKET,        ts, 1, 0 }; if (!handle_token(reader, &t)) fbreak; };
+			')'     => { Token t = { R_BRACKET,        ts, 1, 0 }; if (!handle_token(reader, &t)) fbreak; };
+			'<'     => { Token t = { L_ANGLE_BRACKET,  ts, 1, 0 }; if (!handle_token(reader, &t)) fbreak; };
+			'>'     => { Token t = { R_ANGLE_BRACKET,  ts, 1, 0 }; if (!handle_token(reader, &t)) fbreak; };
+		*|;
+
+
+		write exec;
+	}%%
+
+	if (cs == pgn_tokenizer_error) {
+		if (p < pe)
+			g_set_error(error, 0, 0, "Unexpected character '%c'", *p);
+		else
+			g_set_error(error, 0, 0, "Unexpected end of input");
+
+		return false;
+	}
+
+	// Ragel doesn't reset ts when the parser makes us break out after a
+	// token, but there's no token in progress
+	if (reader->game_done || reader->error != NULL)
+		ts = NULL;
+	if (eof != NULL && p == pe)
+		reader->finished = true;
+
+	reader->tokenized = p - reader->buf;
+	reader->cs = cs;
+	reader->act = act;
+	reader->ts = ts;
+	reader->te = te;
+
+	return true;
+}
+
+static PGN_reader *new_reader(void)
+{
+	PGN_reader *reader = malloc(sizeof *reader);
+	reader->mapped_file = NULL;
+	reader->stream = NULL;
+	reader->decompressor = NULL;
+	reader->end_of_input = false;
+	reader->finished = false;
+	reader->buf = NULL;
+	reader->buf_size = 0;
+	reader->length = 0;
+	reader->tokenized = 0;
+	reader->chunk_size = READ_CHUNK_SIZE;
+	reader->state = BETWEEN_GAMES;
+	reader->fen_tag = intern_tag_name("FEN", 3);
+	reader->error = NULL;
+
+	char *ts, *te;
+	int cs, act;
+	%%write init;
+	reader->cs = cs;
+	reader->act = act;
+	reader->ts = ts;
+	reader->te = te;
+
+	return reader;
+}
+
+// Opens a file and works out whether it's compressed. The stream that's
+// returned still has the magic number at the start.
+static GInputStream *open_input(const char *input_filename,
+		Compression *compression, GError **error)
+{
+	GFile *file = g_file_new_for_path(input_filename);
+	GFileInputStream *file_stream = g_file_read(file, NULL, error);
+	g_object_unref(file);
+	if (file_stream == NULL)
+		return NULL;
+
+	// A buffered stream lets us look at the start without consuming it
+	GInputStream *stream =
+		g_buffered_input_stream_new(G_INPUT_STREAM(file_stream));
+	g_object_unref(file_stream);
+
+	if (g_buffered_input_stream_fill(G_BUFFERED_INPUT_STREAM(stream), 4,
+				NULL, error) < 0) {
+		g_object_unref(stream);
+		return NULL;
+	}
+
+	gsize length;
+	const unsigned char *start = g_buffered_input_stream_peek_buffer(
+			G_BUFFERED_INPUT_STREAM(stream), &length);
+	*compression = detect_compression(start, length);
+
+	return stream;
+}
+
+// Files compressed with gzip or zstd are decompressed as they're read.
+PGN_reader *pgn_reader_open(const char *input_filename, GError **error)
+{
+	Compression compression;
+	GInputStream *stream = open_input(input_filename, &compression, error);
+	if (stream == NULL)
+		return NULL;
+
+	PGN_reader *reader = new_reader();
+	reader->stream = stream;
+	if (compression != UNCOMPRESSED)
+		reader->decompressor = new_decompressor(stream, compression);
+	reader->buf_size = 2 * READ_CHUNK_SIZE;
+	reader->buf = malloc(reader->buf_size);
+
+	return reader;
+}
+
+// A reader for input that's already all in memory
+static PGN_reader *new_memory_reader(char *buf, size_t length)
+{
+	PGN_reader *reader = new_reader();
+	reader->buf = buf;
+	reader->length = length;
+	reader->end_of_input = true;
+	// The contents of an empty file are NULL, so don't try to tokenize them
+	reader->finished = length == 0;
+
+	return reader;
+}
+
+// Compressed files can't be tokenized where they are, so they're read as a
+// stream instead.
+PGN_reader *pgn_reader_open_mapped(const char *input_filename, GError **error)
+{
+	GMappedFile *mapped_file = g_mapped_file_new(input_filename, FALSE, error);
+	if (mapped_file == NULL)
+		return NULL;
+
+	char *contents = g_mapped_file_get_contents(mapped_file);
+	size_t length = g_mapped_file_get_length(mapped_file);
+	if (detect_compression((unsigned char *)contents, length) != UNCOMPRESSED) {
+		g_mapped_file_unref(mapped_file);
+		return pgn_reader_open(input_filename, error);
+	}
+
+	PGN_reader *reader = new_memory_reader(contents, length);
+	reader->mapped_file = mapped_file;
+
+	return reader;
+}
+
+bool pgn_reader_next(PGN_reader *reader, PGN *pgn, GError **error)
+{
+	reader->pgn = pgn;
+	reader->game_done = false;
+
+	while (!reader->game_done && reader->error == NULL) {
+		if (reader->finished) {
+			if (reader->state == BETWEEN_GAMES ||
+					reader->state == SKIPPING_GAME)
+				return false;
+
+			// Whatever's left is a game with no termination marker
+			finish_game(reader);
+			break;
+		}
+
+		if (!tokenize_chunk(reader, error)) {
+			// Throw away the game we were part way through
+			if (reader->state != BETWEEN_GAMES &&
+					reader->state != SKIPPING_GAME) {
+				free_pgn(pgn);
+				reader->state = BETWEEN_GAMES;
+			}
+
+			return false;
+		}
+	}
+
+	if (reader->error != NULL) {
+		g_propagate_error(error, reader->error);
+		reader->error = NULL;
+		free_pgn(pgn);
+
+		return false;
+	}
+
+	return true;
+}
+
+void pgn_reader_set_chunk_size(PGN_reader *reader, size_t chunk_size)
+{
+	if (chunk_size < 1)
+		chunk_size = 1;
+	if (chunk_size > READ_CHUNK_SIZE)
+		chunk_size = READ_CHUNK_SIZE;
+
+	reader->chunk_size = chunk_size;
+}
+
+void pgn_reader_close(PGN_reader *reader)
+{
+	if (reader->mapped_file != NULL)
+		g_mapped_file_unref(reader->mapped_file);
+	// The decompressor has to stop reading from the stream before it goes
+	if (reader->decompressor != NULL)
+		free_decompressor(reader->decompressor);
+	if (reader->stream != NULL) {
+		g_object_unref(reader->stream);
+		free(reader->buf);
+	}
+
+	free(reader);
+}
+
+bool read_pgn(PGN *pgn, const char *input_filename, GError **error)
+{
+	assert(*error == NULL);
+
+	PGN_reader *reader = pgn_reader_open(input_filename, error);
+	if (reader == NULL)
+		return false;
+
+	bool ret = pgn_reader_next(reader, pgn, error);
+	if (!ret && *error == NULL)
+		g_set_error(error, 0, 0, "No games in %s", input_filename);
+
+	pgn_reader_close(reader);
+
+	return ret;
+}
+
+// Games are handed out to threads in chunks of the file. There are a few
+// chunks per thread, so that a thread that gets a chunk full of long games
+// doesn't hold everyone else up at the end.
+#define CHUNKS_PER_THREAD 8
+
+typedef struct Import_chunk
+{
+	char *buf;
+	size_t length;
+
+	GArray *pgns;
+	GError *error;
+} Import_chunk;
+
+typedef struct Import_job
+{
+	Import_chunk *chunks;
+	uint chunk_count;
+
+	// These are only accessed atomically
+	gint next_chunk;
+	gint failed;
+} Import_job;
+
+// Is i at the start of a line that comes straight after a blank line?
+static bool after_blank_line(const char *buf, size_t i)
+{
+	uint newlines = 0;
+	while (i > 0) {
+		char c = buf[--i];
+		if (c == '\n') {
+			if (++newlines == 2)
+				return true;
+		} else if (c != '\r' && c != ' ' && c != '\t') {
+			return false;
+		}
+	}
+
+	return false;
+}
+
+// Finds the start of the first game at or after from, or the end of the
+// input if there isn't one. We take a game to start with a blank line
+// followed by an Event tag. That isn't guaranteed, but it's how PGN export
+// format lays games out, which is what any big database will be in.
+static size_t next_game_start(const char *buf, size_t length, size_t from)
+{
+	static const char event_tag[] = "[Event";
+	size_t tag_length = sizeof event_tag - 1;
+
+	for (size_t i = from; i < length; i++) {
+		const char *bracket = memchr(buf + i, '[', length - i);
+		if (bracket == NULL)
+			break;
+
+		i = bracket - buf;
+		if (length - i >= tag_length &&
+				memcmp(bracket, event_tag, tag_length) == 0 &&
+				after_blank_line(buf, i))
+			return i;
+	}
+
+	return length;
+}
+
+static gpointer import_worker(gpointer data)
+{
+	Import_job *job = data;
+
+	while (!g_atomic_int_get(&job->failed)) {
+		uint i = g_atomic_int_add(&job->next_chunk, 1);
+		if (i >= job->chunk_count)
+			break;
+
+		Import_chunk *chunk = &job->chunks[i];
+		PGN_reader *reader = new_memory_reader(chunk->buf, chunk->length);
+
+		PGN pgn;
+		while (pgn_reader_next(reader, &pgn, &chunk->error))
+			g_array_append_val(chunk->pgns, pgn);
+
+		pgn_reader_close(reader);
+
+		// No point carrying on, as the import as a whole has failed
+		if (chunk->error != NULL)
+			g_atomic_int_set(&job->failed, TRUE);
+	}
+
+	return NULL;
+}
+
+// Reads the whole of a compressed file into memory, decompressed. Returns
+// NULL on error.
+static char *read_decompressed(const char *input_filename, size_t *length,
+		GError **error)
+{
+	Compression compression;
+	GInputStream *stream = open_input(input_filename, &compression, error);
+	if (stream == NULL)
+		return NULL;
+
+	Decompressor *d = new_decompressor(stream, compression);
+	g_object_unref(stream);
+
+	size_t size = DECOMPRESS_BLOCK_SIZE;
+	char *buf = malloc(size);
+	*length = 0;
+
+	gssize read;
+	while ((read = decompressor_read(d, buf + *length, size - *length,
+					error)) > 0) {
+		*length += read;
+		if (*length == size) {
+			size *= 2;
+			buf = realloc(buf, size);
+		}
+	}
+
+	free_decompressor(d);
+
+	if (read < 0) {
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+// Compressed files have to be decompressed into memory in full before they
+// can be split up between the threads.
+bool import_pgn(const char *input_filename, uint threads,
+		PGN **pgns, size_t *game_count, GError **error)
+{
+	GMappedFile *mapped_file = g_mapped_file_new(input_filename, FALSE, error);
+	if (mapped_file == NULL)
+		return false;
+
+	char *buf = g_mapped_file_get_contents(mapped_file);
+	size_t length = g_mapped_file_get_length(mapped_file);
+
+	// We only need the mapping if the file isn't compressed
+	char *decompressed = NULL;
+	if (detect_compression((unsigned char *)buf, length) != UNCOMPRESSED) {
+		g_mapped_file_unref(mapped_file);
+		mapped_file = NULL;
+
+		decompressed = read_decompressed(input_filename, &length, error);
+		if (decompressed == NULL)
+			return false;
+
+		buf = decompressed;
+	}
+
+	// These are initialized lazily when the first board is set up, which
+	// isn't safe to do from several threads at once.
+	init_attack_tables();
+	init_zobrist_keys();
+
+	if (threads == 0)
+		threads = g_get_num_processors();
+
+	Import_job job;
+	job.chunk_count = threads * CHUNKS_PER_THREAD;
+	job.chunks = malloc(job.chunk_count * sizeof *job.chunks);
+	job.next_chunk = 0;
+	job.failed = FALSE;
+
+	// Split the file into roughly equal chunks, moving each split forward to
+	// the start of the next game. If games are very long compared to the
+	// chunks, some chunks will end up empty, which is fine.
+	size_t chunk_start = 0;
+	for (uint i = 0; i < job.chunk_count; i++) {
+		size_t chunk_end = length;
+		if (i != job.chunk_count - 1) {
+			size_t target = length / job.chunk_count * (i + 1);
+			if (target < chunk_start)
+				target = chunk_start;
+
+			chunk_end = next_game_start(buf, length, target);
+		}
+
+		Import_chunk *chunk = &job.chunks[i];
+		chunk->buf = buf + chunk_start;
+		chunk->length = chunk_end - chunk_start;
+		chunk->pgns = g_array_new(FALSE, FALSE, sizeof(PGN));
+		chunk->error = NULL;
+
+		chunk_start = chunk_end;
+	}
+
+	GThread **workers = malloc(threads * sizeof *workers);
+	for (uint i = 0; i < threads; i++)
+		workers[i] = g_thread_new("pgn-import", import_worker, &job);
+	for (uint i = 0; i < threads; i++)
+		g_thread_join(workers[i]);
+	free(workers);
+
+	// Report the first error in the file, if there was one. Otherwise put
+	// all the games together in their original order.
+	bool ret = true;
+	size_t total = 0;
+	for (uint i = 0; i < job.chunk_count; i++) {
+		Import_chunk *chunk = &job.chunks[i];
+		if (chunk->error != NULL && ret) {
+			g_propagate_error(error, chunk->error);
+			ret = false;
+		} else if (chunk->error != NULL) {
+			g_error_free(chunk->error);
+		}
+
+		total += chunk->pgns->len;
+	}
+
+	*pgns = ret ? malloc(total * sizeof **pgns) : NULL;
+	*game_count = ret ? total : 0;
+
+	size_t n = 0;
+	for (uint i = 0; i < job.chunk_count; i++) {
+		GArray *chunk_pgns = job.chunks[i].pgns;
+		if (ret && chunk_pgns->len != 0) {
+			memcpy(*pgns + n, chunk_pgns->data, chunk_pgns->len * sizeof(PGN));
+			n += chunk_pgns->len;
+		} else if (!ret) {
+			for (size_t j = 0; j < chunk_pgns->len; j++)
+				free_pgn(&g_array_index(chunk_pgns, PGN, j));
+		}
+
+		g_array_free(chunk_pgns, TRUE);
+	}
+
+	free(job.chunks);
+	if (mapped_file != NULL)
+		g_mapped_file_unref(mapped_file);
+	free(decompressed);
+
+	return ret;
+}
+
+// Output is built up in a buffer of this size and only handed to stdio once
+// it's full, so that exporting lots of games takes few write calls.
+#define WRITE_BUFFER_SIZE (1024 * 1024)
+
+// The spec asks for lines of movetext to be at most 79 characters long, so
+// that they fit in 80 columns.
+#define MAX_LINE_LENGTH 79
+
+struct PGN_writer
+{
+	FILE *file;
+	char *buf;
+	size_t length;
+
+	// How far along the current line of movetext we are, for wrapping
+	uint column;
+	// Set after an opening bracket, as the next token goes right up against
+	// it
+	bool after_bracket;
+
+	uint games;
+
+	// Once a write has failed we stop writing, and keep reporting the error
+	GError *error;
+};
+
+static void set_write_error(PGN_writer *writer)
+{
+	int err = errno;
+	g_set_error(&writer->error, G_FILE_ERROR, g_file_error_from_errno(err),
+			"Failed to write PGN: %s", g_strerror(err));
+}
+
+static void flush_writer(PGN_writer *writer)
+{
+	if (writer->error != NULL || writer->length == 0)
+		return;
+
+	if (fwrite(writer->buf, 1, writer->length, writer->file) != writer->length)
+		set_write_error(writer);
+
+	writer->length = 0;
+}
+
+static void write_bytes(PGN_writer *writer, const char *bytes, size_t length)
+{
+	if (writer->length + length > WRITE_BUFFER_SIZE)
+		flush_writer(writer);
+
+	// Anything too big for the buffer just goes straight out
+	if (length > WRITE_BUFFER_SIZE) {
+		if (writer->error == NULL &&
+				fwrite(bytes, 1, length, writer->file) != length)
+			set_write_error(writer);
+		return;
+	}
+
+	memcpy(writer->buf + writer->length, bytes, length);
+	writer->length += length;
+}
+
+static void write_char(PGN_writer *writer, char c)
+{
+	if (writer->length == WRITE_BUFFER_SIZE)
+		flush_writer(writer);
+
+	writer->buf[writer->length++] = c;
+}
+
+static void write_string(PGN_writer *writer, const char *str)
+{
+	write_bytes(writer, str, strlen(str));
+}
+
+PGN_writer *pgn_writer_new(FILE *file)
+{
+	PGN_writer *writer = malloc(sizeof *writer);
+	writer->file = file;
+	writer->buf = malloc(WRITE_BUFFER_SIZE);
+	writer->length = 0;
+	writer->column = 0;
+	writer->after_bracket = false;
+	writer->games = 0;
+	writer->error = NULL;
+
+	return writer;
+}
+
+bool pgn_writer_close(PGN_writer *writer, GError **error)
+{
+	flush_writer(writer);
+	if (writer->error == NULL && fflush(writer->file) != 0)
+		set_write_error(writer);
+
+	bool success = writer->error == NULL;
+	if (!success)
+		g_propagate_error(error, writer->error);
+
+	free(writer->buf);
+	free(writer);
+
+	return success;
+}
+
+static void write_tag(PGN_writer *writer, const char *tag_name,
+		const char *tag_value)
+{
+	write_char(writer, '[');
+	write_string(writer, tag_name);
+	write_bytes(writer, " \"", 2);
+
+	// Write the value in runs between the characters that need escaping
+	const char *run = tag_value;
+	for (const char *c = tag_value; *c != '\0'; c++) {
+		if (*c == '\\' || *c == '"') {
+			write_bytes(writer, run, c - run);
+			write_char(writer, '\\');
+			run = c;
+		}
+	}
+	write_string(writer, run);
+
+	write_bytes(writer, "\"]\n", 3);
+}
+
+// Adds a token to the movetext, separated from the last one by a space, or
+// by a newline if it wouldn't fit on the current line.
+static void write_movetext_token(PGN_writer *writer, const char *token,
+		size_t length, bool separate)
+{
+	separate = separate && writer->column != 0 && !writer->after_bracket;
+	writer->after_bracket = false;
+
+	if (writer->column != 0 &&
+			writer->column + separate + length > MAX_LINE_LENGTH) {
+		write_char(writer, '\n');
+		writer->column = 0;
+	} else if (separate) {
+		write_char(writer, ' ');
+		writer->column++;
+	}
+
+	write_bytes(writer, token, length);
+	writer->column += length;
+}
+
+// Writes move, which is played from board, and then plays it on board. The
+// move number is included if it's white's move or need_number is set, and
+// kept together with the move so that a line never ends in a move number.
+static void write_move(PGN_writer *writer, Board *board, Move move,
+		bool need_number)
+{
+	// Long enough for "4294967295... " followed by the move
+	char token[16 + MAX_ALGEBRAIC_NOTATION_LENGTH];
+	int length = 0;
+
+	if (board->turn == WHITE)
+		length = sprintf(token, "%u. ", board->move_number);
+	else if (need_number)
+		length = sprintf(token, "%u... ", board->move_number);
+
+	algebraic_notation_for(board, move, token + length);
+	write_movetext_token(writer, token, strlen(token), true);
+
+	Undo undo;
+	make_move(board, move, &undo);
+}
+
+// Writes the moves following node, where board is node's board, leaving board
+// at the end of the mainline. Variations are written in brackets straight
+// after the mainline move they're an alternative to, as the spec asks.
+// need_number says whether the first move needs its number even if it's
+// black's, which it does unless it carries straight on from another move.
+static void write_moves(PGN_writer *writer, Game *node, Board *board,
+		bool need_number)
+{
+	Game *child;
+
+	while ((child = first_child(node)) != NULL) {
+		// Variations start from the same board as the mainline move, so we
+		// need a copy of it before playing the move. Most moves don't have
+		// any, so we only copy it when there are.
+		Board before;
+		if (child->sibling != NULL)
+			before = *board;
+
+		write_move(writer, board, child->move, need_number);
+		need_number = false;
+
+		for (Game *variation = child->sibling; variation != NULL;
+				variation = variation->sibling) {
+			Board variation_board = before;
+
+			write_movetext_token(writer, "(", 1, true);
+			writer->after_bracket = true;
+
+			write_move(writer, &variation_board, variation->move, true);
+			write_moves(writer, variation, &variation_board, false);
+
+			write_movetext_token(writer, ")", 1, false);
+
+			// The mainline needs its move number again after this
+			need_number = true;
+		}
+
+		node = child;
+	}
+}
+
+// Writes a whole game, with a blank line between it and the previous one.
+bool pgn_writer_write(PGN_writer *writer, PGN *pgn, GError **error)
+{
+	if (writer->games++ != 0)
+		write_char(writer, '\n');
+
+	// The seven tag roster comes first, in its own order, and then any
+	// other tags in the order they were read in
+	for (Tag_name name = 0; name < ROSTER_TAGS; name++) {
+		const char *value = pgn_tag(pgn, name);
+		if (value == NULL)
+			value = default_tag_value(name);
+
+		write_tag(writer, tag_name_string(name), value);
+	}
+	for (uint i = 0; i < pgn->tag_count; i++) {
+		Tag *tag = &pgn->tags[i];
+		if (tag->name >= ROSTER_TAGS)
+			write_tag(writer, tag_name_string(tag->name), tag->value);
+	}
+
+	write_char(writer, '\n');
+
+	writer->column = 0;
+	writer->after_bracket = false;
+	if (pgn->game != NULL) {
+		// The boards for the moves are worked out as we go along, as that's
+		// much cheaper than getting each node's board from the tree
+		Board board = *game_board(pgn->game);
+		write_moves(writer, pgn->game, &board, true);
+	}
+
+	const char *marker = game_termination_marker(pgn->result);
+	write_movetext_token(writer, marker, strlen(marker), true);
+	write_char(writer, '\n');
+
+	if (writer->error != NULL) {
+		g_propagate_error(error, g_error_copy(writer->error));
+		return false;
+	}
+
+	return true;
+}
+
+// Writes a single game. Use a PGN_writer to write lots of them.
+bool write_pgn(PGN *pgn, FILE *file)
+{
+	PGN_writer *writer = pgn_writer_new(file);
+	bool success = pgn_writer_write(writer, pgn, NULL);
+
+	return pgn_writer_close(writer, NULL) && success;
+}
+
+// An index is a header, followed by an entry for each game, followed by the
+// values of the tags in the entries. Each value is only stored once. The
+// index is a cache rather than a way of exchanging data, so it's in native
+// byte order: anything that doesn't look right is simply rebuilt.
+#define INDEX_MAGIC 0x494E4750 // "PGNI" on little endian machines
+#define INDEX_VERSION 1
+
+typedef struct Index_header
+{
+	uint32_t magic;
+	uint32_t version;
+	// The size and modification time of the PGN file that was indexed. If
+	// either of these changes, so might the games.
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint64_t game_count;
+	uint64_t strings_size;
+} Index_header;
+
+typedef struct Index_entry
+{
+	uint64_t offset;
+	uint64_t length;
+	// Where each tag's value starts in the strings. 0 means the game doesn't
+	// have that tag, so the strings start with an unused byte.
+	uint32_t tags[ROSTER_TAGS];
+	// Keeps the entries 8 byte aligned
+	uint32_t padding;
+} Index_entry;
+
+struct PGN_index
+{
+	// The games are read straight out of the mapped PGN file, or if it's
+	// compressed, out of a decompressed copy of it
+	GMappedFile *pgn_file;
+	char *decompressed;
+	const char *pgn;
+
+	// The index itself is either mapped from the sidecar file, or was built
+	// just now into memory we own
+	GMappedFile *index_file;
+	char *built;
+
+	const Index_header *header;
+	const Index_entry *entries;
+	const char *strings;
+};
+
+// What the index of a PGN file is called. "games.pgn" is indexed in
+// "games.pgni", and anything else just gets ".pgni" added on.
+static char *index_filename(const char *input_filename)
+{
+	if (g_str_has_suffix(input_filename, ".pgn"))
+		return g_strconcat(input_filename, "i", NULL);
+	else
+		return g_strconcat(input_filename, ".pgni", NULL);
+}
+
+typedef struct Index_builder
+{
+	GByteArray *entries;
+	GByteArray *strings;
+	// Maps each tag value to where it is in the strings
+	GHashTable *string_offsets;
+	// The value of the tag currently being scanned, unescaped
+	GString *value;
+} Index_builder;
+
+static uint32_t intern_string(Index_builder *builder, const char *str)
+{
+	gpointer offset;
+	if (g_hash_table_lookup_extended(builder->string_offsets, str, NULL,
+				&offset))
+		return GPOINTER_TO_UINT(offset);
+
+	uint32_t new_offset = builder->strings->len;
+	g_byte_array_append(builder->strings, (const guint8 *)str,
+			strlen(str) + 1);
+	g_hash_table_insert(builder->string_offsets, g_strdup(str),
+			GUINT_TO_POINTER(new_offset));
+
+	return new_offset;
+}
+
+static bool is_pgn_whitespace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static const char *skip_whitespace(const char *p, const char *end)
+{
+	while (p != end && is_pgn_whitespace(*p))
+		p++;
+
+	return p;
+}
+
+// Scans a tag pair at p, storing its value in the entry if it's one of the
+// seven tag roster. Returns where the tag ends, or NULL if p isn't the start
+// of a tag, in which case it's the start of the movetext.
+static const char *scan_tag(Index_builder *builder, Index_entry *entry,
+		const char *p, const char *end)
+{
+	if (p == end || *p != '[')
+		return NULL;
+
+	p = skip_whitespace(p + 1, end);
+	const char *name = p;
+	while (p != end && (isalnum((unsigned char)*p) || *p == '_'))
+		p++;
+	size_t name_length = p - name;
+
+	p = skip_whitespace(p, end);
+	if (name_length == 0 || p == end || *p != '"')
+		return NULL;
+
+	g_string_truncate(builder->value, 0);
+	for (p++; p != end && *p != '"'; p++) {
+		if (*p == '\\' && p + 1 != end)
+			p++;
+
+		g_string_append_c(builder->value, *p);
+	}
+
+	p = skip_whitespace(p + (p != end), end);
+	if (p == end || *p != ']')
+		return NULL;
+
+	for (Tag_name i = 0; i < ROSTER_TAGS; i++) {
+		const char *roster_name = tag_name_string(i);
+		if (strlen(roster_name) == name_length &&
+				memcmp(roster_name, name, name_length) == 0) {
+			entry->tags[i] = intern_string(builder, builder->value->str);
+			break;
+		}
+	}
+
+	return p + 1;
+}
+
+// Finds where the movetext starting at p ends, without parsing it. That's
+// the next tag at the start of a line, as nothing in movetext starts with a
+// '[', apart from in comments.
+static const char *scan_movetext(const char *p, const char *end)
+{
+	bool line_start = false;
+
+	while (p != end) {
+		char c = *p;
+		switch (c) {
+		case '\n':
+			line_start = true;
+			p++;
+			continue;
+		case '[':
+			if (line_start)
+				return p;
+			break;
+		case '{':
+			p = memchr(p, '}', end - p);
+			if (p == NULL)
+				return end;
+			break;
+		case ';':
+			p = memchr(p, '\n', end - p);
+			if (p == NULL)
+				return end;
+			continue;
+		case '%':
+			// An escape line, which is to be ignored completely
+			if (line_start) {
+				p = memchr(p, '\n', end - p);
+				if (p == NULL)
+					return end;
+				continue;
+			}
+			break;
+		}
+
+		if (!is_pgn_whitespace(c))
+			line_start = false;
+		p++;
+	}
+
+	return end;
+}
+
+// Scans the whole PGN file, and puts the index together in one block of
+// memory laid out the same way as the sidecar file.
+static char *build_index(const char *buf, size_t length, GStatBuf *stat_buf,
+		size_t *index_size)
+{
+	Index_builder builder;
+	builder.entries = g_byte_array_new();
+	builder.strings = g_byte_array_new();
+	builder.string_offsets =
+		g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	builder.value = g_string_new(NULL);
+
+	// Offset 0 means a tag is missing, so nothing can go there
+	g_byte_array_append(builder.strings, (const guint8 *)"", 1);
+
+	const char *end = buf + length;
+	const char *p = skip_whitespace(buf, end);
+	while (p != end) {
+		Index_entry entry;
+		memset(&entry, 0, sizeof entry);
+		entry.offset = p - buf;
+
+		const char *tag_end;
+		while ((tag_end = scan_tag(&builder, &entry, p, end)) != NULL)
+			p = skip_whitespace(tag_end, end);
+
+		p = scan_movetext(p, end);
+		entry.length = p - buf - entry.offset;
+
+		g_byte_array_append(builder.entries, (const guint8 *)&entry,
+				sizeof entry);
+	}
+
+	Index_header header;
+	memset(&header, 0, sizeof header);
+	header.magic = INDEX_MAGIC;
+	header.version = INDEX_VERSION;
+	header.source_size = stat_buf->st_size;
+	header.source_mtime = stat_buf->st_mtime;
+	header.game_count = builder.entries->len / sizeof(Index_entry);
+	header.strings_size = builder.strings->len;
+
+	*index_size = sizeof header + builder.entries->len + builder.strings->len;
+	char *index = malloc(*index_size);
+	memcpy(index, &header, sizeof header);
+	memcpy(index + sizeof header, builder.entries->data,
+			builder.entries->len);
+	memcpy(index + sizeof header + builder.entries->len,
+			builder.strings->data, builder.strings->len);
+
+	g_byte_array_free(builder.entries, TRUE);
+	g_byte_array_free(builder.strings, TRUE);
+	g_hash_table_destroy(builder.string_offsets);
+	g_string_free(builder.value, TRUE);
+
+	return index;
+}
+
+// Checks that an index is complete, and was made from the file as it is now
+static bool index_is_valid(const char *index, size_t size, GStatBuf *stat_buf)
+{
+	if (size < sizeof(Index_header))
+		return false;
+
+	const Index_header *header = (const Index_header *)index;
+	if (header->magic != INDEX_MAGIC || header->version != INDEX_VERSION ||
+			header->source_size != (uint64_t)stat_buf->st_size ||
+			header->source_mtime != (int64_t)stat_buf->st_mtime)
+		return false;
+
+	return size == sizeof *header +
+		header->game_count * sizeof(Index_entry) + header->strings_size &&
+		header->strings_size > 0 && index[size - 1] == '\0';
+}
+
+static void set_index(PGN_index *index, const char *data)
+{
+	index->header = (const Index_header *)data;
+	index->entries = (const Index_entry *)(data + sizeof(Index_header));
+	index->strings = (const char *)(index->entries + index->header->game_count);
+}
+
+// Opens the index of a PGN file. If there's an up to date sidecar index it's
+// used as it is, otherwise the file is scanned and a new sidecar written.
+// There's no way to jump into the middle of a compressed file, so they're
+// decompressed into memory in full, but the index still saves scanning them.
+PGN_index *pgn_index_open(const char *input_filename, GError **error)
+{
+	GStatBuf stat_buf;
+	if (g_stat(input_filename, &stat_buf) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Couldn't open %s: %s", input_filename, g_strerror(err));
+		return NULL;
+	}
+
+	GMappedFile *pgn_file = g_mapped_file_new(input_filename, FALSE, error);
+	if (pgn_file == NULL)
+		return NULL;
+
+	char *buf = g_mapped_file_get_contents(pgn_file);
+	size_t length = g_mapped_file_get_length(pgn_file);
+	char *decompressed = NULL;
+	if (detect_compression((unsigned char *)buf, length) != UNCOMPRESSED) {
+		g_mapped_file_unref(pgn_file);
+		pgn_file = NULL;
+
+		decompressed = read_decompressed(input_filename, &length, error);
+		if (decompressed == NULL)
+			return NULL;
+
+		buf = decompressed;
+	}
+
+	PGN_index *index = malloc(sizeof *index);
+	index->pgn_file = pgn_file;
+	index->decompressed = decompressed;
+	index->pgn = buf;
+	index->index_file = NULL;
+	index->built = NULL;
+
+	char *filename = index_filename(input_filename);
+	GMappedFile *index_file = g_mapped_file_new(filename, FALSE, NULL);
+	if (index_file != NULL &&
+			index_is_valid(g_mapped_file_get_contents(index_file),
+				g_mapped_file_get_length(index_file), &stat_buf)) {
+		index->index_file = index_file;
+		set_index(index, g_mapped_file_get_contents(index_file));
+	} else {
+		if (index_file != NULL)
+			g_mapped_file_unref(index_file);
+
+		size_t size;
+		index->built = build_index(buf, length, &stat_buf, &size);
+		set_index(index, index->built);
+
+		// If the index can't be saved (say the directory is read only), we
+		// can still use it. It just has to be built again next time.
+		g_file_set_contents(filename, index->built, size, NULL);
+	}
+
+	g_free(filename);
+
+	return index;
+}
+
+size_t pgn_index_game_count(PGN_index *index)
+{
+	return index->header->game_count;
+}
+
+// Returns NULL if the game doesn't have the tag
+const char *pgn_index_tag(PGN_index *index, size_t game, Roster_tag tag)
+{
+	uint32_t offset = index->entries[game].tags[tag];
+
+	return offset == 0 ? NULL : index->strings + offset;
+}
+
+bool pgn_index_read_game(PGN_index *index, size_t game, PGN *pgn,
+		GError **error)
+{
+	const Index_entry *entry = &index->entries[game];
+	PGN_reader *reader = new_memory_reader(
+			(char *)index->pgn + entry->offset, entry->length);
+	bool success = pgn_reader_next(reader, pgn, error);
+	pgn_reader_close(reader);
+
+	if (!success && error != NULL && *error == NULL)
+		g_set_error(error, 0, 0, "No game at index %zu", game);
+
+	return success;
+}
+
+void pgn_index_free(PGN_index *index)
+{
+	if (index->pgn_file != NULL)
+		g_mapped_file_unref(index->pgn_file);
+	free(index->decompressed);
+	if (index->index_file != NULL)
+		g_mapped_file_unref(index->index_file);
+	free(index->built);
+	free(index);
 }
 
 void free_pgn(PGN *pgn)
 {
-	g_hash_table_destroy(pgn->tags);
-	free_game(pgn->game);
+	// The tag names and values themselves stay in the pool
+	free(pgn->tags);
+	if (pgn->game != NULL)
+		free_game(pgn->game);
 }
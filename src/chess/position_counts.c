@@ -0,0 +1,268 @@
+#include <errno.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "encoding.h"
+#include "game.h"
+#include "position_counts.h"
+#include "runs.h"
+
+#define FORMAT_VERSION 1
+#define MAGIC "CHESSPC"
+
+// A counts file is a header with the number of positions in it, followed by
+// the hash and count of each position as two u64s, in ascending order of
+// hash. Numbers are encoded as in encoding.h. Runs (see runs.h) are the same,
+// just without the header.
+#define HEADER_SIZE (FILE_HEADER_SIZE + 8)
+#define RECORD_SIZE 16
+
+// The size of the buffer for writing the counts file
+#define WRITE_BUFFER_SIZE (4096 * RECORD_SIZE)
+
+// However small the budget, spilling every few hashes would be silly
+#define MIN_CAPACITY 1024
+
+struct Position_counter
+{
+	uint64_t *hashes;
+	size_t count;
+	size_t capacity;
+
+	// Combining, so that each run has the count of each hash in it
+	Runs *runs;
+
+	// Once writing the counts file has failed we stop, and keep reporting
+	// the error
+	GError *error;
+};
+
+Position_counter *position_counter_new(size_t memory_budget,
+		const char *temp_dir)
+{
+	Position_counter *counter = malloc(sizeof *counter);
+
+	counter->capacity = memory_budget / sizeof *counter->hashes;
+	if (counter->capacity < MIN_CAPACITY)
+		counter->capacity = MIN_CAPACITY;
+	counter->hashes = malloc(counter->capacity * sizeof *counter->hashes);
+	counter->count = 0;
+
+	counter->runs = runs_new(temp_dir, true);
+	counter->error = NULL;
+
+	return counter;
+}
+
+static void set_file_error(Position_counter *counter, const char *action,
+		const char *filename)
+{
+	int err = errno;
+	if (counter->error == NULL) {
+		g_set_error(&counter->error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to %s '%s': %s", action, filename, g_strerror(err));
+	}
+}
+
+static void write_record(Position_counter *counter, FILE *file,
+		const char *filename, uint64_t hash, uint64_t count)
+{
+	uint8_t record[RECORD_SIZE];
+	set_number(record, hash, 8);
+	set_number(record + 8, count, 8);
+
+	if (counter->error == NULL && fwrite(record, 1, RECORD_SIZE, file) != RECORD_SIZE)
+		set_file_error(counter, "write", filename);
+}
+
+static int compare_hashes(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Sorts the hashes collected so far, and writes them out as a run with each
+// hash only once, along with how many times it occurred.
+static void spill(Position_counter *counter)
+{
+	uint64_t *hashes = counter->hashes;
+	size_t count = counter->count;
+	counter->count = 0;
+
+	qsort(hashes, count, sizeof *hashes, compare_hashes);
+	runs_start(counter->runs);
+
+	size_t i = 0;
+	while (i < count) {
+		size_t end = i;
+		while (end < count && hashes[end] == hashes[i])
+			end++;
+
+		runs_add(counter->runs, hashes[i], end - i);
+		i = end;
+	}
+
+	runs_end(counter->runs);
+}
+
+bool position_counter_add_game(Position_counter *counter, Game *game,
+		GError **error)
+{
+	for (Game *node = game; node != NULL && runs_ok(counter->runs, NULL);
+			node = first_child(node)) {
+		if (counter->count == counter->capacity)
+			spill(counter);
+
+		counter->hashes[counter->count++] = game_hash(node);
+	}
+
+	return runs_ok(counter->runs, error);
+}
+
+// Like the other writers, this writes to a temporary file first, and only
+// replaces the file once everything's been written.
+bool position_counter_write(Position_counter *counter, const char *filename,
+		uint64_t min_count, GError **error)
+{
+	if (counter->count != 0)
+		spill(counter);
+
+	Run_merge *merge = runs_merge(counter->runs);
+	if (counter->error == NULL)
+		runs_ok(counter->runs, &counter->error);
+
+	char *temp_filename = g_strdup_printf("%s.tmp", filename);
+	FILE *file = NULL;
+	if (counter->error == NULL && (file = fopen(temp_filename, "wb")) == NULL)
+		set_file_error(counter, "open", temp_filename);
+
+	if (file != NULL) {
+		setvbuf(file, NULL, _IOFBF, WRITE_BUFFER_SIZE);
+
+		// The header is filled in at the end, once we know how many
+		// positions there are
+		uint8_t header[HEADER_SIZE] = { 0 };
+		if (fwrite(header, 1, HEADER_SIZE, file) != HEADER_SIZE)
+			set_file_error(counter, "write", temp_filename);
+
+		uint64_t positions = 0;
+		Run_record record;
+		while (counter->error == NULL && run_merge_next(merge, &record)) {
+			if (record.value >= min_count) {
+				write_record(counter, file, temp_filename, record.key, record.value);
+				positions++;
+			}
+		}
+		if (counter->error == NULL)
+			runs_ok(counter->runs, &counter->error);
+
+		set_file_header(header, MAGIC, FORMAT_VERSION);
+		set_number(header + FILE_HEADER_SIZE, positions, 8);
+		if (counter->error == NULL && (fseek(file, 0, SEEK_SET) != 0 ||
+					fwrite(header, 1, HEADER_SIZE, file) != HEADER_SIZE))
+			set_file_error(counter, "write", temp_filename);
+
+		if (fclose(file) != 0)
+			set_file_error(counter, "write", temp_filename);
+		if (counter->error == NULL && g_rename(temp_filename, filename) != 0)
+			set_file_error(counter, "rename", temp_filename);
+		if (counter->error != NULL)
+			g_remove(temp_filename);
+	}
+
+	run_merge_free(merge);
+	g_free(temp_filename);
+
+	if (counter->error != NULL) {
+		g_propagate_error(error, g_error_copy(counter->error));
+		return false;
+	}
+
+	return true;
+}
+
+void position_counter_free(Position_counter *counter)
+{
+	runs_free(counter->runs);
+	free(counter->hashes);
+	if (counter->error != NULL)
+		g_error_free(counter->error);
+	free(counter);
+}
+
+struct Position_counts
+{
+	GMappedFile *file;
+	uint64_t positions;
+	const uint8_t *records;
+};
+
+Position_counts *position_counts_open(const char *filename, GError **error)
+{
+	GMappedFile *file = g_mapped_file_new(filename, FALSE, error);
+	if (file == NULL)
+		return NULL;
+
+	const uint8_t *data = (const uint8_t *)g_mapped_file_get_contents(file);
+	uint64_t length = g_mapped_file_get_length(file);
+	uint64_t positions;
+
+	if (!check_file_header(data, length, MAGIC, FORMAT_VERSION, &positions, 1) ||
+			positions != (length - HEADER_SIZE) / RECORD_SIZE ||
+			(length - HEADER_SIZE) % RECORD_SIZE != 0) {
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+				"Invalid position counts '%s'", filename);
+		g_mapped_file_unref(file);
+		return NULL;
+	}
+
+	Position_counts *counts = malloc(sizeof *counts);
+	counts->file = file;
+	counts->positions = positions;
+	counts->records = data + HEADER_SIZE;
+
+	return counts;
+}
+
+uint64_t position_counts_size(Position_counts *counts)
+{
+	return counts->positions;
+}
+
+Position_count position_counts_get(Position_counts *counts, uint64_t i)
+{
+	const uint8_t *record = counts->records + i * RECORD_SIZE;
+	Position_count count = { get_number(record, 8), get_number(record + 8, 8) };
+
+	return count;
+}
+
+uint64_t position_counts_find(Position_counts *counts, uint64_t hash)
+{
+	uint64_t low = 0;
+	uint64_t high = counts->positions;
+	while (low < high) {
+		uint64_t mid = low + (high - low) / 2;
+		uint64_t mid_hash = get_number(counts->records + mid * RECORD_SIZE, 8);
+		if (mid_hash == hash)
+			return position_counts_get(counts, mid).count;
+		else if (mid_hash < hash)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return 0;
+}
+
+void position_counts_close(Position_counts *counts)
+{
+	g_mapped_file_unref(counts->file);
+	free(counts);
+}
@@ -0,0 +1,60 @@
+#ifndef POSITION_COUNTS_H_
+#define POSITION_COUNTS_H_
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "game.h"
+
+// Counts how many times each position occurs across a set of games, for
+// collections of games too big to count in memory.
+//
+// The counter collects position hashes up to a memory budget, and then sorts
+// them and spills them to a temporary file as a run of (hash, count) pairs.
+// At the end the runs are all merged together, in several passes if there are
+// a lot of them (see runs.h), into one file of counts sorted by hash. So the
+// memory used doesn't depend on how many games there are, only the disk
+// space does.
+//
+// As with position indices, positions are identified by their hashes, and
+// only mainlines are counted. A position reached twice in one game is counted
+// twice.
+
+typedef struct Position_count
+{
+	uint64_t hash;
+	uint64_t count;
+} Position_count;
+
+typedef struct Position_counter Position_counter;
+
+// The budget is the number of bytes to use for hashes before spilling them,
+// and runs are written to temp_dir, or the system temporary directory if it's
+// NULL.
+Position_counter *position_counter_new(size_t memory_budget,
+		const char *temp_dir);
+// Fails if the hashes need spilling and a run can't be written. Once that
+// happens, every call after it fails with the same error.
+bool position_counter_add_game(Position_counter *counter, Game *game,
+		GError **error);
+// Merges everything into a counts file, leaving out positions that occur
+// fewer than min_count times.
+bool position_counter_write(Position_counter *counter, const char *filename,
+		uint64_t min_count, GError **error);
+// Also deletes any runs left over.
+void position_counter_free(Position_counter *counter);
+
+// A counts file is memory mapped, and looked up by binary search.
+typedef struct Position_counts Position_counts;
+
+Position_counts *position_counts_open(const char *filename, GError **error);
+// The number of distinct positions in the file
+uint64_t position_counts_size(Position_counts *counts);
+// The number of times a position occurs, or 0 if it isn't in the file
+uint64_t position_counts_find(Position_counts *counts, uint64_t hash);
+// The i'th position in order of hash, for going through all of them
+Position_count position_counts_get(Position_counts *counts, uint64_t i);
+void position_counts_close(Position_counts *counts);
+
+#endif // include guard
@@ -0,0 +1,460 @@
+#include <errno.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "encoding.h"
+#include "game.h"
+#include "positions.h"
+#include "runs.h"
+
+#define FORMAT_VERSION 2
+#define MAGIC "CHESSPI"
+
+// An index file looks like this, with numbers encoded as in encoding.h:
+//
+//     header, the stamp of the database (3 u64s, as in Game_db_stamp),
+//         number of positions (u64)
+//     the hash of each position (u64), in ascending order
+//     the offset of the first position's postings in each block (u64)
+//     the postings of each position
+//
+// The hashes are all the same size so that they can be binary searched.
+// The postings for a position are its number of matches, then the matches in
+// order, as varints. Each one has the difference between its game ID and the
+// last one's, and then its ply, or the difference between its ply and the
+// last one's if they're from the same game. Most of them end up taking two
+// or three bytes.
+//
+// Only the offset of the first position in each block of BLOCK_SIZE is
+// stored, and the postings of the rest are found by skipping over the ones
+// before them, which saves storing an offset for each.
+#define HEADER_SIZE (FILE_HEADER_SIZE + 32)
+#define BLOCK_SIZE 64
+
+// However small the budget, spilling every few postings would be silly
+#define MIN_CAPACITY 1024
+
+// The size of the buffers for writing the index and its temporary files
+#define WRITE_BUFFER_SIZE (64 * 1024)
+
+struct Position_index_builder
+{
+	// The postings collected since the last spill, with the hash as the key
+	// and the game and ply as the value, so that they sort by all three
+	Run_record *postings;
+	size_t count;
+	size_t capacity;
+
+	char *temp_dir;
+	Runs *runs;
+
+	// Once writing the index has failed we stop, and keep reporting the error
+	GError *error;
+};
+
+Position_index_builder *position_index_builder_new(size_t memory_budget,
+		const char *temp_dir)
+{
+	Position_index_builder *builder = malloc(sizeof *builder);
+
+	builder->capacity = memory_budget / sizeof *builder->postings;
+	if (builder->capacity < MIN_CAPACITY)
+		builder->capacity = MIN_CAPACITY;
+	builder->postings = malloc(builder->capacity * sizeof *builder->postings);
+	builder->count = 0;
+
+	builder->temp_dir = g_strdup(temp_dir != NULL ? temp_dir : g_get_tmp_dir());
+	builder->runs = runs_new(temp_dir, false);
+	builder->error = NULL;
+
+	return builder;
+}
+
+static int compare_postings(const void *a, const void *b)
+{
+	const Run_record *x = a;
+	const Run_record *y = b;
+
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	if (x->value != y->value)
+		return x->value < y->value ? -1 : 1;
+
+	return 0;
+}
+
+static void spill(Position_index_builder *builder)
+{
+	Run_record *postings = builder->postings;
+	size_t count = builder->count;
+	builder->count = 0;
+
+	qsort(postings, count, sizeof *postings, compare_postings);
+
+	runs_start(builder->runs);
+	for (size_t i = 0; i < count; i++)
+		runs_add(builder->runs, postings[i].key, postings[i].value);
+	runs_end(builder->runs);
+}
+
+bool position_index_add_game(Position_index_builder *builder,
+		uint32_t game_id, Game *game, GError **error)
+{
+	for (Game *node = game; node != NULL && runs_ok(builder->runs, NULL);
+			node = first_child(node)) {
+		if (builder->count == builder->capacity)
+			spill(builder);
+
+		Run_record *posting = &builder->postings[builder->count++];
+		posting->key = game_hash(node);
+		posting->value = (uint64_t)game_id << 32 | node->ply;
+	}
+
+	return runs_ok(builder->runs, error);
+}
+
+static void set_file_error(Position_index_builder *builder, const char *action,
+		const char *filename)
+{
+	int err = errno;
+	if (builder->error == NULL) {
+		g_set_error(&builder->error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to %s '%s': %s", action, filename, g_strerror(err));
+	}
+}
+
+static FILE *open_file(Position_index_builder *builder, const char *filename,
+		const char *mode)
+{
+	FILE *file = NULL;
+	if (builder->error == NULL && (file = fopen(filename, mode)) == NULL)
+		set_file_error(builder, "open", filename);
+	if (file != NULL)
+		setvbuf(file, NULL, _IOFBF, WRITE_BUFFER_SIZE);
+
+	return file;
+}
+
+// Creates an empty temporary file, returning its name, or NULL if it couldn't
+static char *new_temp_file(Position_index_builder *builder)
+{
+	if (builder->error != NULL)
+		return NULL;
+
+	char *filename = g_build_filename(builder->temp_dir, "positions-XXXXXX", NULL);
+	int fd = g_mkstemp(filename);
+	if (fd == -1) {
+		set_file_error(builder, "create temporary file", filename);
+		g_free(filename);
+		return NULL;
+	}
+
+	g_close(fd, NULL);
+	return filename;
+}
+
+static void write_bytes(Position_index_builder *builder, FILE *file,
+		const char *filename, const void *bytes, size_t length)
+{
+	if (builder->error == NULL && fwrite(bytes, 1, length, file) != length)
+		set_file_error(builder, "write", filename);
+}
+
+static void write_number(Position_index_builder *builder, FILE *file,
+		const char *filename, uint64_t n)
+{
+	uint8_t buf[8];
+	set_number(buf, n, 8);
+	write_bytes(builder, file, filename, buf, 8);
+}
+
+// Appends the whole of one file, which was opened for writing and reading, to
+// another.
+static void append_file(Position_index_builder *builder, FILE *from,
+		const char *from_filename, FILE *to, const char *to_filename)
+{
+	if (builder->error == NULL && fseek(from, 0, SEEK_SET) != 0)
+		set_file_error(builder, "read", from_filename);
+
+	uint8_t buf[WRITE_BUFFER_SIZE];
+	size_t length;
+	while (builder->error == NULL &&
+			(length = fread(buf, 1, sizeof buf, from)) != 0)
+		write_bytes(builder, to, to_filename, buf, length);
+
+	if (builder->error == NULL && ferror(from))
+		set_file_error(builder, "read", from_filename);
+}
+
+static void close_file(Position_index_builder *builder, FILE *file,
+		const char *filename)
+{
+	if (file != NULL && fclose(file) != 0)
+		set_file_error(builder, "write", filename);
+}
+
+// Writes the postings of one position to lists, taking them from the merge
+// until the next position's, which is left in *posting, and adds how many
+// bytes they took to *lists_size. Returns false if there aren't any more
+// positions after it.
+//
+// The postings have to be counted before they can be written, so they're
+// collected in postings first. This takes as much memory as a query for the
+// position would, so it doesn't need to be bounded any more than that.
+static bool write_postings(Position_index_builder *builder, Run_merge *merge,
+		Run_record *posting, GByteArray *postings, FILE *lists,
+		const char *lists_filename, uint64_t *lists_size)
+{
+	uint64_t hash = posting->key;
+	uint64_t count = 0;
+	uint32_t last_game = 0;
+	uint32_t last_ply = 0;
+	bool more;
+
+	g_byte_array_set_size(postings, 0);
+	do {
+		uint32_t game = posting->value >> 32;
+		uint32_t ply = posting->value & 0xFFFFFFFF;
+		bool same_game = count != 0 && game == last_game;
+		put_varint(postings, game - last_game);
+		put_varint(postings, same_game ? ply - last_ply : ply);
+
+		last_game = game;
+		last_ply = ply;
+		count++;
+	} while ((more = run_merge_next(merge, posting)) && posting->key == hash);
+
+	uint8_t buf[MAX_VARINT_SIZE];
+	uint length = set_varint(buf, count);
+	write_bytes(builder, lists, lists_filename, buf, length);
+	write_bytes(builder, lists, lists_filename, postings->data, postings->len);
+	*lists_size += length + postings->len;
+
+	return more;
+}
+// Like the other writers, this writes to a temporary file first, and only
+// replaces the file once everything's been written.
+bool position_index_write(Position_index_builder *builder,
+		const Game_db_stamp *stamp, const char *filename, GError **error)
+{
+	if (builder->count != 0)
+		spill(builder);
+
+	Run_merge *merge = runs_merge(builder->runs);
+	if (builder->error == NULL)
+		runs_ok(builder->runs, &builder->error);
+
+	// The hashes go straight into the file after the header, but how many
+	// there are isn't known until the end, so the blocks and lists are
+	// written to temporary files and copied on after them.
+	char *temp_filename = g_strdup_printf("%s.tmp", filename);
+	char *blocks_filename = new_temp_file(builder);
+	char *lists_filename = new_temp_file(builder);
+	FILE *file = open_file(builder, temp_filename, "wb");
+	FILE *blocks = open_file(builder, blocks_filename, "w+b");
+	FILE *lists = open_file(builder, lists_filename, "w+b");
+
+	uint8_t header[HEADER_SIZE] = { 0 };
+	write_bytes(builder, file, temp_filename, header, HEADER_SIZE);
+
+	uint64_t positions = 0;
+	uint64_t lists_size = 0;
+	GByteArray *postings = g_byte_array_new();
+	Run_record posting;
+	bool more = builder->error == NULL && run_merge_next(merge, &posting);
+	while (more && builder->error == NULL) {
+		if (positions % BLOCK_SIZE == 0)
+			write_number(builder, blocks, blocks_filename, lists_size);
+		write_number(builder, file, temp_filename, posting.key);
+		positions++;
+
+		more = write_postings(builder, merge, &posting, postings, lists,
+				lists_filename, &lists_size);
+	}
+	g_byte_array_free(postings, TRUE);
+
+	if (builder->error == NULL)
+		runs_ok(builder->runs, &builder->error);
+
+	append_file(builder, blocks, blocks_filename, file, temp_filename);
+	append_file(builder, lists, lists_filename, file, temp_filename);
+
+	set_file_header(header, MAGIC, FORMAT_VERSION);
+	set_number(header + FILE_HEADER_SIZE, stamp->games, 8);
+	set_number(header + FILE_HEADER_SIZE + 8, stamp->size, 8);
+	set_number(header + FILE_HEADER_SIZE + 16, stamp->mtime, 8);
+	set_number(header + FILE_HEADER_SIZE + 24, positions, 8);
+	if (builder->error == NULL && fseek(file, 0, SEEK_SET) != 0)
+		set_file_error(builder, "write", temp_filename);
+	write_bytes(builder, file, temp_filename, header, HEADER_SIZE);
+
+	close_file(builder, blocks, blocks_filename);
+	close_file(builder, lists, lists_filename);
+	close_file(builder, file, temp_filename);
+	if (builder->error == NULL && g_rename(temp_filename, filename) != 0)
+		set_file_error(builder, "rename", temp_filename);
+	if (builder->error != NULL)
+		g_remove(temp_filename);
+
+	run_merge_free(merge);
+	if (blocks_filename != NULL)
+		g_remove(blocks_filename);
+	if (lists_filename != NULL)
+		g_remove(lists_filename);
+	g_free(temp_filename);
+	g_free(blocks_filename);
+	g_free(lists_filename);
+
+	if (builder->error != NULL) {
+		g_propagate_error(error, g_error_copy(builder->error));
+		return false;
+	}
+
+	return true;
+}
+
+void position_index_builder_free(Position_index_builder *builder)
+{
+	runs_free(builder->runs);
+	g_free(builder->temp_dir);
+	free(builder->postings);
+	if (builder->error != NULL)
+		g_error_free(builder->error);
+	free(builder);
+}
+
+struct Position_index
+{
+	GMappedFile *file;
+	Game_db_stamp stamp;
+	uint64_t positions;
+	const uint8_t *hashes;
+	const uint8_t *blocks;
+	const uint8_t *lists;
+	const uint8_t *end;
+};
+
+Position_index *position_index_open(const char *filename, GError **error)
+{
+	GMappedFile *file = g_mapped_file_new(filename, FALSE, error);
+	if (file == NULL)
+		return NULL;
+
+	const uint8_t *data = (const uint8_t *)g_mapped_file_get_contents(file);
+	uint64_t length = g_mapped_file_get_length(file);
+	// The stamp, and then the number of positions
+	uint64_t counts[4] = { 0 };
+	bool valid = check_file_header(data, length, MAGIC, FORMAT_VERSION,
+			counts, 4);
+	uint64_t positions = counts[3];
+	uint64_t blocks = (positions + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	if (!valid || positions > (length - HEADER_SIZE) / 8 ||
+			HEADER_SIZE + 8 * (positions + blocks) > length) {
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+				"Invalid position index '%s'", filename);
+		g_mapped_file_unref(file);
+		return NULL;
+	}
+
+	Position_index *index = malloc(sizeof *index);
+	index->file = file;
+	index->stamp = (Game_db_stamp){ counts[0], counts[1], counts[2] };
+	index->positions = positions;
+	index->hashes = data + HEADER_SIZE;
+	index->blocks = index->hashes + 8 * positions;
+	index->lists = index->blocks + 8 * blocks;
+	index->end = data + length;
+
+	return index;
+}
+
+const Game_db_stamp *position_index_stamp(Position_index *index)
+{
+	return &index->stamp;
+}
+
+// Skips over the count and the matches of one position's postings, or
+// decodes them into matches if it's not NULL. Returns NULL if they run off
+// the end of the file.
+static const uint8_t *read_postings(const uint8_t *p, const uint8_t *end,
+		uint64_t count, Position_match *matches)
+{
+	uint64_t game = 0;
+	uint64_t ply = 0;
+	for (uint64_t i = 0; i < count; i++) {
+		uint64_t game_delta, n;
+		if ((p = get_varint(p, end, &game_delta)) == NULL ||
+				(p = get_varint(p, end, &n)) == NULL)
+			return NULL;
+
+		ply = game_delta == 0 && i != 0 ? ply + n : n;
+		game += game_delta;
+
+		if (matches != NULL) {
+			matches[i].game = game;
+			matches[i].ply = ply;
+		}
+	}
+
+	return p;
+}
+
+size_t position_index_find(Position_index *index, uint64_t hash,
+		Position_match **matches)
+{
+	*matches = NULL;
+
+	// Find the first hash that isn't less than the one we're looking for
+	uint64_t low = 0;
+	uint64_t high = index->positions;
+	while (low < high) {
+		uint64_t mid = low + (high - low) / 2;
+		if (get_number(index->hashes + 8 * mid, 8) < hash)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (low == index->positions ||
+			get_number(index->hashes + 8 * low, 8) != hash)
+		return 0;
+
+	// Anything that doesn't make sense means the file is corrupt, in which
+	// case we don't find anything
+	uint64_t block = low / BLOCK_SIZE;
+	uint64_t offset = get_number(index->blocks + 8 * block, 8);
+	if (offset > (uint64_t)(index->end - index->lists))
+		return 0;
+
+	const uint8_t *p = index->lists + offset;
+	uint64_t count = 0;
+	for (uint64_t i = block * BLOCK_SIZE; p != NULL && i <= low; i++) {
+		p = get_varint(p, index->end, &count);
+		if (p != NULL && i != low)
+			p = read_postings(p, index->end, count, NULL);
+	}
+
+	// Every match takes at least two bytes
+	if (p == NULL || count > (uint64_t)(index->end - p) / 2)
+		return 0;
+
+	*matches = malloc(count * sizeof **matches);
+	if (read_postings(p, index->end, count, *matches) == NULL) {
+		free(*matches);
+		*matches = NULL;
+		return 0;
+	}
+
+	return count;
+}
+
+void position_index_close(Position_index *index)
+{
+	g_mapped_file_unref(index->file);
+	free(index);
+}
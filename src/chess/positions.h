@@ -0,0 +1,63 @@
+#ifndef POSITIONS_H_
+#define POSITIONS_H_
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "database.h"
+#include "game.h"
+
+// An index from positions to the games that reach them, for finding every
+// game that reaches a position, however it got there.
+//
+// Positions are identified by their hashes, so on the off chance that two
+// positions have the same hash, games reaching either one will be found.
+// Only the mainline of each game is indexed, as the variations are moves
+// that weren't actually played.
+//
+// Games are identified by whatever IDs they're given when they're added,
+// which would normally be their indices in a game database.
+
+typedef struct Position_match
+{
+	uint32_t game;
+	// The number of half-moves into the game at which it reaches the
+	// position. A game can reach the same position more than once.
+	uint32_t ply;
+} Position_match;
+
+// Collects every position from each game it's given, and then writes them
+// all out sorted, so that the index doesn't need building again. As with
+// position counts, they're spilled to temporary files in sorted runs once
+// they reach the memory budget, and merged at the end (see runs.h), so
+// building the index doesn't need all the positions in memory at once.
+typedef struct Position_index_builder Position_index_builder;
+
+// The budget is in bytes, and runs are written to temp_dir, or the system
+// temporary directory if it's NULL.
+Position_index_builder *position_index_builder_new(size_t memory_budget,
+		const char *temp_dir);
+// Fails if the positions need spilling and a run can't be written
+bool position_index_add_game(Position_index_builder *builder,
+		uint32_t game_id, Game *game, GError **error);
+// The stamp is that of the database the games came from, so that the index
+// can be rebuilt when it changes.
+bool position_index_write(Position_index_builder *builder,
+		const Game_db_stamp *stamp, const char *filename, GError **error);
+void position_index_builder_free(Position_index_builder *builder);
+
+// The file is memory mapped, and only the parts needed to answer each query
+// are looked at.
+typedef struct Position_index Position_index;
+
+Position_index *position_index_open(const char *filename, GError **error);
+const Game_db_stamp *position_index_stamp(Position_index *index);
+// Sets *matches to an array of every time a game reached the position, in
+// order of game and then ply, which must be freed with free. Returns the
+// number of matches, which is 0 if there aren't any.
+size_t position_index_find(Position_index *index, uint64_t hash,
+		Position_match **matches);
+void position_index_close(Position_index *index);
+
+#endif // include guard
@@ -0,0 +1,312 @@
+#include <errno.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "encoding.h"
+#include "runs.h"
+
+// A run is just the key and value of each record as two u64s, encoded as in
+// encoding.h.
+#define RECORD_SIZE 16
+
+// Merging too many runs at once would mean lots of files open, and lots of
+// seeking back and forth between them, so beyond this many they're merged in
+// more than one pass.
+#define MAX_MERGE_RUNS 64
+
+// The size of the buffer for reading and writing each run. It's a multiple of
+// RECORD_SIZE so that records never straddle two reads.
+#define RUN_BUFFER_SIZE (4096 * RECORD_SIZE)
+
+struct Runs
+{
+	char *temp_dir;
+	bool combine;
+
+	// The filenames of the runs that have been written, in order
+	GPtrArray *filenames;
+	// The run being written, if there is one
+	FILE *file;
+
+	// Once anything has failed we stop, and keep reporting the error
+	GError *error;
+};
+
+Runs *runs_new(const char *temp_dir, bool combine)
+{
+	Runs *runs = malloc(sizeof *runs);
+	runs->temp_dir = g_strdup(temp_dir != NULL ? temp_dir : g_get_tmp_dir());
+	runs->combine = combine;
+	runs->filenames = g_ptr_array_new_with_free_func(g_free);
+	runs->file = NULL;
+	runs->error = NULL;
+
+	return runs;
+}
+
+static void set_file_error(Runs *runs, const char *action,
+		const char *filename)
+{
+	int err = errno;
+	if (runs->error == NULL) {
+		g_set_error(&runs->error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to %s '%s': %s", action, filename, g_strerror(err));
+	}
+}
+
+static const char *last_run(Runs *runs)
+{
+	return g_ptr_array_index(runs->filenames, runs->filenames->len - 1);
+}
+
+// Creates an empty temporary file to write the run to, which is added to the
+// list of runs so that it always gets deleted.
+void runs_start(Runs *runs)
+{
+	if (runs->error != NULL)
+		return;
+
+	char *filename = g_build_filename(runs->temp_dir, "positions-XXXXXX", NULL);
+	int fd = g_mkstemp(filename);
+	if (fd != -1) {
+		g_ptr_array_add(runs->filenames, filename);
+		g_close(fd, NULL);
+		runs->file = fopen(filename, "wb");
+	}
+
+	if (runs->file == NULL) {
+		set_file_error(runs, "create temporary file", filename);
+		if (fd == -1)
+			g_free(filename);
+		return;
+	}
+
+	setvbuf(runs->file, NULL, _IOFBF, RUN_BUFFER_SIZE);
+}
+
+void runs_add(Runs *runs, uint64_t key, uint64_t value)
+{
+	if (runs->file == NULL || runs->error != NULL)
+		return;
+
+	uint8_t record[RECORD_SIZE];
+	set_number(record, key, 8);
+	set_number(record + 8, value, 8);
+
+	if (fwrite(record, 1, RECORD_SIZE, runs->file) != RECORD_SIZE)
+		set_file_error(runs, "write", last_run(runs));
+}
+
+void runs_end(Runs *runs)
+{
+	if (runs->file == NULL)
+		return;
+
+	if (fclose(runs->file) != 0)
+		set_file_error(runs, "write", last_run(runs));
+	runs->file = NULL;
+}
+
+bool runs_ok(Runs *runs, GError **error)
+{
+	if (runs->error != NULL) {
+		g_propagate_error(error, g_error_copy(runs->error));
+		return false;
+	}
+
+	return true;
+}
+
+typedef struct Run_reader
+{
+	FILE *file;
+	const char *filename;
+	uint8_t buf[RUN_BUFFER_SIZE];
+	size_t pos;
+	size_t len;
+
+	Run_record current;
+} Run_reader;
+
+struct Run_merge
+{
+	Runs *runs;
+	// The readers for the first n runs, and a heap of the ones that haven't
+	// finished, ordered by their current records
+	Run_reader **readers;
+	uint n;
+	Run_reader **heap;
+	uint size;
+};
+
+// Moves on to the next record in the run, returning false at the end.
+static bool next_record(Runs *runs, Run_reader *reader)
+{
+	if (reader->pos == reader->len) {
+		reader->len = fread(reader->buf, 1, RUN_BUFFER_SIZE, reader->file);
+		reader->pos = 0;
+
+		if (ferror(reader->file)) {
+			set_file_error(runs, "read", reader->filename);
+			return false;
+		}
+		if (reader->len % RECORD_SIZE != 0) {
+			if (runs->error == NULL) {
+				g_set_error(&runs->error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+						"Truncated run '%s'", reader->filename);
+			}
+			return false;
+		}
+		if (reader->len == 0)
+			return false;
+	}
+
+	reader->current.key = get_number(reader->buf + reader->pos, 8);
+	reader->current.value = get_number(reader->buf + reader->pos + 8, 8);
+	reader->pos += RECORD_SIZE;
+
+	return true;
+}
+
+static bool less_than(Run_reader *a, Run_reader *b)
+{
+	if (a->current.key != b->current.key)
+		return a->current.key < b->current.key;
+
+	return a->current.value < b->current.value;
+}
+
+static void sift_down(Run_reader **heap, uint size, uint i)
+{
+	for (;;) {
+		uint smallest = i;
+		uint left = 2 * i + 1;
+		uint right = left + 1;
+
+		if (left < size && less_than(heap[left], heap[smallest]))
+			smallest = left;
+		if (right < size && less_than(heap[right], heap[smallest]))
+			smallest = right;
+		if (smallest == i)
+			return;
+
+		Run_reader *tmp = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = tmp;
+		i = smallest;
+	}
+}
+
+// Starts merging the first n runs
+static Run_merge *start_merge(Runs *runs, uint n)
+{
+	Run_merge *merge = malloc(sizeof *merge);
+	merge->runs = runs;
+	merge->readers = malloc(n * sizeof *merge->readers);
+	merge->n = n;
+	merge->heap = malloc(n * sizeof *merge->heap);
+	merge->size = 0;
+
+	for (uint i = 0; i < n; i++) {
+		Run_reader *reader = merge->readers[i] = malloc(sizeof *reader);
+		reader->filename = g_ptr_array_index(runs->filenames, i);
+		reader->file = fopen(reader->filename, "rb");
+		reader->pos = reader->len = 0;
+
+		if (reader->file == NULL)
+			set_file_error(runs, "open", reader->filename);
+		else if (next_record(runs, reader))
+			merge->heap[merge->size++] = reader;
+	}
+
+	for (uint i = merge->size / 2; i-- > 0; )
+		sift_down(merge->heap, merge->size, i);
+
+	return merge;
+}
+
+static void end_merge(Run_merge *merge)
+{
+	for (uint i = 0; i < merge->n; i++) {
+		if (merge->readers[i]->file != NULL)
+			fclose(merge->readers[i]->file);
+		free(merge->readers[i]);
+	}
+
+	free(merge->readers);
+	free(merge->heap);
+	free(merge);
+}
+
+static void remove_runs(Runs *runs, uint n)
+{
+	for (uint i = 0; i < n; i++)
+		g_remove(g_ptr_array_index(runs->filenames, i));
+
+	g_ptr_array_remove_range(runs->filenames, 0, n);
+}
+
+bool run_merge_next(Run_merge *merge, Run_record *record)
+{
+	Run_reader **heap = merge->heap;
+	if (merge->size == 0 || merge->runs->error != NULL)
+		return false;
+
+	*record = heap[0]->current;
+	for (;;) {
+		if (!next_record(merge->runs, heap[0]))
+			heap[0] = heap[--merge->size];
+		sift_down(heap, merge->size, 0);
+
+		if (!merge->runs->combine || merge->size == 0 ||
+				heap[0]->current.key != record->key)
+			break;
+		record->value += heap[0]->current.value;
+	}
+
+	return merge->runs->error == NULL;
+}
+
+Run_merge *runs_merge(Runs *runs)
+{
+	// Merge the oldest runs into a new one until there are few enough left
+	// to merge them all at once. Each pass only writes as much as it reads,
+	// and the memory used is bounded by MAX_MERGE_RUNS buffers.
+	while (runs->error == NULL && runs->filenames->len > MAX_MERGE_RUNS) {
+		Run_merge *merge = start_merge(runs, MAX_MERGE_RUNS);
+		runs_start(runs);
+
+		Run_record record;
+		while (run_merge_next(merge, &record))
+			runs_add(runs, record.key, record.value);
+
+		runs_end(runs);
+		end_merge(merge);
+		remove_runs(runs, MAX_MERGE_RUNS);
+	}
+
+	return start_merge(runs, runs->filenames->len);
+}
+
+void run_merge_free(Run_merge *merge)
+{
+	Runs *runs = merge->runs;
+	end_merge(merge);
+	remove_runs(runs, runs->filenames->len);
+}
+
+void runs_free(Runs *runs)
+{
+	if (runs->file != NULL)
+		fclose(runs->file);
+	remove_runs(runs, runs->filenames->len);
+	g_ptr_array_free(runs->filenames, TRUE);
+	g_free(runs->temp_dir);
+	if (runs->error != NULL)
+		g_error_free(runs->error);
+	free(runs);
+}
@@ -0,0 +1,52 @@
+#ifndef RUNS_H_
+#define RUNS_H_
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Sorting more records than fit in memory. Records are collected up to a
+// memory budget by whatever's using this, sorted, and written out to a
+// temporary file as a run. At the end the runs are all merged together, in
+// several passes if there are a lot of them, so the memory used doesn't
+// depend on how many records there are, only the disk space does.
+//
+// Records are pairs of u64s, and come out of the merge in order of key and
+// then value. If the runs are combining, records with the same key come out
+// as one, with the sum of their values, which is how positions are counted.
+
+typedef struct Run_record
+{
+	uint64_t key;
+	uint64_t value;
+} Run_record;
+
+typedef struct Runs Runs;
+
+// Runs are written to temp_dir, or the system temporary directory if it's
+// NULL.
+Runs *runs_new(const char *temp_dir, bool combine);
+
+// Writes a run, with the records added in between. They must already be
+// sorted.
+void runs_start(Runs *runs);
+void runs_add(Runs *runs, uint64_t key, uint64_t value);
+void runs_end(Runs *runs);
+
+// Once anything has failed, nothing else is written or read, and this keeps
+// returning false with the same error.
+bool runs_ok(Runs *runs, GError **error);
+
+typedef struct Run_merge Run_merge;
+
+// Starts merging all the runs written so far, and then gives back their
+// records one at a time, returning false at the end or if reading fails.
+Run_merge *runs_merge(Runs *runs);
+bool run_merge_next(Run_merge *merge, Run_record *record);
+// Deletes all the runs once they've been merged.
+void run_merge_free(Run_merge *merge);
+
+// Also deletes any runs left over.
+void runs_free(Runs *runs);
+
+#endif // include guard
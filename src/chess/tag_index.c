@@ -0,0 +1,616 @@
+#include <gio/gio.h>
+#include <glib.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "database.h"
+#include "encoding.h"
+#include "pgn.h"
+#include "tag_index.h"
+#include "tags.h"
+
+#define FORMAT_VERSION 2
+#define MAGIC "CHESSTI"
+
+// An index file looks like this, with numbers encoded as in encoding.h:
+//
+//     header, the stamp of the database (3 u64s, as in Game_db_stamp, which
+//         starts with the number of games), number of strings (u64),
+//         size of the strings (u64)
+//     each column: every game's value (u32), in order of game
+//     each column again: every game's index (u32), in order of value
+//     the offset of each string (u64), from the start of the strings
+//     the strings, null-terminated, in strcmp order
+//
+// Text columns hold indices into the strings, or NO_STRING if the tag is
+// missing or unknown. The rest hold the numbers themselves, with 0 for
+// unknown.
+#define HEADER_SIZE (FILE_HEADER_SIZE + 40)
+
+typedef enum Column
+{
+	WHITE_COLUMN,
+	BLACK_COLUMN,
+	EVENT_COLUMN,
+	ECO_COLUMN,
+	DATE_COLUMN,
+	WHITE_ELO_COLUMN,
+	BLACK_ELO_COLUMN,
+	RESULT_COLUMN,
+	COLUMNS,
+} Column;
+
+#define TEXT_COLUMNS (ECO_COLUMN + 1)
+#define NO_STRING UINT32_MAX
+
+void game_query_init(Game_query *query)
+{
+	memset(query, 0, sizeof *query);
+	query->result = NULL_RESULT;
+}
+
+typedef struct Index_builder
+{
+	uint32_t *columns[COLUMNS];
+
+	// The distinct values of the text columns. They're all from the tag
+	// pool, so equal values are the same pointer, which maps to its index
+	// plus one.
+	GHashTable *string_ids;
+	GPtrArray *strings;
+} Index_builder;
+
+static uint32_t string_id(Index_builder *builder, const char *value)
+{
+	if (value == NULL || value[0] == '\0' || strcmp(value, "?") == 0)
+		return NO_STRING;
+
+	uint32_t id = GPOINTER_TO_UINT(g_hash_table_lookup(builder->string_ids, value));
+	if (id == 0) {
+		g_ptr_array_add(builder->strings, (gpointer)value);
+		id = builder->strings->len;
+		g_hash_table_insert(builder->string_ids, (gpointer)value,
+				GUINT_TO_POINTER(id));
+	}
+
+	return id - 1;
+}
+
+static void add_game(Index_builder *builder, uint32_t game, PGN *pgn,
+		Tag_name eco, Tag_name white_elo, Tag_name black_elo)
+{
+	uint32_t **columns = builder->columns;
+
+	columns[WHITE_COLUMN][game] = string_id(builder, pgn_tag(pgn, TAG_WHITE));
+	columns[BLACK_COLUMN][game] = string_id(builder, pgn_tag(pgn, TAG_BLACK));
+	columns[EVENT_COLUMN][game] = string_id(builder, pgn_tag(pgn, TAG_EVENT));
+	columns[ECO_COLUMN][game] = string_id(builder, pgn_tag(pgn, eco));
+	columns[DATE_COLUMN][game] = parse_date_tag(pgn_tag(pgn, TAG_DATE));
+	columns[WHITE_ELO_COLUMN][game] = parse_elo_tag(pgn_tag(pgn, white_elo));
+	columns[BLACK_ELO_COLUMN][game] = parse_elo_tag(pgn_tag(pgn, black_elo));
+	columns[RESULT_COLUMN][game] = pgn->result;
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Renumbers the strings in strcmp order, so that IDs compare the same way as
+// the strings do.
+static void sort_strings(Index_builder *builder, size_t games)
+{
+	GPtrArray *strings = builder->strings;
+	uint32_t *new_ids = malloc(strings->len * sizeof *new_ids);
+
+	if (strings->len > 1)
+		qsort(strings->pdata, strings->len, sizeof *strings->pdata, compare_strings);
+	for (uint32_t i = 0; i < strings->len; i++) {
+		uint32_t old_id = GPOINTER_TO_UINT(
+				g_hash_table_lookup(builder->string_ids, strings->pdata[i])) - 1;
+		new_ids[old_id] = i;
+	}
+
+	for (uint c = 0; c < TEXT_COLUMNS; c++) {
+		uint32_t *column = builder->columns[c];
+		for (size_t i = 0; i < games; i++) {
+			if (column[i] != NO_STRING)
+				column[i] = new_ids[column[i]];
+		}
+	}
+
+	free(new_ids);
+}
+
+bool tag_index_build(Game_db *db, const char *filename, GError **error)
+{
+	size_t games = game_db_game_count(db);
+	Tag_name eco = intern_tag_name("ECO", strlen("ECO"));
+	Tag_name white_elo = intern_tag_name("WhiteElo", strlen("WhiteElo"));
+	Tag_name black_elo = intern_tag_name("BlackElo", strlen("BlackElo"));
+
+	Index_builder builder;
+	for (uint c = 0; c < COLUMNS; c++)
+		builder.columns[c] = malloc(games * sizeof *builder.columns[c]);
+	builder.string_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+	builder.strings = g_ptr_array_new();
+
+	bool success = true;
+	for (size_t i = 0; success && i < games; i++) {
+		PGN pgn;
+		success = game_db_read_tags(db, i, &pgn, error);
+		if (success) {
+			add_game(&builder, i, &pgn, eco, white_elo, black_elo);
+			free_pgn(&pgn);
+		}
+	}
+
+	GByteArray *out = g_byte_array_new();
+	if (success) {
+		sort_strings(&builder, games);
+
+		GByteArray *strings = g_byte_array_new();
+		Game_db_stamp stamp = game_db_stamp(db);
+		put_file_header(out, MAGIC, FORMAT_VERSION);
+		put_number(out, stamp.games, 8);
+		put_number(out, stamp.size, 8);
+		put_number(out, stamp.mtime, 8);
+		put_number(out, builder.strings->len, 8);
+		for (uint32_t i = 0; i < builder.strings->len; i++) {
+			const char *str = g_ptr_array_index(builder.strings, i);
+			g_byte_array_append(strings, (const uint8_t *)str, strlen(str) + 1);
+		}
+		put_number(out, strings->len, 8);
+
+		for (uint c = 0; c < COLUMNS; c++) {
+			for (size_t i = 0; i < games; i++)
+				put_number(out, builder.columns[c][i], 4);
+		}
+
+		// Sorting the value and game together means games with the same
+		// value stay in order
+		uint64_t *keys = malloc(games * sizeof *keys);
+		for (uint c = 0; c < COLUMNS; c++) {
+			for (size_t i = 0; i < games; i++)
+				keys[i] = (uint64_t)builder.columns[c][i] << 32 | i;
+			qsort(keys, games, sizeof *keys, compare_keys);
+			for (size_t i = 0; i < games; i++)
+				put_number(out, (uint32_t)keys[i], 4);
+		}
+		free(keys);
+
+		uint64_t offset = 0;
+		for (uint32_t i = 0; i < builder.strings->len; i++) {
+			put_number(out, offset, 8);
+			offset += strlen(g_ptr_array_index(builder.strings, i)) + 1;
+		}
+		g_byte_array_append(out, strings->data, strings->len);
+		g_byte_array_free(strings, TRUE);
+
+		success = g_file_set_contents(filename,
+				(const char *)out->data, out->len, error);
+	}
+
+	g_byte_array_free(out, TRUE);
+	for (uint c = 0; c < COLUMNS; c++)
+		free(builder.columns[c]);
+	g_hash_table_destroy(builder.string_ids);
+	g_ptr_array_free(builder.strings, TRUE);
+
+	return success;
+}
+
+struct Tag_index
+{
+	GMappedFile *file;
+	Game_db_stamp stamp;
+	uint64_t games;
+	uint64_t string_count;
+	uint64_t strings_size;
+	const uint8_t *columns;
+	const uint8_t *sorted;
+	const uint8_t *string_offsets;
+	const char *strings;
+};
+
+Tag_index *tag_index_open(const char *filename, GError **error)
+{
+	GMappedFile *file = g_mapped_file_new(filename, FALSE, error);
+	if (file == NULL)
+		return NULL;
+
+	const uint8_t *data = (const uint8_t *)g_mapped_file_get_contents(file);
+	uint64_t length = g_mapped_file_get_length(file);
+	// The stamp, the number of strings and the size of the strings
+	uint64_t counts[5] = { 0 };
+	bool valid = check_file_header(data, length, MAGIC, FORMAT_VERSION,
+			counts, 5);
+	uint64_t games = counts[0];
+	uint64_t string_count = counts[3];
+	uint64_t strings_size = counts[4];
+
+	// Checked one at a time so that nothing can overflow. The strings all
+	// being terminated means that looking at any of them stays in the file.
+	uint64_t left = valid ? length - HEADER_SIZE : 0;
+	valid = valid && games <= UINT32_MAX && games <= left / (8 * COLUMNS);
+	if (valid) {
+		left -= 8 * COLUMNS * games;
+		valid = string_count <= left / 8;
+	}
+	if (valid) {
+		left -= 8 * string_count;
+		valid = strings_size == left && string_count <= strings_size &&
+			(strings_size == 0 || data[length - 1] == '\0');
+	}
+
+	if (!valid) {
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+				"Invalid tag index '%s'", filename);
+		g_mapped_file_unref(file);
+		return NULL;
+	}
+
+	Tag_index *index = malloc(sizeof *index);
+	index->file = file;
+	index->stamp = (Game_db_stamp){ counts[0], counts[1], counts[2] };
+	index->games = games;
+	index->string_count = string_count;
+	index->strings_size = strings_size;
+	index->columns = data + HEADER_SIZE;
+	index->sorted = index->columns + 4 * COLUMNS * games;
+	index->string_offsets = index->sorted + 4 * COLUMNS * games;
+	index->strings = (const char *)index->string_offsets + 8 * string_count;
+
+	return index;
+}
+
+size_t tag_index_game_count(Tag_index *index)
+{
+	return index->games;
+}
+
+const Game_db_stamp *tag_index_stamp(Tag_index *index)
+{
+	return &index->stamp;
+}
+
+// The same as get_number(p, 4), but written out so that it can be inlined,
+// as queries read a lot of these
+static uint32_t get_u32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+		(uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t column_value(Tag_index *index, Column column, uint32_t game)
+{
+	return get_u32(index->columns + 4 * (column * index->games + game));
+}
+
+static uint32_t sorted_game(Tag_index *index, Column column, uint64_t i)
+{
+	return get_u32(index->sorted + 4 * (column * index->games + i));
+}
+
+// A corrupt offset just gives an empty string
+static const char *index_string(Tag_index *index, uint64_t i)
+{
+	uint64_t offset = get_number(index->string_offsets + 8 * i, 8);
+	return offset < index->strings_size ? index->strings + offset : "";
+}
+
+// The first string that isn't less than value, or that doesn't start with it
+// if after_prefix is set.
+static uint64_t find_string(Tag_index *index, const char *value,
+		bool after_prefix)
+{
+	size_t length = strlen(value);
+	uint64_t low = 0;
+	uint64_t high = index->string_count;
+	while (low < high) {
+		uint64_t mid = low + (high - low) / 2;
+		const char *str = index_string(index, mid);
+		int cmp = after_prefix ? strncmp(str, value, length) : strcmp(str, value);
+		if (cmp < 0 || (after_prefix && cmp == 0))
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+// A condition that a column's value is between low and high inclusive
+typedef struct Condition
+{
+	Column column;
+	uint32_t low;
+	uint32_t high;
+} Condition;
+
+// Queries are made of clauses which all have to be met, each of which is met
+// if any of its conditions are. Only players need more than one, to match
+// either colour.
+typedef struct Clause
+{
+	Condition conditions[2];
+	uint count;
+} Clause;
+
+// A player, the other text tags, the date, both ratings and the result
+#define MAX_CLAUSES (1 + TEXT_COLUMNS + 1 + 2 + 1)
+
+// Adds a clause matching a range of string IDs for a text tag. Returns false
+// if nothing can match it.
+static bool text_clause(Tag_index *index, Column column, const char *value,
+		bool prefix_match, Clause *clause)
+{
+	uint64_t low = find_string(index, value, false);
+	uint64_t high;
+	if (prefix_match) {
+		high = find_string(index, value, true);
+	} else {
+		bool found = low < index->string_count &&
+			strcmp(index_string(index, low), value) == 0;
+		high = found ? low + 1 : low;
+	}
+
+	clause->conditions[0].column = column;
+	clause->conditions[0].low = low;
+	clause->conditions[0].high = high - 1;
+	clause->count = 1;
+
+	return low < high;
+}
+
+// Adds a clause matching a range of numbers. Returns false if the range is
+// empty, as meets only works on ranges with low <= high.
+static bool number_clause(Column column, uint32_t low, uint32_t high,
+		Clause *clause)
+{
+	// Zero is unknown, so it never matches a limit
+	clause->conditions[0].column = column;
+	clause->conditions[0].low = low == 0 ? 1 : low;
+	clause->conditions[0].high = high == 0 ? UINT32_MAX : high;
+	clause->count = 1;
+
+	return clause->conditions[0].low <= clause->conditions[0].high;
+}
+
+// The games in a column's sorted order that meet a condition are
+// [*start, *end).
+static void condition_games(Tag_index *index, Condition *condition,
+		uint64_t *start, uint64_t *end)
+{
+	for (uint bound = 0; bound < 2; bound++) {
+		uint64_t low = 0;
+		uint64_t high = index->games;
+		while (low < high) {
+			uint64_t mid = low + (high - low) / 2;
+			uint32_t game = sorted_game(index, condition->column, mid);
+			uint32_t value = game < index->games ?
+				column_value(index, condition->column, game) : UINT32_MAX;
+
+			if (bound == 0 ? value < condition->low : value <= condition->high)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+
+		*(bound == 0 ? start : end) = low;
+	}
+}
+
+// Written without branches that depend on the values, as whether a game
+// matches is about as unpredictable as it gets, and the CPU guessing wrong
+// costs more than anything else here
+static bool meets(Tag_index *index, Clause *clause, uint32_t game)
+{
+	bool met = false;
+	for (uint i = 0; i < clause->count; i++) {
+		Condition *condition = &clause->conditions[i];
+		uint32_t value = column_value(index, condition->column, game);
+		// Values below low wrap around to be bigger than the range
+		met |= value - condition->low <= condition->high - condition->low;
+	}
+
+	return met;
+}
+
+static int compare_games(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Puts the games meeting a clause into games, from its sorted columns, so
+// they come out in order of value. There's room for them all, as the caller
+// has counted them.
+static size_t clause_games(Tag_index *index, Clause *clause,
+		uint64_t starts[], uint64_t ends[], uint32_t *games)
+{
+	size_t count = 0;
+	for (uint i = 0; i < clause->count; i++) {
+		for (uint64_t j = starts[i]; j < ends[i]; j++) {
+			uint32_t game = sorted_game(index, clause->conditions[i].column, j);
+			if (game < index->games)
+				games[count++] = game;
+		}
+	}
+
+	return count;
+}
+
+// Puts games from clause_games back in order. If the clause had more than
+// one condition, a game can meet both, like someone playing themselves, so
+// this also takes out repeats, returning how many are left.
+static size_t sort_games(uint32_t *games, size_t count)
+{
+	if (count > 1)
+		qsort(games, count, sizeof *games, compare_games);
+
+	size_t unique = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (unique == 0 || games[i] != games[unique - 1])
+			games[unique++] = games[i];
+	}
+
+	return unique;
+}
+
+// Puts the games meeting a clause into games, in order, by going through its
+// whole columns. Every game is written whether it matches or not, so games
+// needs room for one more than will match.
+static size_t scan_games(Tag_index *index, Clause *clause, uint32_t *games)
+{
+	// Copied so that the compiler knows writing the games can't change it
+	Clause c = *clause;
+	size_t count = 0;
+
+	for (uint32_t game = 0; game < index->games; game++) {
+		games[count] = game;
+		count += meets(index, &c, game);
+	}
+
+	return count;
+}
+
+// Keeps just the games that meet a clause, returning how many there are
+static size_t filter_games(Tag_index *index, Clause *clause, uint32_t *games,
+		size_t count)
+{
+	Clause c = *clause;
+	size_t kept = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		games[kept] = games[i];
+		kept += meets(index, &c, games[i]);
+	}
+
+	return kept;
+}
+
+// If the clause with the fewest games still has more than this fraction of
+// all of them, it's quicker to go through its whole column in order than to
+// jump around it in order of value
+#define SCAN_FRACTION 16
+
+size_t tag_index_search(Tag_index *index, Game_query *query, uint32_t **games)
+{
+	*games = NULL;
+
+	Clause clauses[MAX_CLAUSES];
+	uint count = 0;
+	bool possible = true;
+
+	if (query->player != NULL) {
+		Clause *clause = &clauses[count++];
+		possible = text_clause(index, WHITE_COLUMN, query->player,
+				query->prefix_match, clause);
+		clause->conditions[1] = clause->conditions[0];
+		clause->conditions[1].column = BLACK_COLUMN;
+		clause->count = 2;
+	}
+
+	const char *texts[TEXT_COLUMNS] =
+		{ query->white, query->black, query->event, query->eco };
+	for (uint c = 0; possible && c < TEXT_COLUMNS; c++) {
+		if (texts[c] != NULL) {
+			possible = text_clause(index, c, texts[c], query->prefix_match,
+					&clauses[count++]);
+		}
+	}
+
+	if (possible && (query->min_date != 0 || query->max_date != 0)) {
+		possible = number_clause(DATE_COLUMN, query->min_date,
+				query->max_date, &clauses[count++]);
+	}
+	if (possible && (query->min_elo != 0 || query->max_elo != 0)) {
+		possible = number_clause(WHITE_ELO_COLUMN, query->min_elo,
+				query->max_elo, &clauses[count++]);
+		number_clause(BLACK_ELO_COLUMN, query->min_elo, query->max_elo,
+				&clauses[count++]);
+	}
+	if (query->result != NULL_RESULT) {
+		Clause *clause = &clauses[count++];
+		clause->conditions[0].column = RESULT_COLUMN;
+		clause->conditions[0].low = clause->conditions[0].high = query->result;
+		clause->count = 1;
+	}
+
+	if (!possible)
+		return 0;
+
+	// Find the clause with the fewest games, which is where we start
+	uint first = count;
+	uint64_t fewest = index->games;
+	uint64_t starts[2];
+	uint64_t ends[2];
+	for (uint i = 0; i < count; i++) {
+		uint64_t s[2], e[2];
+		uint64_t total = 0;
+		for (uint j = 0; j < clauses[i].count; j++) {
+			condition_games(index, &clauses[i].conditions[j], &s[j], &e[j]);
+			total += e[j] - s[j];
+		}
+
+		if (total < fewest) {
+			first = i;
+			fewest = total;
+			memcpy(starts, s, sizeof starts);
+			memcpy(ends, e, sizeof ends);
+		}
+	}
+
+	if (fewest == 0)
+		return 0;
+
+	// Then the games are narrowed down one clause at a time, so that each
+	// clause only reads its own columns. Scanning goes by the value columns
+	// rather than the sorted ones, and in a damaged file those needn't agree
+	// on how many games match, so that needs room for all of them.
+	bool sorted = fewest > index->games / SCAN_FRACTION;
+	uint64_t room = sorted ? index->games : fewest;
+	uint32_t *matches = malloc((room + 1) * sizeof *matches);
+	size_t found = 0;
+	if (first == count) {
+		for (uint32_t game = 0; game < index->games; game++)
+			matches[found++] = game;
+	} else if (sorted) {
+		found = scan_games(index, &clauses[first], matches);
+	} else {
+		found = clause_games(index, &clauses[first], starts, ends, matches);
+	}
+
+	for (uint i = 0; i < count; i++) {
+		if (i != first)
+			found = filter_games(index, &clauses[i], matches, found);
+	}
+
+	// Sorting after filtering means sorting fewer games
+	if (!sorted)
+		found = sort_games(matches, found);
+
+	if (found == 0)
+		free(matches);
+	else
+		*games = matches;
+
+	return found;
+}
+
+void tag_index_close(Tag_index *index)
+{
+	g_mapped_file_unref(index->file);
+	free(index);
+}
@@ -0,0 +1,68 @@
+#ifndef TAG_INDEX_H_
+#define TAG_INDEX_H_
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "database.h"
+#include "pgn.h"
+
+// An index of the tags of every game in a game database, for searching by
+// player, event, ECO code, date, rating and result without reading the
+// games.
+//
+// The index is columnar: for each of those it has an array with every game's
+// value, and another with the games sorted by value, so that the games with
+// a value in some range are all together and can be found by binary search.
+// A query starts from whichever of its conditions matches the fewest games,
+// and checks the rest of the conditions for just those games against the
+// columns.
+//
+// Names, events and ECO codes are stored as IDs into a table of all their
+// distinct values, which is sorted, so that the values with a given prefix
+// have a range of IDs too.
+
+typedef struct Game_query
+{
+	// Each of these is ignored if it's NULL. They must match the tag values
+	// exactly, or just start with them if prefix_match is set.
+	const char *player; // White or Black
+	const char *white;
+	const char *black;
+	const char *event;
+	const char *eco;
+	bool prefix_match;
+
+	// Dates are numbers like 20240131, as from parse_date_tag, and are
+	// inclusive. Zero means no limit.
+	uint32_t min_date;
+	uint32_t max_date;
+
+	// Both players' ratings have to be in this range, inclusive. Zero means
+	// no limit, but if either limit is set, unrated games never match.
+	uint min_elo;
+	uint max_elo;
+
+	// NULL_RESULT to match any result
+	Result result;
+} Game_query;
+
+// Sets up a query that matches every game, for filling in.
+void game_query_init(Game_query *query);
+
+// The index records the database's stamp, for telling when it's out of date
+bool tag_index_build(Game_db *db, const char *filename, GError **error);
+
+// The file is memory mapped, and queries only look at the parts they need.
+typedef struct Tag_index Tag_index;
+
+Tag_index *tag_index_open(const char *filename, GError **error);
+size_t tag_index_game_count(Tag_index *index);
+const Game_db_stamp *tag_index_stamp(Tag_index *index);
+// Sets *games to the indices of the games matching the query, in ascending
+// order, which must be freed with free. Returns how many there are.
+size_t tag_index_search(Tag_index *index, Game_query *query, uint32_t **games);
+void tag_index_close(Tag_index *index);
+
+#endif // include guard
@@ -0,0 +1,225 @@
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "tags.h"
+
+#define POOL_FIRST_BLOCK_SIZE 4096
+
+// The pool is split into shards by string (see shard_for), each with its own
+// lock, so that threads reading PGNs at the same time (see import_pgn) are
+// almost never after the same lock. Must be a power of two.
+#define SHARD_BITS 6
+#define SHARDS (1 << SHARD_BITS)
+
+typedef struct Shard
+{
+	GMutex lock;
+	// The strings in this shard, names and values alike
+	Arena arena;
+	// Both map from the pooled strings: names to their IDs plus one (so that
+	// a missing name can be told apart from ID 0), and values to themselves
+	GHashTable *names;
+	GHashTable *values;
+} Shard;
+
+// Shards are padded out to two cache lines, so that no two of them share one
+// wherever the array starts, and threads using different shards don't slow
+// each other down
+typedef union Padded_shard
+{
+	Shard shard;
+	char padding[128];
+} Padded_shard;
+
+// Statically allocated GMutexes don't need initializing
+static Padded_shard shards[SHARDS];
+static gsize pool_initialized;
+
+// Names are numbered across all the shards, so giving out IDs and looking
+// them up has its own lock. This is only needed the first time each name is
+// seen, and to turn IDs back into names.
+static GMutex names_lock;
+static GPtrArray *name_strings;
+
+// Strings shorter than this are copied onto the stack to be null-terminated
+// for lookups
+#define SHORT_STRING_SIZE 128
+
+static const char *roster_tag_names[ROSTER_TAGS] =
+{
+	"Event", "Site", "Date", "Round", "White", "Black", "Result"
+};
+
+static const char *pool_copy(Shard *shard, const char *str, size_t length)
+{
+	char *copy = arena_alloc(&shard->arena, length + 1);
+	memcpy(copy, str, length + 1);
+
+	return copy;
+}
+
+// Must be called with the shard's lock held, or before anything else can be
+// using the pool
+static Tag_name add_name(Shard *shard, const char *name, size_t length)
+{
+	const char *copy = pool_copy(shard, name, length);
+
+	g_mutex_lock(&names_lock);
+	Tag_name id = name_strings->len;
+	g_ptr_array_add(name_strings, (gpointer)copy);
+	g_mutex_unlock(&names_lock);
+
+	g_hash_table_insert(shard->names, (gpointer)copy, GUINT_TO_POINTER(id + 1));
+
+	return id;
+}
+
+// The shard only needs to spread the strings out, not tell them apart, so
+// rather than hashing the whole string a second time, it's picked from the
+// length and the last few bytes, which is where names and numbers that share
+// a prefix differ
+static Shard *shard_for(const char *str, size_t length)
+{
+	uint64_t tail = 0;
+	size_t n = length < sizeof tail ? length : sizeof tail;
+	memcpy(&tail, str + length - n, n);
+
+	uint64_t hash = (tail ^ length) * UINT64_C(0x9E3779B97F4A7C15);
+	return &shards[hash >> (64 - SHARD_BITS)].shard;
+}
+
+static void init_pool(void)
+{
+	if (!g_once_init_enter(&pool_initialized))
+		return;
+
+	for (uint i = 0; i < SHARDS; i++) {
+		Shard *shard = &shards[i].shard;
+		arena_init(&shard->arena, POOL_FIRST_BLOCK_SIZE);
+		shard->names = g_hash_table_new(g_str_hash, g_str_equal);
+		shard->values = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+	name_strings = g_ptr_array_new();
+
+	// This gives them the IDs in Roster_tag
+	for (size_t i = 0; i < ROSTER_TAGS; i++) {
+		const char *name = roster_tag_names[i];
+		add_name(shard_for(name, strlen(name)), name, strlen(name));
+	}
+
+	g_once_init_leave(&pool_initialized, 1);
+}
+
+// A null-terminated copy of str, which is in buf if it fits, and must be
+// freed otherwise
+static char *null_terminated(const char *str, size_t length,
+		char buf[SHORT_STRING_SIZE])
+{
+	char *copy = length < SHORT_STRING_SIZE ? buf : malloc(length + 1);
+	memcpy(copy, str, length);
+	copy[length] = '\0';
+
+	return copy;
+}
+
+Tag_name intern_tag_name(const char *name, size_t length)
+{
+	init_pool();
+
+	char buf[SHORT_STRING_SIZE];
+	char *key = null_terminated(name, length, buf);
+	Shard *shard = shard_for(key, length);
+
+	g_mutex_lock(&shard->lock);
+	uint id_plus_one = GPOINTER_TO_UINT(g_hash_table_lookup(shard->names, key));
+	Tag_name id = id_plus_one != 0 ?
+		id_plus_one - 1 :
+		add_name(shard, key, length);
+	g_mutex_unlock(&shard->lock);
+
+	if (key != buf)
+		free(key);
+
+	return id;
+}
+
+const char *tag_name_string(Tag_name name)
+{
+	if (name < ROSTER_TAGS)
+		return roster_tag_names[name];
+
+	// The array can move when names are added
+	g_mutex_lock(&names_lock);
+	const char *str = g_ptr_array_index(name_strings, name);
+	g_mutex_unlock(&names_lock);
+
+	return str;
+}
+
+const char *intern_tag_value(const char *value, size_t length)
+{
+	init_pool();
+
+	char buf[SHORT_STRING_SIZE];
+	char *key = null_terminated(value, length, buf);
+	Shard *shard = shard_for(key, length);
+
+	g_mutex_lock(&shard->lock);
+	const char *pooled = g_hash_table_lookup(shard->values, key);
+	if (pooled == NULL) {
+		pooled = pool_copy(shard, key, length);
+		g_hash_table_insert(shard->values, (gpointer)pooled, (gpointer)pooled);
+	}
+	g_mutex_unlock(&shard->lock);
+
+	if (key != buf)
+		free(key);
+
+	return pooled;
+}
+
+const char *default_tag_value(Tag_name name)
+{
+	switch (name) {
+	case TAG_DATE:
+		return "????.??.??";
+	case TAG_RESULT:
+		return "*";
+	default:
+		return "?";
+	}
+}
+
+// Unknown ratings are usually left out, but they're sometimes given as "?"
+// or "-", or as 0.
+uint parse_elo_tag(const char *value)
+{
+	if (value == NULL)
+		return 0;
+
+	char *end;
+	unsigned long elo = strtoul(value, &end, 10);
+
+	return end != value && *end == '\0' && elo < 10000 ? elo : 0;
+}
+
+uint32_t parse_date_tag(const char *value)
+{
+	uint year = 0;
+	uint month = 0;
+	uint day = 0;
+
+	// This stops at the first part that's "??"
+	int parts = value == NULL ? 0 :
+		sscanf(value, "%4u.%2u.%2u", &year, &month, &day);
+	if (parts < 1 || year == 0)
+		return 0;
+	if (parts < 2 || month > 12)
+		month = 0;
+	if (parts < 3 || month == 0 || day > 31)
+		day = 0;
+
+	return year * 10000 + month * 100 + day;
+}
@@ -0,0 +1,57 @@
+#ifndef TAGS_H_
+#define TAGS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "misc.h"
+
+// PGN tags are stored as pairs of small integer IDs for the names and
+// pointers into a string pool shared by every game. Names and values repeat
+// a lot across a database ("Event", "Site", player names, "1-0" ...), so
+// each distinct string is only stored once, and games just point at it.
+//
+// Strings in the pool are never freed, so they can be held onto for as long
+// as the program runs. The pool can be used from several threads at once.
+
+typedef uint Tag_name;
+
+// The seven tags that every game is meant to have, in the order they're
+// written in. Their names always have these IDs.
+typedef enum Roster_tag
+{
+	TAG_EVENT,
+	TAG_SITE,
+	TAG_DATE,
+	TAG_ROUND,
+	TAG_WHITE,
+	TAG_BLACK,
+	TAG_RESULT,
+	ROSTER_TAGS,
+} Roster_tag;
+
+typedef struct Tag
+{
+	Tag_name name;
+	const char *value;
+} Tag;
+
+// The ID for a tag name, which is given a new one if it hasn't been seen
+// before. The text doesn't need to be null-terminated.
+Tag_name intern_tag_name(const char *name, size_t length);
+const char *tag_name_string(Tag_name name);
+
+// The pooled copy of a tag value, which is the same pointer for equal values
+const char *intern_tag_value(const char *value, size_t length);
+
+// The value to write for a roster tag that a game doesn't have
+const char *default_tag_value(Tag_name name);
+
+// A rating from a tag like WhiteElo, or 0 if it's missing or unknown
+uint parse_elo_tag(const char *value);
+
+// A date from a Date tag, such as "2024.01.31", as a number such as 20240131,
+// so that dates compare as numbers. Unknown months and days are 0, and so is
+// the whole thing if the year is unknown or it isn't a date at all.
+uint32_t parse_date_tag(const char *value);
+
+#endif // include guard
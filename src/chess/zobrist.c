@@ -0,0 +1,96 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include "attacks.h"
+#include "bitboard.h"
+#include "board.h"
+#include "zobrist.h"
+
+uint64_t zobrist_piece_keys[PLAYERS][PIECE_TYPES + 1][BOARD_SIZE * BOARD_SIZE];
+uint64_t zobrist_black_to_move_key;
+uint64_t zobrist_castling_keys[16];
+uint64_t zobrist_en_passant_keys[BOARD_SIZE];
+
+// SplitMix64. The keys don't need to be particularly random, but they do need
+// to be the same every time, so that hashes can be stored and compared
+// between runs.
+static uint64_t next_key(uint64_t *state)
+{
+	uint64_t z = (*state += UINT64_C(0x9E3779B97F4A7C15));
+	z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+	z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+
+	return z ^ (z >> 31);
+}
+
+void init_zobrist_keys(void)
+{
+	static bool initialized = false;
+	if (initialized)
+		return;
+
+	uint64_t state = UINT64_C(0x636865737362);
+
+	for (uint p = 0; p < PLAYERS; p++)
+		for (uint t = PAWN; t <= KING; t++)
+			for (uint i = 0; i < BOARD_SIZE * BOARD_SIZE; i++)
+				zobrist_piece_keys[p][t][i] = next_key(&state);
+
+	zobrist_black_to_move_key = next_key(&state);
+
+	// Each castling right gets its own key, and each combination of rights is
+	// the XOR of the keys for the rights in it. That way losing a right is the
+	// same change to the hash whatever other rights are still around.
+	uint64_t right_keys[4];
+	for (uint r = 0; r < 4; r++)
+		right_keys[r] = next_key(&state);
+	for (uint c = 0; c < 16; c++) {
+		zobrist_castling_keys[c] = 0;
+		for (uint r = 0; r < 4; r++)
+			if (c & (1 << r))
+				zobrist_castling_keys[c] ^= right_keys[r];
+	}
+
+	for (uint x = 0; x < BOARD_SIZE; x++)
+		zobrist_en_passant_keys[x] = next_key(&state);
+
+	initialized = true;
+}
+
+// The en passant square only matters if a pawn can actually capture onto it.
+// Otherwise positions that are the same in every way that matters would hash
+// differently depending on whether the last move was a double pawn push.
+uint64_t en_passant_key(Board *board)
+{
+	if (board->en_passant == NULL_SQUARE)
+		return 0;
+
+	uint target = SQUARE_INDEX(board->en_passant);
+	Player us = board->turn;
+	Bitboard capturers = PAWN_ATTACKS(OTHER_PLAYER(us), target) &
+		PIECES_OF(board, us, PAWN);
+	if (capturers == EMPTY_BITBOARD)
+		return 0;
+
+	return zobrist_en_passant_keys[SQUARE_X(board->en_passant)];
+}
+
+// Calculates the hash of a board from scratch. This is what the hash kept up
+// to date by set_piece and make_move should always be equal to.
+uint64_t hash_board(Board *board)
+{
+	uint64_t hash = 0;
+
+	for (uint i = 0; i < BOARD_SIZE * BOARD_SIZE; i++) {
+		Piece p = board->pieces[i];
+		if (p != EMPTY)
+			hash ^= PIECE_KEY(p, i);
+	}
+
+	if (board->turn == BLACK)
+		hash ^= zobrist_black_to_move_key;
+
+	hash ^= zobrist_castling_keys[CASTLING_INDEX(board)];
+	hash ^= en_passant_key(board);
+
+	return hash;
+}
@@ -0,0 +1,33 @@
+#ifndef ZOBRIST_H_
+#define ZOBRIST_H_
+
+#include <stdint.h>
+#include "board.h"
+
+// Zobrist hashing gives each (piece, square) pair and each other bit of
+// board state a random 64-bit key. A position's hash is the XOR of the keys
+// for everything in it, so moving a piece only takes a couple of XORs to
+// update, and two positions with the same hash are almost certainly the same.
+// See <https://www.chessprogramming.org/Zobrist_Hashing>
+//
+// Like the attack tables, the keys are set up by from_fen.
+
+extern uint64_t zobrist_piece_keys[PLAYERS][PIECE_TYPES + 1][BOARD_SIZE * BOARD_SIZE];
+extern uint64_t zobrist_black_to_move_key;
+extern uint64_t zobrist_castling_keys[16];
+extern uint64_t zobrist_en_passant_keys[BOARD_SIZE];
+
+#define PIECE_KEY(p, i) (zobrist_piece_keys[PLAYER(p)][PIECE_TYPE(p)][i])
+
+// Packs castling rights into 4 bits, for indexing zobrist_castling_keys.
+#define CASTLING_INDEX(b) \
+	(((b)->castling[WHITE].kingside  ? 1 : 0) | \
+	 ((b)->castling[WHITE].queenside ? 2 : 0) | \
+	 ((b)->castling[BLACK].kingside  ? 4 : 0) | \
+	 ((b)->castling[BLACK].queenside ? 8 : 0))
+
+void init_zobrist_keys(void);
+uint64_t en_passant_key(Board *board);
+uint64_t hash_board(Board *board);
+
+#endif // include guard
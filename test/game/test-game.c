@@ -0,0 +1,348 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chess/board.h"
+#include "chess/game.h"
+#include "chess/moves.h"
+
+// Checks for the parts of game trees that the PGN tests don't get at, like
+// draw detection and rebuilding boards between checkpoints. Each test prints
+// a line if it fails.
+
+static uint failures = 0;
+
+static void expect(bool passed, const char *what)
+{
+	if (!passed) {
+		printf("FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+// Sets up a game from a FEN and plays some space-separated moves in algebraic
+// notation. Returns the node after the last move, or NULL if the FEN or one
+// of the moves is invalid.
+static Game *play(const char *fen, const char *moves)
+{
+	Game *game = new_game();
+	if (!from_fen(game->board, fen)) {
+		free_game(game);
+		return NULL;
+	}
+
+	Game *node = game;
+	const char *p = moves;
+	while (*p != '\0') {
+		size_t length = strcspn(p, " ");
+		Move move = parse_algebraic_notation(game_board(node), p, length);
+		if (move == NULL_MOVE) {
+			printf("Invalid move %.*s\n", (int)length, p);
+			free_game(game);
+			return NULL;
+		}
+
+		node = add_child(node, move);
+		p += length;
+		p += strspn(p, " ");
+	}
+
+	return node;
+}
+
+// The draw status after some moves, or -1 if they couldn't be played
+static int status_after(const char *fen, const char *moves)
+{
+	Game *node = play(fen, moves);
+	if (node == NULL)
+		return -1;
+
+	int status = draw_status(node);
+	free_game(node);
+
+	return status;
+}
+
+static uint repetitions_after(const char *fen, const char *moves)
+{
+	Game *node = play(fen, moves);
+	if (node == NULL)
+		return 0;
+
+	uint count = repetition_count(node);
+	free_game(node);
+
+	return count;
+}
+
+static bool has(int status, Draw_reason reason)
+{
+	return status != -1 && (status & reason) != 0;
+}
+
+static void test_repetition(void)
+{
+	const char *shuffle = "Nf3 Nf6 Ng1 Ng8";
+
+	expect(repetitions_after(start_board_fen, shuffle) == 2,
+			"knight shuffle repeats the start position");
+	expect(!has(status_after(start_board_fen, shuffle),
+				DRAW_THREEFOLD_REPETITION),
+			"two occurrences aren't threefold repetition");
+
+	int status = status_after(start_board_fen, "Nf3 Nf6 Ng1 Ng8 Nf3 Nf6 Ng1 Ng8");
+	expect(has(status, DRAW_THREEFOLD_REPETITION),
+			"three occurrences are threefold repetition");
+	expect(!has(status, DRAW_FIVEFOLD_REPETITION),
+			"three occurrences aren't fivefold repetition");
+
+	status = status_after(start_board_fen,
+			"Nf3 Nf6 Ng1 Ng8 Nf3 Nf6 Ng1 Ng8 Nf3 Nf6 Ng1 Ng8 Nf3 Nf6 Ng1 Ng8");
+	expect(has(status, DRAW_FIVEFOLD_REPETITION),
+			"five occurrences are fivefold repetition");
+
+	// The white king goes round a triangle, so the pieces end up where they
+	// started but with the other player to move
+	expect(repetitions_after("4k3/8/8/8/8/8/8/R3K3 w - - 0 1",
+				"Kd1 Ke7 Kd2 Ke8 Ke1") == 1,
+			"repetition needs the same player to move");
+
+	// A pawn move means nothing before it can repeat
+	expect(repetitions_after(start_board_fen,
+				"Nf3 Nf6 Ng1 Ng8 e3 e6 Nf3 Nf6 Ng1 Ng8") == 2,
+			"positions repeated after a pawn move are counted");
+}
+
+// Positions with the same pieces on the same squares only repeat if the same
+// castling and en passant captures are possible.
+static void test_repetition_rights(void)
+{
+	// The first position still has castling rights, the rest don't
+	const char *castling = "r3k2r/8/8/8/8/8/8/R3K2R w KQkq - 0 1";
+	expect(repetitions_after(castling, "Ke2 Ke7 Ke1 Ke8 Ke2 Ke7 Ke1 Ke8") == 2,
+			"losing castling rights changes the position");
+	expect(repetitions_after(castling,
+				"Ke2 Ke7 Ke1 Ke8 Ke2 Ke7 Ke1 Ke8 Ke2 Ke7 Ke1 Ke8") == 3,
+			"repetition after losing castling rights");
+
+	// After d4, exd3 is possible the first time round but not after that
+	const char *capturable = "4k3/8/8/8/4p3/8/3P4/4K3 w - - 0 1";
+	expect(repetitions_after(capturable,
+				"d4 Ke7 Ke2 Ke8 Ke1 Ke7 Ke2 Ke8 Ke1") == 2,
+			"a possible en passant capture changes the position");
+
+	// Without a pawn that could capture, the en passant square doesn't matter
+	const char *uncapturable = "4k3/8/8/8/8/4p3/3P4/4K3 w - - 0 1";
+	expect(repetitions_after(uncapturable, "d4 Ke7 Kd1 Ke8 Ke1 Ke7 Kd1 Ke8 Ke1")
+				== 3,
+			"an impossible en passant capture doesn't change the position");
+}
+
+static void test_move_rules(void)
+{
+	const char *fen_99 = "4k3/8/8/8/8/8/4P3/R3K3 w - - 99 80";
+	expect(!has(status_after(fen_99, ""), DRAW_FIFTY_MOVE_RULE),
+			"99 half-moves isn't the 50-move rule");
+	int status = status_after(fen_99, "Ra2");
+	expect(has(status, DRAW_FIFTY_MOVE_RULE),
+			"100 half-moves is the 50-move rule");
+	expect(!has(status, DRAW_SEVENTY_FIVE_MOVE_RULE),
+			"100 half-moves isn't the 75-move rule");
+	expect(status_after(fen_99, "e4") == 0, "a pawn move resets the 50-move rule");
+
+	const char *fen_149 = "4k3/8/8/8/8/8/4P3/R3K3 w - - 149 100";
+	expect(!has(status_after(fen_149, ""), DRAW_SEVENTY_FIVE_MOVE_RULE),
+			"149 half-moves isn't the 75-move rule");
+	status = status_after(fen_149, "Ra2");
+	expect(has(status, DRAW_SEVENTY_FIVE_MOVE_RULE),
+			"150 half-moves is the 75-move rule");
+	expect(has(status, DRAW_FIFTY_MOVE_RULE),
+			"150 half-moves is also the 50-move rule");
+
+	expect(status_after("7k/8/6K1/8/8/8/8/R7 w - - 99 80", "Ra8") == 0,
+			"checkmate on the 100th half-move isn't a draw");
+}
+
+static void test_insufficient_material(void)
+{
+	struct { const char *fen; bool insufficient; const char *what; } tests[] = {
+		{ "8/8/4k3/8/8/4K3/8/8 w - - 0 1", true, "K vs K" },
+		{ "8/8/4k3/8/8/4K3/8/6N1 w - - 0 1", true, "K+N vs K" },
+		{ "8/8/4k3/8/8/4K3/8/2B5 w - - 0 1", true, "K+B vs K" },
+		{ "5b2/8/4k3/8/8/4K3/8/2B5 w - - 0 1", true,
+			"K+B vs K+B with bishops on the same colour" },
+		{ "5b2/8/4k3/8/8/4K3/8/B1B5 w - - 0 1", true,
+			"several bishops all on the same colour" },
+		{ "2b5/8/4k3/8/8/4K3/8/2B5 w - - 0 1", false,
+			"K+B vs K+B with bishops on different colours" },
+		{ "8/8/4k3/8/8/4K3/8/1N4N1 w - - 0 1", false, "K+N+N vs K" },
+		{ "6n1/8/4k3/8/8/4K3/8/2B5 w - - 0 1", false, "K+B vs K+N" },
+		{ "8/8/4k3/8/8/4K3/4P3/8 w - - 0 1", false, "K+P vs K" },
+		{ "8/8/4k3/8/8/4K3/8/7R w - - 0 1", false, "K+R vs K" },
+	};
+
+	for (uint i = 0; i < sizeof tests / sizeof tests[0]; i++) {
+		int status = status_after(tests[i].fen, "");
+		expect(status != -1 &&
+				has(status, DRAW_INSUFFICIENT_MATERIAL) == tests[i].insufficient,
+				tests[i].what);
+	}
+}
+
+static bool boards_equal(Board *a, Board *b)
+{
+	return a->turn == b->turn &&
+		a->castling[WHITE].kingside == b->castling[WHITE].kingside &&
+		a->castling[WHITE].queenside == b->castling[WHITE].queenside &&
+		a->castling[BLACK].kingside == b->castling[BLACK].kingside &&
+		a->castling[BLACK].queenside == b->castling[BLACK].queenside &&
+		a->en_passant == b->en_passant &&
+		a->half_move_clock == b->half_move_clock &&
+		a->move_number == b->move_number &&
+		a->hash == b->hash &&
+		memcmp(a->by_type, b->by_type, sizeof a->by_type) == 0 &&
+		memcmp(a->by_player, b->by_player, sizeof a->by_player) == 0 &&
+		memcmp(a->pieces, b->pieces, sizeof a->pieces) == 0;
+}
+
+// Works out the board at node the slow way, by playing every move from the
+// root.
+static void replay_board(Game *node, Board *board)
+{
+	if (node->parent == NULL) {
+		copy_board(board, node->board);
+		return;
+	}
+
+	replay_board(node->parent, board);
+	Undo undo;
+	make_move(board, node->move, &undo);
+}
+
+// Plays random moves from node, stopping early if the game ends. Returns the
+// last node.
+static Game *random_moves(Game *node, uint plies)
+{
+	for (uint i = 0; i < plies; i++) {
+		Move_list moves;
+		generate_legal_moves(game_board(node), &moves);
+		if (moves.count == 0)
+			break;
+
+		node = add_child(node, moves.moves[rand() % moves.count]);
+	}
+
+	return node;
+}
+
+static uint collect_nodes(Game *node, Game **nodes, uint count, uint max)
+{
+	if (count < max)
+		nodes[count++] = node;
+	for (Game *child = node->children; child != NULL; child = child->sibling)
+		count = collect_nodes(child, nodes, count, max);
+
+	return count;
+}
+
+#define MAX_TEST_NODES 1024
+
+// Checks that game_board gives the right board for every node in the tree,
+// asking for them in a random order so that boards come from a mix of
+// checkpoints, the cache, and ancestors in the cache.
+static void check_boards(Game *game, const char *what)
+{
+	Game *nodes[MAX_TEST_NODES];
+	uint count = collect_nodes(root_node(game), nodes, 0, MAX_TEST_NODES);
+
+	for (uint i = count - 1; i > 0; i--) {
+		uint j = rand() % (i + 1);
+		Game *tmp = nodes[i];
+		nodes[i] = nodes[j];
+		nodes[j] = tmp;
+	}
+
+	bool passed = true;
+	for (uint i = 0; i < count; i++) {
+		Board expected;
+		replay_board(nodes[i], &expected);
+		Board *board = game_board(nodes[i]);
+
+		if (!boards_equal(board, &expected) || game_hash(nodes[i]) != expected.hash)
+			passed = false;
+	}
+
+	expect(passed, what);
+}
+
+static Game *new_start_game(uint checkpoint_interval)
+{
+	Game *game = new_game();
+	set_checkpoint_interval(game, checkpoint_interval);
+	from_fen(game->board, start_board_fen);
+
+	return game;
+}
+
+static void test_checkpoints(void)
+{
+	srand(1);
+
+	uint intervals[] = { 1, 2, 16, MAX_CHECKPOINT_INTERVAL };
+	for (uint i = 0; i < sizeof intervals / sizeof intervals[0]; i++) {
+		Game *game = new_start_game(intervals[i]);
+		Game *node = random_moves(game, 150);
+
+		// Some variations, so that there are nodes whose nearest checkpoint is
+		// on the mainline
+		for (uint j = 0; j < 10; j++) {
+			Game *start = game;
+			for (uint k = rand() % node->ply; k > 0; k--)
+				start = first_child(start);
+			random_moves(start, 1 + rand() % 70);
+		}
+
+		check_boards(game, "boards rebuilt from checkpoints");
+		release_board_cache(game);
+		check_boards(game, "boards rebuilt after releasing the cache");
+
+		free_game(game);
+	}
+
+	// Changing the interval part way through mustn't leave more than the
+	// largest interval between boards. Counting from the ply would put the
+	// next board after the change at ply 126 here.
+	Game *game = new_start_game(MAX_CHECKPOINT_INTERVAL);
+	Game *node = random_moves(game, MAX_CHECKPOINT_INTERVAL - 1);
+	set_checkpoint_interval(game, MAX_CHECKPOINT_INTERVAL - 1);
+	node = random_moves(node, MAX_CHECKPOINT_INTERVAL - 1);
+	release_board_cache(game);
+	check_boards(node, "boards after making the checkpoint interval shorter");
+	free_game(game);
+
+	// And the other way round, with every node keeping a board at first
+	game = new_start_game(1);
+	node = random_moves(game, 30);
+	set_checkpoint_interval(game, 7);
+	node = random_moves(node, 30);
+	set_checkpoint_interval(game, 3);
+	random_moves(node, 30);
+	check_boards(game, "boards after changing the checkpoint interval");
+	free_game(game);
+}
+
+int main(void)
+{
+	test_repetition();
+	test_repetition_rights();
+	test_move_rules();
+	test_insufficient_material();
+	test_checkpoints();
+
+	if (failures == 0)
+		puts("All game tests passed");
+	else
+		printf("%u game tests failed\n", failures);
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,287 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "chess/board.h"
+#include "chess/moves.h"
+#include "chess/packed.h"
+
+// Counts the leaf nodes of the move tree to a given depth. Comparing these
+// against known values is a very thorough check of move generation, and
+// timing it is a decent benchmark of the move code as a whole.
+// See <https://www.chessprogramming.org/Perft>
+
+static uint64_t perft(Board *board, uint depth)
+{
+	Move_list moves;
+	generate_legal_moves(board, &moves);
+
+	// We don't need to actually make the moves to count them
+	if (depth == 1)
+		return moves.count;
+
+	uint64_t nodes = 0;
+	for (uint i = 0; i < moves.count; i++) {
+		Undo undo;
+		make_move(board, moves.moves[i], &undo);
+		nodes += perft(board, depth - 1);
+		unmake_move(board, moves.moves[i], &undo);
+	}
+
+	return nodes;
+}
+
+// Prints a move in the coordinate notation used by UCI engines (e.g. e7e8q),
+// so that divide output can be compared against theirs.
+static void print_coordinate_move(Move m)
+{
+	Square start = START_SQUARE(m);
+	Square end = END_SQUARE(m);
+
+	putchar(FILE_CHAR(SQUARE_X(start)));
+	putchar(RANK_CHAR(SQUARE_Y(start)));
+	putchar(FILE_CHAR(SQUARE_X(end)));
+	putchar(RANK_CHAR(SQUARE_Y(end)));
+	if (PROMOTION(m) != EMPTY)
+		putchar("  nbrq"[PROMOTION(m)]);
+}
+
+static double seconds_since(clock_t start)
+{
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void print_rate(uint64_t nodes, double seconds)
+{
+	if (seconds > 0)
+		printf("%.2fs, %.0f nodes/sec", seconds, nodes / seconds);
+	else
+		printf("%.2fs", seconds);
+}
+
+// Prints the number of leaf nodes under each root move, which makes it easy
+// to narrow down where a wrong count is coming from.
+static void divide(Board *board, uint depth)
+{
+	Move_list moves;
+	generate_legal_moves(board, &moves);
+
+	clock_t start = clock();
+	uint64_t total = 0;
+
+	for (uint i = 0; i < moves.count; i++) {
+		Undo undo;
+		make_move(board, moves.moves[i], &undo);
+		uint64_t nodes = depth <= 1 ? 1 : perft(board, depth - 1);
+		unmake_move(board, moves.moves[i], &undo);
+
+		total += nodes;
+
+		print_coordinate_move(moves.moves[i]);
+		printf(": %llu\n", (unsigned long long)nodes);
+	}
+
+	printf("\n%u moves, %llu nodes (", moves.count, (unsigned long long)total);
+	print_rate(total, seconds_since(start));
+	puts(")");
+}
+
+static bool same_board(Board *a, Board *b)
+{
+	Packed_board packed_a, packed_b;
+	pack_board(&packed_a, a);
+	pack_board(&packed_b, b);
+
+	return memcmp(&packed_a, &packed_b, sizeof packed_a) == 0 &&
+		a->hash == b->hash &&
+		memcmp(a->pieces, b->pieces, sizeof a->pieces) == 0 &&
+		memcmp(a->by_type, b->by_type, sizeof a->by_type) == 0 &&
+		memcmp(a->by_player, b->by_player, sizeof a->by_player) == 0;
+}
+
+static bool board_survives_packing(Board *board)
+{
+	Packed_board packed;
+	Board unpacked;
+	pack_board(&packed, board);
+	unpack_board(&unpacked, &packed);
+
+	return same_board(board, &unpacked);
+}
+
+// Checks that the board, every legal move from it, and the board after each
+// of those moves all come back the same after being packed and unpacked (see
+// packed.h). Between them the suite positions have all the odd cases, like
+// promotions, castling and en passant.
+static bool check_packing(Board *board)
+{
+	if (!board_survives_packing(board))
+		return false;
+
+	Move_list moves;
+	generate_legal_moves(board, &moves);
+	for (uint i = 0; i < moves.count; i++) {
+		Move move = moves.moves[i];
+		if (unpack_move(pack_move(move)) != move)
+			return false;
+
+		Undo undo;
+		make_move(board, move, &undo);
+		bool survived = board_survives_packing(board);
+		unmake_move(board, move, &undo);
+
+		if (!survived)
+			return false;
+	}
+
+	return unpack_move(pack_move(NULL_MOVE)) == NULL_MOVE;
+}
+
+// Runs every position in a suite file, which has one position per line in the
+// form:
+//
+//     <FEN> ;D1 <count> ;D2 <count> ...
+//
+// Blank lines and lines starting with '#' are ignored. Depths greater than
+// max_depth are skipped. Each position is also checked with check_packing.
+// Returns the number of checks that failed.
+static uint run_suite(const char *filename, uint max_depth)
+{
+	FILE *file = fopen(filename, "r");
+	if (file == NULL) {
+		fprintf(stderr, "Couldn't open suite file '%s'\n", filename);
+		return 1;
+	}
+
+	uint failures = 0;
+	uint64_t total_nodes = 0;
+	double total_seconds = 0;
+	char line[1024];
+
+	while (fgets(line, sizeof line, file) != NULL) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		char *fen = strtok(line, ";");
+		Board board;
+		if (!from_fen(&board, fen)) {
+			printf("Invalid FEN: %s\n", fen);
+			failures++;
+			continue;
+		}
+
+		printf("%s\n", fen);
+
+		if (check_packing(&board)) {
+			puts("  Packing ok");
+		} else {
+			puts("  Packing FAILED");
+			failures++;
+		}
+
+		char *field;
+		while ((field = strtok(NULL, ";")) != NULL) {
+			uint depth;
+			unsigned long long expected;
+			if (sscanf(field, " D%u %llu", &depth, &expected) != 2)
+				continue;
+			if (depth > max_depth)
+				continue;
+
+			clock_t start = clock();
+			uint64_t nodes = perft(&board, depth);
+			double seconds = seconds_since(start);
+
+			total_nodes += nodes;
+			total_seconds += seconds;
+
+			bool passed = nodes == expected;
+			if (!passed)
+				failures++;
+
+			printf("  D%u %12llu  ", depth, (unsigned long long)nodes);
+			print_rate(nodes, seconds);
+			if (passed)
+				puts("  ok");
+			else
+				printf("  FAILED (expected %llu)\n", expected);
+		}
+	}
+
+	fclose(file);
+
+	printf("\nTotal: %llu nodes, ", (unsigned long long)total_nodes);
+	print_rate(total_nodes, total_seconds);
+	putchar('\n');
+
+	if (failures == 0)
+		puts("All counts and packing correct");
+	else
+		printf("%u checks failed\n", failures);
+
+	return failures;
+}
+
+static void usage(const char *prog_name)
+{
+	fprintf(stderr,
+			"Usage: %s [-d] <depth> [fen]\n"
+			"       %s -s <suite file> [max depth]\n"
+			"\n"
+			"  -d  Show the node count under each move from the root\n"
+			"  -s  Check the counts for every position in a suite file\n",
+			prog_name, prog_name);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (strcmp(argv[1], "-s") == 0) {
+		if (argc < 3) {
+			usage(argv[0]);
+			return 1;
+		}
+
+		uint max_depth = argc > 3 ? (uint)atoi(argv[3]) : ~0u;
+		return run_suite(argv[2], max_depth) == 0 ? 0 : 1;
+	}
+
+	bool show_divide = strcmp(argv[1], "-d") == 0;
+	int arg = show_divide ? 2 : 1;
+	if (arg >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	int depth = atoi(argv[arg++]);
+	if (depth < 1) {
+		fprintf(stderr, "Depth must be at least 1\n");
+		return 1;
+	}
+
+	const char *fen = arg < argc ? argv[arg] : start_board_fen;
+	Board board;
+	if (!from_fen(&board, fen)) {
+		fprintf(stderr, "Invalid FEN: %s\n", fen);
+		return 1;
+	}
+
+	if (show_divide) {
+		divide(&board, depth);
+	} else {
+		clock_t start = clock();
+		uint64_t nodes = perft(&board, depth);
+
+		printf("%llu nodes (", (unsigned long long)nodes);
+		print_rate(nodes, seconds_since(start));
+		puts(")");
+	}
+
+	return 0;
+}
@@ -3,6 +3,8 @@
 cd `dirname $0`
 
 pgns=$(find . -type f -name '*.in')
+# Indexes left over from last time would mean the indexing never gets tested
+rm -f test_files/*.pgni
 num_tests=0
 passed=0
 failed=0
@@ -11,12 +13,32 @@ for pgn in $pgns; do
 	out=$(echo -n $pgn | sed 's/in$/out/')
 	if [ -e "$out" ]; then
 		echo "Testing $pgn..."
-		num_tests=$((tests_run+1))
 
-		./test-pgn "$pgn" | diff - "$out"
+		# Reading the file as a stream, memory mapped, in parallel, through
+		# an index (twice, to use the saved index the second time), through
+		# a game database, and then in tiny chunks, so that tokens are split
+		# between chunks
+		for flags in "" "-m" "-p" "-i" "-i" "-d" "-c 1" "-c 7" "-m -c 5"; do
+			num_tests=$((num_tests+1))
+
+			./test-pgn $flags "$pgn" | diff - "$out"
+			if [ $? -ne 0 ]; then
+				echo
+				echo Failed on `basename "$pgn"` $flags
+
+				failed=$((failed+1))
+			else
+				passed=$((passed+1))
+			fi
+		done
+
+		# The output should read back in as exactly the same games, to
+		# check that the reader understands everything the writer writes
+		num_tests=$((num_tests+1))
+		./test-pgn "$out" | diff - "$out"
 		if [ $? -ne 0 ]; then
 			echo
-			echo Failed on `basename "$pgn"`
+			echo Failed reading back `basename "$out"`
 
 			failed=$((failed+1))
 		else
@@ -1,34 +1,229 @@
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <glib/gstdio.h>
 #include <gtk/gtk.h>
+#include "chess/database.h"
 #include "chess/pgn.h"
 
+// Flushes out whatever's left to write. Returns the exit status.
+static int write_output(PGN_writer *writer)
+{
+	GError *error = NULL;
+	if (!pgn_writer_close(writer, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		return 1;
+	}
+
+	return 0;
+}
+
+// Writes every game in the file to a temporary database, and then writes
+// them back out as PGN from there. Returns the exit status.
+static int through_database(const char *filename, PGN_writer *writer)
+{
+	GError *error = NULL;
+	char *db_filename;
+	int fd = g_file_open_tmp("test-pgn-XXXXXX.db", &db_filename, &error);
+	if (fd == -1) {
+		fprintf(stderr, "%s\n", error->message);
+		return 1;
+	}
+
+	g_close(fd, NULL);
+
+	FILE *db_file = fopen(db_filename, "wb");
+	Game_db_writer *db_writer = game_db_writer_new(db_file);
+	PGN_reader *reader = pgn_reader_open(filename, &error);
+	if (reader == NULL) {
+		fprintf(stderr, "Failed to open PGN '%s'\n", filename);
+		fprintf(stderr, "%s\n", error->message);
+
+		return 1;
+	}
+
+	PGN pgn;
+	while (pgn_reader_next(reader, &pgn, &error)) {
+		bool success = game_db_writer_add(db_writer, &pgn, &error);
+		free_pgn(&pgn);
+		if (!success)
+			break;
+	}
+
+	pgn_reader_close(reader);
+
+	if (error != NULL || !game_db_writer_close(db_writer, &error)) {
+		fprintf(stderr, "Failed to convert PGN '%s'\n", filename);
+		fprintf(stderr, "%s\n", error->message);
+
+		return 1;
+	}
+
+	fclose(db_file);
+
+	Game_db *db = game_db_open(db_filename, &error);
+	if (db == NULL) {
+		fprintf(stderr, "%s\n", error->message);
+		return 1;
+	}
+
+	for (size_t i = 0; i < game_db_game_count(db); i++) {
+		if (!game_db_read_game(db, i, &pgn, &error)) {
+			fprintf(stderr, "Failed to read game %zu back\n", i + 1);
+			fprintf(stderr, "%s\n", error->message);
+
+			return 1;
+		}
+
+		if (!pgn_writer_write(writer, &pgn, &error)) {
+			fprintf(stderr, "%s\n", error->message);
+
+			return 1;
+		}
+
+		free_pgn(&pgn);
+	}
+
+	game_db_close(db);
+	remove(db_filename);
+	g_free(db_filename);
+
+	return write_output(writer);
+}
+
 int main(int argc, char *argv[])
 {
 #if GLIB_MAJOR_VERION <= 2 && GLIB_MINOR_VERSION <= 34
 	g_type_init();
 #endif
 
-	if (argc < 2) {
-		fprintf(stderr, "Usage: %s <pgn file>\n", argv[0]);
+	// By default the file is read as a stream. -m reads it through a memory
+	// mapping instead, -p imports it all at once using several threads, -i
+	// reads each game through an index, and -d converts the games to a game
+	// database and back. -c <size> makes the stream or mapped reader
+	// tokenize that many bytes at a time, so that lots of tokens get cut off
+	// by the end of a chunk.
+	bool mapped = false, parallel = false, indexed = false, database = false;
+	size_t chunk_size = 0;
+	int arg = 1;
+	for (; arg < argc && argv[arg][0] == '-'; arg++) {
+		if (strcmp(argv[arg], "-m") == 0)
+			mapped = true;
+		else if (strcmp(argv[arg], "-p") == 0)
+			parallel = true;
+		else if (strcmp(argv[arg], "-i") == 0)
+			indexed = true;
+		else if (strcmp(argv[arg], "-d") == 0)
+			database = true;
+		else if (strcmp(argv[arg], "-c") == 0 && arg + 1 < argc)
+			chunk_size = strtoul(argv[++arg], NULL, 10);
+		else
+			break;
+	}
+	if (arg != argc - 1) {
+		fprintf(stderr, "Usage: %s [-m | -p | -i | -d] [-c <chunk size>] "
+				"<pgn file>\n", argv[0]);
 		return 1;
 	}
 
-	PGN pgn;
+	const char *filename = argv[arg];
 	GError *error = NULL;
-	if (!read_pgn(&pgn, argv[1], &error)) {
-		fprintf(stderr, "Failed to read PGN '%s'\n", argv[1]);
+	PGN_writer *writer = pgn_writer_new(stdout);
+
+	if (database)
+		return through_database(filename, writer);
+
+	if (parallel) {
+		PGN *pgns;
+		size_t count;
+		if (!import_pgn(filename, 4, &pgns, &count, &error)) {
+			fprintf(stderr, "Failed to read PGN '%s'\n", filename);
+			fprintf(stderr, "%s\n", error->message);
+
+			return 1;
+		}
+
+		for (size_t i = 0; i < count; i++) {
+			if (!pgn_writer_write(writer, &pgns[i], &error)) {
+				fprintf(stderr, "%s\n", error->message);
+
+				return 1;
+			}
+
+			free_pgn(&pgns[i]);
+		}
+
+		free(pgns);
+
+		return write_output(writer);
+	}
+
+	if (indexed) {
+		PGN_index *index = pgn_index_open(filename, &error);
+		if (index == NULL) {
+			fprintf(stderr, "Failed to index PGN '%s'\n", filename);
+			fprintf(stderr, "%s\n", error->message);
+
+			return 1;
+		}
+
+		for (size_t i = 0; i < pgn_index_game_count(index); i++) {
+			PGN pgn;
+			if (!pgn_index_read_game(index, i, &pgn, &error)) {
+				fprintf(stderr, "Failed to read PGN '%s'\n", filename);
+				fprintf(stderr, "%s\n", error->message);
+
+				return 1;
+			}
+
+			if (!pgn_writer_write(writer, &pgn, &error)) {
+				fprintf(stderr, "%s\n", error->message);
+
+				return 1;
+			}
+
+			free_pgn(&pgn);
+		}
+
+		pgn_index_free(index);
+
+		return write_output(writer);
+	}
+
+	PGN_reader *reader = mapped ?
+		pgn_reader_open_mapped(filename, &error) :
+		pgn_reader_open(filename, &error);
+	if (reader == NULL) {
+		fprintf(stderr, "Failed to open PGN '%s'\n", filename);
 		if (error != NULL)
 			fprintf(stderr, "%s\n", error->message);
 
 		return 1;
 	}
 
-	if (!write_pgn(&pgn, stdout)) {
-		fprintf(stderr, "Failed to write PGN '%s'\n", argv[1]);
+	if (chunk_size != 0)
+		pgn_reader_set_chunk_size(reader, chunk_size);
+
+	PGN pgn;
+	while (pgn_reader_next(reader, &pgn, &error)) {
+		if (!pgn_writer_write(writer, &pgn, &error)) {
+			fprintf(stderr, "%s\n", error->message);
+
+			return 1;
+		}
+
+		free_pgn(&pgn);
+	}
+
+	pgn_reader_close(reader);
+
+	if (error != NULL) {
+		fprintf(stderr, "Failed to read PGN '%s'\n", filename);
+		fprintf(stderr, "%s\n", error->message);
 
 		return 1;
 	}
 
-	return 0;
+	return write_output(writer);
 }
@@ -0,0 +1,170 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "chess/board.h"
+#include "chess/game.h"
+#include "chess/moves.h"
+
+// Times encoding and decoding moves in algebraic notation. Decoding is what
+// most of the time spent replaying games from a PGN goes on, and encoding is
+// what most of the time spent writing them goes on. The moves come from
+// random games, so that all the awkward cases (disambiguation, promotions,
+// en passant, castling, checks) turn up. Every decoded move is checked
+// against the move its notation was made from.
+
+#define MAX_PLIES 200
+
+typedef struct Random_game
+{
+	Game *game;
+	uint length;
+	Move moves[MAX_PLIES];
+	char notation[MAX_PLIES][MAX_ALGEBRAIC_NOTATION_LENGTH];
+} Random_game;
+
+// A fixed seed, so that every run decodes the same moves
+static uint64_t random_state = 0x9E3779B97F4A7C15ull;
+
+// xorshift64*
+static uint64_t next_random(void)
+{
+	random_state ^= random_state >> 12;
+	random_state ^= random_state << 25;
+	random_state ^= random_state >> 27;
+
+	return random_state * 0x2545F4914F6CDD1Dull;
+}
+
+static void generate_game(Random_game *game)
+{
+	Board board;
+	from_fen(&board, start_board_fen);
+
+	game->game = new_game();
+	set_checkpoint_interval(game->game, DEFAULT_CHECKPOINT_INTERVAL);
+	from_fen(game->game->board, start_board_fen);
+	Game *node = game->game;
+
+	game->length = 0;
+	while (game->length < MAX_PLIES) {
+		Move_list moves;
+		generate_legal_moves(&board, &moves);
+		if (moves.count == 0)
+			break;
+
+		Move m = moves.moves[next_random() % moves.count];
+		game->moves[game->length++] = m;
+		node = add_child(node, m);
+
+		perform_move(&board, m);
+	}
+}
+
+// Writes out the notation for every game. Returns the number of games that
+// didn't come out the right length.
+static uint encode_games(Random_game *games, uint count, uint64_t *encoded)
+{
+	uint failures = 0;
+
+	for (uint i = 0; i < count; i++) {
+		Random_game *game = &games[i];
+		uint length = mainline_notation(game->game, game->notation, MAX_PLIES);
+		*encoded += length;
+
+		if (length != game->length)
+			failures++;
+	}
+
+	return failures;
+}
+
+static void print_rate(const char *what, uint64_t moves, double seconds)
+{
+	printf("%llu moves %s in %.2fs", (unsigned long long)moves, what, seconds);
+	if (seconds > 0)
+		printf(", %.0f moves/sec", moves / seconds);
+	putchar('\n');
+}
+
+// Replays every game from its notation. Returns the number of moves that
+// didn't come out as expected.
+static uint decode_games(Random_game *games, uint count, uint64_t *decoded)
+{
+	uint failures = 0;
+
+	for (uint i = 0; i < count; i++) {
+		Random_game *game = &games[i];
+		Board board;
+		from_fen(&board, start_board_fen);
+
+		for (uint j = 0; j < game->length; j++) {
+			const char *notation = game->notation[j];
+			Move m = parse_algebraic_notation(&board, notation,
+					strlen(notation));
+			(*decoded)++;
+
+			if (m != game->moves[j]) {
+				failures++;
+				break;
+			}
+
+			Undo undo;
+			make_move(&board, m, &undo);
+		}
+	}
+
+	return failures;
+}
+
+int main(int argc, char *argv[])
+{
+	uint game_count = argc > 1 ? (uint)atoi(argv[1]) : 1000;
+	uint passes = argc > 2 ? (uint)atoi(argv[2]) : 10;
+	if (game_count == 0 || passes == 0) {
+		fprintf(stderr, "Usage: %s [games] [passes]\n", argv[0]);
+		return 1;
+	}
+
+	Random_game *games = malloc(game_count * sizeof *games);
+	for (uint i = 0; i < game_count; i++)
+		generate_game(&games[i]);
+
+	uint failures = 0;
+	uint64_t encoded = 0;
+	clock_t start = clock();
+
+	for (uint i = 0; i < passes; i++)
+		failures += encode_games(games, game_count, &encoded);
+
+	print_rate("encoded", encoded,
+			(double)(clock() - start) / CLOCKS_PER_SEC);
+
+	if (failures != 0) {
+		printf("%u games encoded with the wrong length\n", failures / passes);
+		return 1;
+	}
+
+	uint64_t decoded = 0;
+	start = clock();
+
+	for (uint i = 0; i < passes; i++)
+		failures += decode_games(games, game_count, &decoded);
+
+	print_rate("decoded", decoded,
+			(double)(clock() - start) / CLOCKS_PER_SEC);
+
+	for (uint i = 0; i < game_count; i++)
+		free_game(games[i].game);
+	free(games);
+
+	if (failures != 0) {
+		printf("%u moves decoded incorrectly\n", failures / passes);
+		return 1;
+	}
+
+	puts("All moves decoded correctly");
+	return 0;
+}
@@ -0,0 +1,158 @@
+#!/bin/bash
+
+cd `dirname $0`
+
+tools=../../tools
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+num_tests=0
+passed=0
+failed=0
+
+start='rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1'
+# After 1. e4 e5 2. Nf3 Nc6, which game 4 gets to by 1. Nf3 Nc6 2. e4 e5
+open_game='r1bqkbnr/pppp1ppp/2n5/4p3/4P3/5N2/PPPP1PPP/RNBQKB1R w KQkq - 2 3'
+# After 1. e4 c5 2. Nf3 Nc6 3. d4 cxd4 4. Nxd4 Nf6
+sicilian='r1bqkb1r/pp1ppppp/2n2n2/8/3NP3/8/PPP2PPP/RNBQKB1R w KQkq - 1 5'
+# Not in any of the games
+nowhere='rnbqkbnr/pppppppp/8/8/8/2P5/PP1PPPPP/RNBQKBNR b KQkq - 0 1'
+
+# Passes if the output of a command is the same as test_files/<name>.out
+check() {
+	name=$1
+	shift
+	num_tests=$((num_tests+1))
+
+	"$@" | diff - "test_files/$name.out"
+	if [ $? -ne 0 ]; then
+		echo
+		echo Failed on $name
+
+		failed=$((failed+1))
+	else
+		passed=$((passed+1))
+	fi
+}
+
+$tools/pgn2db test_files/games.pgn "$tmp/games.db" > /dev/null || exit 1
+
+find_positions() {
+	for fen in "$start" "$open_game" "$sicilian" "$nowhere"; do
+		echo "find-position $fen"
+		$tools/find-position "$tmp/games.db" "$fen"
+		echo
+	done
+}
+
+# Adding games to the explorer file that's already there should count them
+# on top of what it had
+explore() {
+	$tools/explore -a "$tmp/explorer" test_files/games.pgn
+	for fen in "$start" "$open_game" "$nowhere"; do
+		echo "explore $fen"
+		$tools/explore "$tmp/explorer" "$fen"
+		echo
+	done
+
+	$tools/explore -a "$tmp/explorer" test_files/more_games.pgn
+	for fen in "$start" "$open_game"; do
+		echo "explore $fen"
+		$tools/explore "$tmp/explorer" "$fen"
+		echo
+	done
+}
+
+# The games 2000 times over make 132000 positions. With the default budget
+# they're all counted in memory, and with the smallest one they spill in 129
+# runs of 1024, which takes a couple of passes to merge. The counts should
+# come out exactly the same either way, and the runs should all be gone.
+for i in $(seq 2000); do
+	cat test_files/games.pgn
+done > "$tmp/many.pgn"
+
+count_positions() {
+	$tools/count-positions "$tmp/in_memory" "$tmp/many.pgn"
+	$tools/count-positions -m 0.001 -t "$tmp" "$tmp/spilled" "$tmp/many.pgn"
+	for fen in "$start" "$open_game" "$sicilian" "$nowhere"; do
+		echo "count-positions -q $fen"
+		$tools/count-positions -q "$tmp/spilled" "$fen"
+	done
+
+	cmp "$tmp/in_memory" "$tmp/spilled" && echo "Same counts in memory"
+	ls "$tmp" | grep -q '^positions-' && echo "Runs left over"
+}
+
+# Likewise the position index, which should come out the same however many
+# runs its positions were spilled in
+find_position_spilled() {
+	$tools/pgn2db "$tmp/many.pgn" "$tmp/many.db" > /dev/null
+	$tools/find-position "$tmp/many.db" "$sicilian" | tail -n 1
+	mv "$tmp/many.db.positions" "$tmp/in_memory.positions"
+	$tools/find-position -m 0.001 -t "$tmp" "$tmp/many.db" "$sicilian" | tail -n 1
+
+	cmp "$tmp/in_memory.positions" "$tmp/many.db.positions" &&
+		echo "Same index in memory"
+	ls "$tmp" | grep -q '^positions-' && echo "Runs left over"
+}
+
+search() {
+	echo "search-games $@"
+	$tools/search-games "$@" "$tmp/games.db"
+	echo
+}
+
+search_games() {
+	search
+	search -player "Carlsen, Magnus"
+	search -player Carlsen -prefix
+	search -player "Smith, John"
+	search -white "Smith, John" -black "Smith, John"
+	search -black "Carlsen, Magnus"
+	search -player Carl
+	search -event "World Cup"
+	search -event World -prefix
+	search -eco B33
+	search -eco C6 -prefix
+	search -from 2019 -to 2020
+	search -from 2021.07.21
+	search -to 2019.06
+	search -min-elo 2800
+	search -max-elo 2100
+	search -min-elo 2700 -max-elo 2800
+	search -from 2021 -to 2019
+	search -min-elo 2800 -max-elo 2700
+	search -player "Carlsen, Magnus" -event World -prefix -from 2021.08
+	search -result 1-0 -eco C -prefix
+}
+
+# Indexes are rebuilt when the database changes, so check both
+# building them and using them once they're there
+check find-position find_positions
+check find-position find_positions
+check explore explore
+check count-positions count_positions
+check find-position-spilled find_position_spilled
+check search-games search_games
+check search-games search_games
+
+# An index for another database, even an older, smaller one, shouldn't be used
+replaced() {
+	$tools/pgn2db test_files/more_games.pgn "$tmp/games.db" > /dev/null
+	touch -d 2000-01-01 "$tmp/games.db"
+
+	echo "find-position $start"
+	$tools/find-position "$tmp/games.db" "$start"
+	echo
+	search
+}
+
+check replaced replaced
+
+echo
+
+if [ $num_tests -eq $passed ]; then
+	echo "All $num_tests tests passed"
+else
+	echo "$failed / $num_tests tests failed"
+	exit 1
+fi
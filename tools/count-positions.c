@@ -0,0 +1,130 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "chess/board.h"
+#include "chess/pgn.h"
+#include "chess/position_counts.h"
+
+// Counts how many times each position occurs in some PGN files, which can be
+// compressed, however many games they have (see src/chess/position_counts.h).
+//
+//     count-positions [-m <megabytes>] [-n <min count>] [-t <temp dir>]
+//             <counts file> <pgn file>...
+//
+// -m is the memory to use for counting before spilling to temporary files,
+// which can be a fraction so that tiny budgets can be tried out, and -n
+// leaves out positions that occur fewer times than that.
+//
+//     count-positions -q <counts file> <FEN>
+//
+// looks up how many times a position occurred.
+
+#define DEFAULT_MEMORY_MB 256
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-m <megabytes>] [-n <min count>] "
+			"[-t <temp dir>] <counts file> <pgn file>...\n", name);
+	fprintf(stderr, "       %s -q <counts file> <FEN>\n", name);
+}
+
+static int query(const char *counts_filename, const char *fen)
+{
+	Board board;
+	if (!from_fen(&board, fen)) {
+		fprintf(stderr, "Invalid FEN: %s\n", fen);
+		return 1;
+	}
+
+	GError *error = NULL;
+	Position_counts *counts = position_counts_open(counts_filename, &error);
+	if (counts == NULL) {
+		fprintf(stderr, "%s\n", error->message);
+		return 1;
+	}
+
+	printf("%llu\n", (unsigned long long)position_counts_find(counts, board.hash));
+	position_counts_close(counts);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc == 4 && strcmp(argv[1], "-q") == 0)
+		return query(argv[2], argv[3]);
+
+	double memory_mb = DEFAULT_MEMORY_MB;
+	uint64_t min_count = 1;
+	const char *temp_dir = NULL;
+
+	int i = 1;
+	for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+		if (strcmp(argv[i], "-m") == 0)
+			memory_mb = strtod(argv[i + 1], NULL);
+		else if (strcmp(argv[i], "-n") == 0)
+			min_count = strtoull(argv[i + 1], NULL, 10);
+		else if (strcmp(argv[i], "-t") == 0)
+			temp_dir = argv[i + 1];
+		else
+			break;
+	}
+
+	if (argc - i < 2 || !(memory_mb > 0)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	const char *counts_filename = argv[i];
+	Position_counter *counter =
+		position_counter_new((size_t)(memory_mb * 1024 * 1024), temp_dir);
+	GError *error = NULL;
+	size_t games = 0;
+
+	for (i++; i < argc; i++) {
+		PGN_reader *reader = pgn_reader_open(argv[i], &error);
+		if (reader == NULL) {
+			fprintf(stderr, "Failed to open PGN '%s'\n", argv[i]);
+			fprintf(stderr, "%s\n", error->message);
+			position_counter_free(counter);
+
+			return 1;
+		}
+
+		PGN pgn;
+		while (pgn_reader_next(reader, &pgn, &error)) {
+			bool success = position_counter_add_game(counter, pgn.game, &error);
+			free_pgn(&pgn);
+			if (!success)
+				break;
+
+			games++;
+		}
+
+		pgn_reader_close(reader);
+
+		if (error != NULL) {
+			fprintf(stderr, "Failed to count '%s' after %zu games\n",
+					argv[i], games);
+			fprintf(stderr, "%s\n", error->message);
+			position_counter_free(counter);
+
+			return 1;
+		}
+	}
+
+	if (!position_counter_write(counter, counts_filename, min_count, &error)) {
+		fprintf(stderr, "Failed to write '%s'\n", counts_filename);
+		fprintf(stderr, "%s\n", error->message);
+		position_counter_free(counter);
+
+		return 1;
+	}
+
+	position_counter_free(counter);
+	printf("Counted %zu games\n", games);
+
+	return 0;
+}
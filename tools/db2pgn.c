@@ -0,0 +1,70 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib.h>
+#include "chess/database.h"
+#include "chess/pgn.h"
+
+// Converts a game database (see src/chess/database.h) back into PGN, which is
+// written to standard output unless a file is given.
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr, "Usage: %s <database file> [pgn file]\n", argv[0]);
+		return 1;
+	}
+
+	const char *db_filename = argv[1];
+	GError *error = NULL;
+
+	Game_db *db = game_db_open(db_filename, &error);
+	if (db == NULL) {
+		fprintf(stderr, "Failed to open database '%s'\n", db_filename);
+		fprintf(stderr, "%s\n", error->message);
+
+		return 1;
+	}
+
+	FILE *pgn_file = argc == 3 ? fopen(argv[2], "w") : stdout;
+	if (pgn_file == NULL) {
+		fprintf(stderr, "Couldn't open '%s' for writing\n", argv[2]);
+
+		return 1;
+	}
+
+	PGN_writer *writer = pgn_writer_new(pgn_file);
+
+	for (size_t i = 0; i < game_db_game_count(db); i++) {
+		PGN pgn;
+		if (!game_db_read_game(db, i, &pgn, &error)) {
+			fprintf(stderr, "Failed to read game %zu\n", i + 1);
+			fprintf(stderr, "%s\n", error->message);
+
+			return 1;
+		}
+
+		if (!pgn_writer_write(writer, &pgn, &error)) {
+			fprintf(stderr, "%s\n", error->message);
+
+			return 1;
+		}
+
+		free_pgn(&pgn);
+	}
+
+	game_db_close(db);
+
+	if (!pgn_writer_close(writer, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+
+		return 1;
+	}
+	if (pgn_file != stdout && fclose(pgn_file) != 0) {
+		fprintf(stderr, "Failed to write PGN\n");
+
+		return 1;
+	}
+
+	return 0;
+}
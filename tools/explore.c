@@ -0,0 +1,140 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "chess/board.h"
+#include "chess/explorer.h"
+#include "chess/moves.h"
+#include "chess/pgn.h"
+
+// An opening explorer (see src/chess/explorer.h) on the command line.
+//
+//     explore -a <explorer file> <pgn file>...
+//
+// adds the games in some PGN files, which can be compressed, to an explorer
+// file, creating it if it doesn't exist yet, and
+//
+//     explore <explorer file> <FEN>
+//
+// lists the moves played from a position.
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s -a <explorer file> <pgn file>...\n", name);
+	fprintf(stderr, "       %s <explorer file> <FEN>\n", name);
+}
+
+static int add_games(const char *explorer_filename, int pgn_count,
+		char *pgn_filenames[])
+{
+	GError *error = NULL;
+	Explorer *explorer;
+	if (g_file_test(explorer_filename, G_FILE_TEST_EXISTS))
+		explorer = explorer_load(explorer_filename, &error);
+	else
+		explorer = explorer_new();
+
+	if (explorer == NULL) {
+		fprintf(stderr, "%s\n", error->message);
+		return 1;
+	}
+
+	size_t games = 0;
+	for (int i = 0; i < pgn_count; i++) {
+		PGN_reader *reader = pgn_reader_open(pgn_filenames[i], &error);
+		if (reader == NULL) {
+			fprintf(stderr, "Failed to open PGN '%s'\n", pgn_filenames[i]);
+			fprintf(stderr, "%s\n", error->message);
+
+			return 1;
+		}
+
+		PGN pgn;
+		while (pgn_reader_next(reader, &pgn, &error)) {
+			explorer_add_game(explorer, &pgn);
+			free_pgn(&pgn);
+			games++;
+		}
+
+		pgn_reader_close(reader);
+
+		// Nothing is saved if any of the files can't be read, so that it's
+		// safe to just run this again once it's fixed
+		if (error != NULL) {
+			fprintf(stderr, "Failed to read '%s'\n", pgn_filenames[i]);
+			fprintf(stderr, "%s\n", error->message);
+
+			return 1;
+		}
+	}
+
+	if (!explorer_save(explorer, explorer_filename, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		return 1;
+	}
+
+	printf("Added %zu games\n", games);
+	explorer_free(explorer);
+
+	return 0;
+}
+
+static double average(uint64_t total, uint32_t count)
+{
+	return count == 0 ? 0 : (double)total / count;
+}
+
+static double percent(uint32_t n, uint32_t games)
+{
+	return 100.0 * n / games;
+}
+
+static int show_moves(const char *explorer_filename, const char *fen)
+{
+	Board board;
+	if (!from_fen(&board, fen)) {
+		fprintf(stderr, "Invalid FEN: %s\n", fen);
+		return 1;
+	}
+
+	GError *error = NULL;
+	Explorer *explorer = explorer_load(explorer_filename, &error);
+	if (explorer == NULL) {
+		fprintf(stderr, "%s\n", error->message);
+		return 1;
+	}
+
+	Explorer_move_list list;
+	explorer_lookup(explorer, board.hash, &list);
+
+	printf("%-8s %8s %7s %7s %7s %6s %6s\n", "Move", "Games",
+			"White", "Draw", "Black", "WElo", "BElo");
+	for (uint i = 0; i < list.count; i++) {
+		Explorer_move *m = &list.moves[i];
+		char notation[MAX_ALGEBRAIC_NOTATION_LENGTH];
+		algebraic_notation_for(&board, m->move, notation);
+
+		printf("%-8s %8u %6.1f%% %6.1f%% %6.1f%% %6.0f %6.0f\n", notation,
+				m->games, percent(m->white_wins, m->games),
+				percent(m->draws, m->games), percent(m->black_wins, m->games),
+				average(m->white_elo_total, m->white_rated),
+				average(m->black_elo_total, m->black_rated));
+	}
+
+	explorer_free(explorer);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc >= 4 && strcmp(argv[1], "-a") == 0)
+		return add_games(argv[2], argc - 3, argv + 3);
+	if (argc == 3 && argv[1][0] != '-')
+		return show_moves(argv[1], argv[2]);
+
+	usage(argv[0]);
+	return 1;
+}
@@ -0,0 +1,151 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "chess/board.h"
+#include "chess/database.h"
+#include "chess/pgn.h"
+#include "chess/positions.h"
+
+// Lists every game in a game database that reaches a position, given as a
+// FEN string. The first time, this builds an index of all the positions in
+// the database, which is saved next to it as <database>.positions, and then
+// used again until the database changes (see Game_db_stamp).
+//
+//     find-position [-m <megabytes>] [-t <temp dir>] <database file> <FEN>
+//
+// -m and -t are the memory to use for building the index before spilling to
+// temporary files, and where to put them, as in count-positions.
+
+#define DEFAULT_MEMORY_MB 256
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-m <megabytes>] [-t <temp dir>] "
+			"<database file> <FEN>\n", name);
+}
+
+static bool build_index(Game_db *db, const char *index_filename,
+		size_t memory_budget, const char *temp_dir, GError **error)
+{
+	Position_index_builder *builder =
+		position_index_builder_new(memory_budget, temp_dir);
+
+	for (size_t i = 0; i < game_db_game_count(db); i++) {
+		PGN pgn;
+		if (!game_db_read_game(db, i, &pgn, error)) {
+			position_index_builder_free(builder);
+			return false;
+		}
+
+		bool success = position_index_add_game(builder, i, pgn.game, error);
+		free_pgn(&pgn);
+		if (!success) {
+			position_index_builder_free(builder);
+			return false;
+		}
+	}
+
+	Game_db_stamp stamp = game_db_stamp(db);
+	bool success = position_index_write(builder, &stamp, index_filename, error);
+	position_index_builder_free(builder);
+
+	return success;
+}
+
+int main(int argc, char *argv[])
+{
+	double memory_mb = DEFAULT_MEMORY_MB;
+	const char *temp_dir = NULL;
+
+	int i = 1;
+	for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+		if (strcmp(argv[i], "-m") == 0)
+			memory_mb = strtod(argv[i + 1], NULL);
+		else if (strcmp(argv[i], "-t") == 0)
+			temp_dir = argv[i + 1];
+		else
+			break;
+	}
+
+	if (argc - i != 2 || !(memory_mb > 0)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	const char *db_filename = argv[i];
+	const char *fen = argv[i + 1];
+	Board board;
+	if (!from_fen(&board, fen)) {
+		fprintf(stderr, "Invalid FEN: %s\n", fen);
+		return 1;
+	}
+
+	GError *error = NULL;
+	Game_db *db = game_db_open(db_filename, &error);
+	if (db == NULL) {
+		fprintf(stderr, "Failed to open database '%s'\n", db_filename);
+		fprintf(stderr, "%s\n", error->message);
+
+		return 1;
+	}
+
+	// If there's no index, or it can't be read, it just gets built again
+	char *index_filename = g_strdup_printf("%s.positions", db_filename);
+	Position_index *index = position_index_open(index_filename, NULL);
+	if (index == NULL ||
+			!game_db_stamp_matches(db, position_index_stamp(index))) {
+		if (index != NULL)
+			position_index_close(index);
+
+		if (!build_index(db, index_filename,
+					(size_t)(memory_mb * 1024 * 1024), temp_dir, &error)) {
+			fprintf(stderr, "Failed to index '%s'\n", db_filename);
+			fprintf(stderr, "%s\n", error->message);
+
+			return 1;
+		}
+
+		index = position_index_open(index_filename, &error);
+		if (index == NULL) {
+			fprintf(stderr, "%s\n", error->message);
+			return 1;
+		}
+	}
+
+	Position_match *matches;
+	size_t count = position_index_find(index, board.hash, &matches);
+
+	for (size_t i = 0; i < count; i++) {
+		// Only a damaged index could have these, but they'd be out of bounds
+		if (matches[i].game >= game_db_game_count(db)) {
+			fprintf(stderr, "'%s' refers to games that aren't there\n",
+					index_filename);
+			return 1;
+		}
+
+		PGN pgn;
+		if (!game_db_read_game(db, matches[i].game, &pgn, &error)) {
+			fprintf(stderr, "%s\n", error->message);
+			return 1;
+		}
+
+		const char *white = pgn_tag(&pgn, TAG_WHITE);
+		const char *black = pgn_tag(&pgn, TAG_BLACK);
+		printf("Game %u (%s - %s), ply %u\n", matches[i].game + 1,
+				white == NULL ? "?" : white, black == NULL ? "?" : black,
+				matches[i].ply);
+
+		free_pgn(&pgn);
+	}
+
+	printf("%zu matches\n", count);
+
+	free(matches);
+	position_index_close(index);
+	game_db_close(db);
+	g_free(index_filename);
+
+	return 0;
+}
@@ -0,0 +1,80 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "chess/database.h"
+#include "chess/pgn.h"
+
+// Converts a PGN file, which can be compressed, into a game database (see
+// src/chess/database.h).
+
+int main(int argc, char *argv[])
+{
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <pgn file> <database file>\n", argv[0]);
+		return 1;
+	}
+
+	const char *pgn_filename = argv[1];
+	const char *db_filename = argv[2];
+	GError *error = NULL;
+
+	PGN_reader *reader = pgn_reader_open(pgn_filename, &error);
+	if (reader == NULL) {
+		fprintf(stderr, "Failed to open PGN '%s'\n", pgn_filename);
+		fprintf(stderr, "%s\n", error->message);
+
+		return 1;
+	}
+
+	FILE *db_file = fopen(db_filename, "wb");
+	if (db_file == NULL) {
+		fprintf(stderr, "Couldn't open '%s' for writing\n", db_filename);
+		pgn_reader_close(reader);
+
+		return 1;
+	}
+
+	Game_db_writer *writer = game_db_writer_new(db_file);
+	size_t games = 0;
+
+	PGN pgn;
+	while (pgn_reader_next(reader, &pgn, &error)) {
+		bool success = game_db_writer_add(writer, &pgn, &error);
+		free_pgn(&pgn);
+		if (!success)
+			break;
+
+		games++;
+	}
+
+	pgn_reader_close(reader);
+
+	// A database with only some of the games would look just as good as a
+	// complete one, so it's deleted
+	if (error != NULL) {
+		fprintf(stderr, "Failed to convert '%s' after %zu games\n",
+				pgn_filename, games);
+		fprintf(stderr, "%s\n", error->message);
+		game_db_writer_free(writer);
+		fclose(db_file);
+		g_remove(db_filename);
+
+		return 1;
+	}
+
+	bool written = game_db_writer_close(writer, &error);
+	if (fclose(db_file) != 0 || !written) {
+		fprintf(stderr, "Failed to write '%s'\n", db_filename);
+		if (error != NULL)
+			fprintf(stderr, "%s\n", error->message);
+		g_remove(db_filename);
+
+		return 1;
+	}
+
+	printf("Converted %zu games\n", games);
+
+	return 0;
+}
@@ -0,0 +1,172 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "chess/database.h"
+#include "chess/pgn.h"
+#include "chess/tag_index.h"
+#include "chess/tags.h"
+
+// Lists the games in a game database that match some tags. The first time,
+// this builds an index of the tags (see src/chess/tag_index.h), which is
+// saved next to the database as <database>.tags, and then used again until
+// the database changes (see Game_db_stamp).
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options] <database file>\n", name);
+	fprintf(stderr,
+			"  -player <name>   games played by someone, as either colour\n"
+			"  -white <name>    games with this White tag\n"
+			"  -black <name>    games with this Black tag\n"
+			"  -event <name>    games with this Event tag\n"
+			"  -eco <code>      games with this ECO tag\n"
+			"  -prefix          match names, events and ECO codes by prefix\n"
+			"  -from <date>     games on or after a date, like 2020 or 2020.06.01\n"
+			"  -to <date>       games on or before a date\n"
+			"  -min-elo <elo>   games where both players are rated at least this\n"
+			"  -max-elo <elo>   games where both players are rated at most this\n"
+			"  -result <result> games with this result: 1-0, 0-1, 1/2-1/2 or *\n");
+}
+
+// The last day a date could mean, for a date range ending on it
+static uint32_t end_of(uint32_t date)
+{
+	if (date % 10000 == 0)
+		return date + 1231;
+	if (date % 100 == 0)
+		return date + 31;
+
+	return date;
+}
+
+static bool parse_result(const char *str, Result *result)
+{
+	const char *results[] = { "1-0", "0-1", "1/2-1/2", "*" };
+	for (uint i = 0; i < sizeof results / sizeof results[0]; i++) {
+		if (strcmp(str, results[i]) == 0) {
+			*result = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Fills in the query from the options, and returns the index of the first
+// argument that isn't one, or 0 if they don't make sense.
+static int parse_options(int argc, char *argv[], Game_query *query)
+{
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		const char *option = argv[i];
+		if (strcmp(option, "-prefix") == 0) {
+			query->prefix_match = true;
+			continue;
+		}
+
+		if (i + 1 == argc)
+			return 0;
+		const char *arg = argv[++i];
+
+		if (strcmp(option, "-player") == 0)
+			query->player = arg;
+		else if (strcmp(option, "-white") == 0)
+			query->white = arg;
+		else if (strcmp(option, "-black") == 0)
+			query->black = arg;
+		else if (strcmp(option, "-event") == 0)
+			query->event = arg;
+		else if (strcmp(option, "-eco") == 0)
+			query->eco = arg;
+		else if (strcmp(option, "-from") == 0)
+			query->min_date = parse_date_tag(arg);
+		else if (strcmp(option, "-to") == 0)
+			query->max_date = end_of(parse_date_tag(arg));
+		else if (strcmp(option, "-min-elo") == 0)
+			query->min_elo = strtoul(arg, NULL, 10);
+		else if (strcmp(option, "-max-elo") == 0)
+			query->max_elo = strtoul(arg, NULL, 10);
+		else if (strcmp(option, "-result") != 0 ||
+				!parse_result(arg, &query->result))
+			return 0;
+	}
+
+	return i;
+}
+
+static const char *tag_or_unknown(PGN *pgn, Tag_name name)
+{
+	const char *value = pgn_tag(pgn, name);
+	return value == NULL ? "?" : value;
+}
+
+int main(int argc, char *argv[])
+{
+	Game_query query;
+	game_query_init(&query);
+	int first_arg = parse_options(argc, argv, &query);
+	if (first_arg == 0 || first_arg != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	const char *db_filename = argv[first_arg];
+	GError *error = NULL;
+	Game_db *db = game_db_open(db_filename, &error);
+	if (db == NULL) {
+		fprintf(stderr, "Failed to open database '%s'\n", db_filename);
+		fprintf(stderr, "%s\n", error->message);
+
+		return 1;
+	}
+
+	// If there's no index, or it can't be read, it just gets built again
+	char *index_filename = g_strdup_printf("%s.tags", db_filename);
+	Tag_index *index = tag_index_open(index_filename, NULL);
+	if (index == NULL || !game_db_stamp_matches(db, tag_index_stamp(index))) {
+		if (index != NULL)
+			tag_index_close(index);
+
+		if (!tag_index_build(db, index_filename, &error)) {
+			fprintf(stderr, "Failed to index '%s'\n", db_filename);
+			fprintf(stderr, "%s\n", error->message);
+
+			return 1;
+		}
+
+		index = tag_index_open(index_filename, &error);
+		if (index == NULL) {
+			fprintf(stderr, "%s\n", error->message);
+			return 1;
+		}
+	}
+
+	uint32_t *games;
+	size_t count = tag_index_search(index, &query, &games);
+
+	for (size_t i = 0; i < count; i++) {
+		PGN pgn;
+		if (!game_db_read_tags(db, games[i], &pgn, &error)) {
+			fprintf(stderr, "%s\n", error->message);
+			return 1;
+		}
+
+		printf("Game %u (%s - %s), %s, %s, %s\n", games[i] + 1,
+				tag_or_unknown(&pgn, TAG_WHITE), tag_or_unknown(&pgn, TAG_BLACK),
+				tag_or_unknown(&pgn, TAG_EVENT), tag_or_unknown(&pgn, TAG_DATE),
+				tag_or_unknown(&pgn, TAG_RESULT));
+
+		free_pgn(&pgn);
+	}
+
+	printf("%zu games\n", count);
+
+	free(games);
+	tag_index_close(index);
+	game_db_close(db);
+	g_free(index_filename);
+
+	return 0;
+}